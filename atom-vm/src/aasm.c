@@ -1,15 +1,98 @@
 #include "assembler.h"
 #include "bytecode.h"
+#include "cgen.h"
+#include "inliner.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
 
-int main(void)
+static void usage(const char *name)
 {
-    Byte_Code *bc = asm_compile("examples/func.atom", 1);
-    bc_dump(bc, "test.S");
-    bc_free(bc);
-    Byte_Code *read_code = bc_load("test.S");
-    if (!read_code)
+    fprintf(stderr,
+            "usage: %s [--emit-c] [-o <output>] [--memory <words>] "
+            "[--stack <words>] [--call-stack <words>] "
+            "[--inline <instructions>] <source.atom>\n",
+            name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    char *source_path = NULL;
+    char *output_path = NULL;
+    bool emit_c       = false;
+    size_t inline_max = 0;
+    // Sizes recorded in the bytecode header, 0 keeps the defaults
+    Word memory_size     = 0;
+    Word stack_size      = 0;
+    Word call_stack_size = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp("--emit-c", argv[i]) == 0) {
+            emit_c = true;
+        } else if (strcmp("-o", argv[i]) == 0 && i + 1 < argc) {
+            output_path = argv[++i];
+        } else if (strcmp("--inline", argv[i]) == 0 && i + 1 < argc) {
+            inline_max = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp("--memory", argv[i]) == 0 && i + 1 < argc) {
+            memory_size = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp("--stack", argv[i]) == 0 && i + 1 < argc) {
+            stack_size = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp("--call-stack", argv[i]) == 0 && i + 1 < argc) {
+            call_stack_size = strtoull(argv[++i], NULL, 10);
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+        } else {
+            source_path = argv[i];
+        }
+    }
+
+    if (!source_path)
+        usage(argv[0]);
+
+    Byte_Code *bc = asm_compile(source_path, 0);
+    if (!bc)
         exit(EXIT_FAILURE);
-    asm_disassemble(read_code);
-    bc_free(read_code);
-    return 0;
+
+    if (memory_size)
+        bc->memory_size = memory_size;
+    if (stack_size)
+        bc->stack_size = stack_size;
+    if (call_stack_size)
+        bc->call_stack_size = call_stack_size;
+
+    inline_procedures(bc, inline_max);
+
+    int err = 0;
+    if (emit_c) {
+        // The generated C goes to stdout unless asked otherwise, ready to be
+        // piped to the compiler
+        FILE *out = output_path ? fopen(output_path, "w") : stdout;
+        if (!out) {
+            fprintf(stderr, "unable to open %s\n", output_path);
+            bc_free(bc);
+            exit(EXIT_FAILURE);
+        }
+        err = cgen_emit(bc, out);
+        if (out != stdout)
+            fclose(out);
+    } else {
+        const char *path = output_path ? output_path : "a.S";
+        if (bc_dump(bc, path) < 0) {
+            fprintf(stderr, "unable to write %s\n", path);
+            bc_free(bc);
+            exit(EXIT_FAILURE);
+        }
+        Byte_Code *read_code = bc_load(path, false);
+        if (!read_code) {
+            bc_free(bc);
+            exit(EXIT_FAILURE);
+        }
+        asm_disassemble(read_code);
+        bc_free(read_code);
+    }
+
+    bc_free(bc);
+
+    return err < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -2,6 +2,55 @@
 #include "bytecode.h"
 #include "parser.h"
 
+size_t asm_disassemble_instruction(const Byte_Code *bc, size_t i)
+{
+    Word op = bc->code_segment->data[i];
+    if (op >= NUM_INSTRUCTIONS) {
+        printf("\t%04lX %-11s", i, "???");
+        return i + 1;
+    }
+
+    printf("\t%04lX %-11s", i, instructions_table[op]);
+    if (bc_nary_instruction(op)) {
+        switch (op) {
+        case OP_PUSH:
+            printf(" @%04llX", bc->code_segment->data[++i]);
+            break;
+        case OP_CALL:
+        case OP_SPAWN:
+            printf(" (%04llX)", bc->code_segment->data[++i]);
+            break;
+        case OP_JEQ_I:
+        case OP_JNE_I:
+        case OP_JLT_I:
+        case OP_JLE_I:
+        case OP_JGT_I:
+        case OP_JGE_I:
+            printf(" %04llu,", bc->code_segment->data[++i]);
+            printf(" [%02llu]", bc->code_segment->data[++i]);
+            break;
+        case OP_LOAD_IDXS:
+        case OP_STORE_IDXS:
+            printf(" [%02llu],", bc->code_segment->data[++i]);
+            printf(" %llu", bc->code_segment->data[++i]);
+            break;
+        case OP_JMP:
+        case OP_JNE:
+        case OP_JEQ:
+        case OP_LOAD_CONST:
+        case OP_STORE_CONST:
+        case OP_LOAD_IDX:
+        case OP_STORE_IDX:
+            printf(" [%02llu]", bc->code_segment->data[++i]);
+            break;
+        default:
+            printf(" %04llu", bc->code_segment->data[++i]);
+            break;
+        }
+    }
+    return i + 1;
+}
+
 void asm_disassemble(const Byte_Code *bc)
 {
     size_t i = 0;
@@ -26,32 +75,11 @@ void asm_disassemble(const Byte_Code *bc)
     while (i < bc->code_segment->length) {
         if (bc->entry_point == i)
             printf(".main\n");
-        printf("\t%04lX %-11s", i,
-               instructions_table[bc->code_segment->data[i]]);
-        if (bc->code_segment->data[i] == OP_RET)
+        Word op = bc->code_segment->data[i];
+        i       = asm_disassemble_instruction(bc, i);
+        if (op == OP_RET)
             printf("\n");
-        if (bc_nary_instruction(bc->code_segment->data[i])) {
-            switch (bc->code_segment->data[i]) {
-            case OP_PUSH:
-                printf(" @%04llX", bc->code_segment->data[++i]);
-                break;
-            case OP_CALL:
-                printf(" (%04llX)", bc->code_segment->data[++i]);
-                break;
-            case OP_JMP:
-            case OP_JNE:
-            case OP_JEQ:
-            case OP_LOAD_CONST:
-            case OP_STORE_CONST:
-                printf(" [%02llu]", bc->code_segment->data[++i]);
-                break;
-            default:
-                printf(" %04llu", bc->code_segment->data[++i]);
-                break;
-            }
-        }
         printf("\n");
-        i++;
     }
 }
 
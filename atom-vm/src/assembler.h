@@ -1,6 +1,8 @@
 #ifndef ASSEMBLER_H
 #define ASSEMBLER_H
 
+#include <stddef.h>
+
 typedef struct bytecode Byte_Code;
 
 Byte_Code *asm_compile(const char *path, int debug);
@@ -8,4 +10,8 @@ Byte_Code *asm_compile_from_stdin(int debug);
 
 void asm_disassemble(const Byte_Code *bc);
 
+// Print a single instruction at the given offset, without a trailing newline,
+// returns the offset of the following instruction
+size_t asm_disassemble_instruction(const Byte_Code *bc, size_t offset);
+
 #endif
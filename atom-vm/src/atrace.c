@@ -0,0 +1,71 @@
+#include "assembler.h"
+#include "bytecode.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// Offline decoder for the binary traces produced by `atom-vm --trace`, the
+// records are rendered oldest first against the program that generated them
+int main(int argc, char **argv)
+{
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <trace-file> <source.atom>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *fp = fopen(argv[1], "rb");
+    if (!fp) {
+        fprintf(stderr, "unable to open trace file %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    Trace_Header header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+        fprintf(stderr, "%s is not a valid trace file\n", argv[1]);
+        fclose(fp);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t count = header.total < header.capacity ? header.total
+                                                    : header.capacity;
+    Trace_Record *records = calloc(count ? count : 1, sizeof(*records));
+    if (!records || fread(records, sizeof(*records), count, fp) != count) {
+        fprintf(stderr, "truncated trace file %s\n", argv[1]);
+        free(records);
+        fclose(fp);
+        return EXIT_FAILURE;
+    }
+    fclose(fp);
+
+    Byte_Code *bc = asm_compile(argv[2], 0);
+    if (!bc) {
+        fprintf(stderr, "unable to assemble %s\n", argv[2]);
+        free(records);
+        return EXIT_FAILURE;
+    }
+
+    printf("%llu instructions executed, showing the last %llu\n\n",
+           header.total, count);
+
+    // When the ring wrapped around, the oldest record sits right after the
+    // most recently written one
+    uint64_t start = header.total > header.capacity
+                         ? header.total & (header.capacity - 1)
+                         : 0;
+    for (uint64_t i = 0; i < count; ++i) {
+        const Trace_Record *r = &records[(start + i) & (header.capacity - 1)];
+        printf("%10llu", header.total - count + i);
+        if (r->pc < bc->code_segment->length &&
+            bc->code_segment->data[r->pc] == r->opcode)
+            asm_disassemble_instruction(bc, r->pc);
+        else
+            printf("\t%04X %-11s %04u", r->pc, "???", r->opcode);
+        printf("\t; tos = %llu\n", r->tos);
+    }
+
+    bc_free(bc);
+    free(records);
+
+    return EXIT_SUCCESS;
+}
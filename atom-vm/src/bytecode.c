@@ -4,15 +4,38 @@
 #include <string.h>
 
 const char *const instructions_table[] = {
-    "LOAD",       "LOAD_CONST",  "STORE", "STORE_CONST", "CALL", "PUSH",
-    "PUSH_CONST", "ADD",         "SUB",   "MUL",         "DIV",  "DUP",
-    "INC",        "EQ",          "JMP",   "JEQ",         "JNE",  "MAKE_TUPLE",
-    "PRINT",      "PRINT_CONST", "RET",   "HALT",        NULL};
+    "LOAD",       "LOAD_CONST",  "STORE", "STORE_CONST", "CALL",  "PUSH",
+    "PUSH_CONST", "ADD",         "SUB",   "MUL",         "DIV",   "DUP",
+    "INC",        "EQ",          "JMP",   "JEQ",         "JNE",   "MAKE_TUPLE",
+    "PRINT",      "PRINT_CONST", "RET",   "HALT",        "SWAP",  "OVER",
+    "ROT",        "DROP",        "PICK",  "ADD_I",       "SUB_I", "MUL_I",
+    "LT",         "GT",          "LE",    "GE",          "JEQ_I", "JNE_I",
+    "JLT_I",      "JLE_I",       "JGT_I", "JGE_I",       "LOAD_PROC",
+    "MAP_NEW",    "MAP_PUT",     "MAP_GET", "MAP_DEL",   "MAP_LEN",
+    "LOAD_IDX",   "STORE_IDX",   "LOAD_IDXS", "STORE_IDXS", "SPAWN",
+    "SYNC",       NULL};
+
+static const uint8_t instructions_arity[NUM_INSTRUCTIONS] = {
+    [OP_LOAD_CONST] = 1, [OP_STORE_CONST] = 1, [OP_CALL] = 1,
+    [OP_PUSH] = 1,       [OP_PUSH_CONST] = 1,  [OP_JMP] = 1,
+    [OP_JEQ] = 1,        [OP_JNE] = 1,         [OP_MAKE_TUPLE] = 1,
+    [OP_PICK] = 1,       [OP_ADD_I] = 1,       [OP_SUB_I] = 1,
+    [OP_MUL_I] = 1,      [OP_JEQ_I] = 2,       [OP_JNE_I] = 2,
+    [OP_JLT_I] = 2,      [OP_JLE_I] = 2,       [OP_JGT_I] = 2,
+    [OP_JGE_I] = 2,      [OP_LOAD_IDX] = 1,    [OP_STORE_IDX] = 1,
+    [OP_LOAD_IDXS] = 2,  [OP_STORE_IDXS] = 2,  [OP_SPAWN] = 1,
+};
+
+size_t bc_instruction_arity(Instruction_ID instr)
+{
+    if (instr >= NUM_INSTRUCTIONS)
+        return 0;
+    return instructions_arity[instr];
+}
 
 bool bc_nary_instruction(Instruction_ID instr)
 {
-    return (instr > OP_LOAD && instr < OP_ADD) ||
-           (instr > OP_EQ && instr < OP_PRINT);
+    return bc_instruction_arity(instr) > 0;
 }
 
 static Word_Segment *word_segment_create(void)
@@ -39,6 +62,18 @@ static Data_Segment *data_segment_create(void)
     return d;
 }
 
+static Procedures *procedures_create(void)
+{
+    Procedures *p = calloc(1, sizeof(*p));
+    if (!p)
+        return NULL;
+
+    size_t capacity = 4;
+    da_init(p, capacity);
+
+    return p;
+}
+
 static void word_segment_free(Word_Segment *c)
 {
     free(c->data);
@@ -51,6 +86,12 @@ static void data_segment_free(Data_Segment *d)
     free(d);
 }
 
+static void procedures_free(Procedures *p)
+{
+    free(p->data);
+    free(p);
+}
+
 static Labels *labels_create(void)
 {
     Labels *l = calloc(1, sizeof(*l));
@@ -69,8 +110,11 @@ Byte_Code *bc_create(void)
     if (!bc)
         return NULL;
 
-    bc->entry_point  = 0;
-    bc->code_segment = word_segment_create();
+    bc->entry_point     = 0;
+    bc->memory_size     = DEFAULT_MEMORY_SIZE;
+    bc->stack_size      = DEFAULT_STACK_SIZE;
+    bc->call_stack_size = DEFAULT_CALL_STACK_SIZE;
+    bc->code_segment    = word_segment_create();
     if (!bc->code_segment)
         goto error;
 
@@ -82,7 +126,11 @@ Byte_Code *bc_create(void)
     bc->data_segment->rd_string_addr_offset = DATA_STRING_OFFSET;
     bc->data_segment->rw_data_addr_offset   = DATA_STRING_OFFSET * 2;
 
-    bc->labels                              = labels_create();
+    bc->procedures                          = procedures_create();
+    if (!bc->procedures)
+        goto error;
+
+    bc->labels = labels_create();
     if (!bc->labels)
         goto error;
 
@@ -97,7 +145,10 @@ void bc_free(Byte_Code *bc)
 {
     word_segment_free(bc->code_segment);
     data_segment_free(bc->data_segment);
+    procedures_free(bc->procedures);
     labels_free(bc->labels);
+    if (bc->source)
+        fclose(bc->source);
     free(bc);
 }
 
@@ -123,27 +174,98 @@ static uint64_t read_u64(uint8_t *buf)
            ((uint64_t)buf[6] << 8) | buf[7];
 }
 
-void bc_dump(const Byte_Code *bc, const char *path)
+#define BC_PURE_BIT (1ULL << 63)
+
+static size_t padded_length(size_t length)
+{
+    return (length + sizeof(Word) - 1) & ~(sizeof(Word) - 1);
+}
+
+static int write_word(FILE *fp, Word value)
+{
+    uint8_t buffer[sizeof(uint64_t)] = {0};
+    write_u64(buffer, value);
+    return fwrite(buffer, sizeof(buffer), 1, fp) == 1 ? 0 : -1;
+}
+
+static int read_word(FILE *fp, Word *value)
+{
+    uint8_t buffer[sizeof(uint64_t)] = {0};
+    if (fread(buffer, sizeof(buffer), 1, fp) != 1)
+        return -1;
+    *value = read_u64(buffer);
+    return 0;
+}
+
+int bc_dump(const Byte_Code *bc, const char *path)
 {
     if (!path)
-        return;
+        return -1;
 
     FILE *fp = fopen(path, "wb");
     if (!fp)
-        return;
-
-    uint8_t buffer[sizeof(uint64_t)] = {0};
+        return -1;
+
+    const Word header[] = {BC_MAGIC,
+                           BC_VERSION,
+                           bc->entry_point,
+                           bc->memory_size,
+                           bc->stack_size,
+                           bc->call_stack_size,
+                           bc->code_segment->length,
+                           bc->data_segment->length,
+                           bc->procedures->length};
+
+    int err             = 0;
+    for (size_t i = 0; i < sizeof(header) / sizeof(*header); ++i)
+        err |= write_word(fp, header[i]);
+
+    for (size_t i = 0; i < bc->procedures->length; ++i) {
+        const Procedure *proc = &bc->procedures->data[i];
+        err |= write_word(fp, proc->start);
+        err |= write_word(fp, proc->end);
+        err |= write_word(fp, proc->arity | (proc->pure ? BC_PURE_BIT : 0));
+    }
 
-    for (size_t i = 0; i < bc->code_segment->length; ++i) {
-        memset(buffer, 0x00, sizeof(buffer));
-        write_u64(buffer, bc->code_segment->data[i]);
-        fwrite(buffer, sizeof(buffer), 1, fp);
+    for (size_t i = 0; i < bc->data_segment->length; ++i) {
+        const Data_Record *r = &bc->data_segment->data[i];
+        err |= write_word(fp, r->type);
+        err |= write_word(fp, r->address);
+        if (r->type != DT_STRING) {
+            err |= write_word(fp, r->as_int);
+            continue;
+        }
+        // Raw bytes, zero padded to the next word
+        uint8_t buffer[DATA_STRING_SIZE] = {0};
+        size_t length                    = strlen(r->as_str);
+        memcpy(buffer, r->as_str, length);
+        err |= write_word(fp, length);
+        if (fwrite(buffer, padded_length(length), 1, fp) != 1 && length > 0)
+            err = -1;
     }
 
+    for (size_t i = 0; i < bc->code_segment->length; ++i)
+        err |= write_word(fp, bc->code_segment->data[i]);
+
     fclose(fp);
+
+    return err;
 }
 
-Byte_Code *bc_load(const char *path)
+static int read_code(Byte_Code *bc, FILE *fp, size_t start, size_t end)
+{
+    if (fseek(fp, bc->code_offset + start * sizeof(Word), SEEK_SET) < 0)
+        return -1;
+
+    for (size_t i = start; i < end; ++i) {
+        if (read_word(fp, &bc->code_segment->data[i]) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+Byte_Code *bc_load(const char *path, bool lazy)
 {
     if (!path)
         return NULL;
@@ -152,18 +274,119 @@ Byte_Code *bc_load(const char *path)
     if (!fp)
         return NULL;
 
-    uint8_t buffer[sizeof(uint64_t)] = {0};
-    Byte_Code *bc                    = bc_create();
+    Word header[9] = {0};
+    for (size_t i = 0; i < sizeof(header) / sizeof(*header); ++i) {
+        if (read_word(fp, &header[i]) < 0) {
+            fclose(fp);
+            return NULL;
+        }
+    }
+
+    if (header[0] != BC_MAGIC || header[1] != BC_VERSION) {
+        fclose(fp);
+        return NULL;
+    }
+
+    Byte_Code *bc = bc_create();
     if (!bc) {
         fclose(fp);
         return NULL;
     }
 
-    while (fread(buffer, sizeof(buffer), 1, fp) == 1) {
-        da_push(bc->code_segment, read_u64(buffer));
+    bc->entry_point     = header[2];
+    bc->memory_size     = header[3];
+    bc->stack_size      = header[4];
+    bc->call_stack_size = header[5];
+
+    for (Word i = 0; i < header[8]; ++i) {
+        Procedure p = {0};
+        Word start = 0, end = 0, arity = 0;
+        if (read_word(fp, &start) < 0 || read_word(fp, &end) < 0 ||
+            read_word(fp, &arity) < 0 || start > end || end > header[6])
+            goto error;
+        p.start = start;
+        p.end   = end;
+        p.pure  = (arity & BC_PURE_BIT) != 0;
+        p.arity = arity & ~BC_PURE_BIT;
+        da_push(bc->procedures, p);
     }
 
-    fclose(fp);
+    for (Word i = 0; i < header[7]; ++i) {
+        Data_Record r = {0};
+        Word type = 0, length = 0;
+        if (read_word(fp, &type) < 0 || read_word(fp, &r.address) < 0 ||
+            read_word(fp, type == DT_STRING ? &length : &r.as_int) < 0)
+            goto error;
+        r.type = type;
+        if (type == DT_STRING) {
+            if (length >= DATA_STRING_SIZE ||
+                (length > 0 &&
+                 fread(r.as_str, padded_length(length), 1, fp) != 1))
+                goto error;
+            r.as_str[length] = '\0';
+        }
+        da_push(bc->data_segment, r);
+    }
+
+    // The code segment is sized upfront, large zeroed allocations are backed
+    // by pages only once touched, so procedures never called cost nothing
+    Word_Segment *code = bc->code_segment;
+    free(code->data);
+    size_t capacity = header[6] + 1;
+    da_init(code, capacity);
+    if (!code->data)
+        goto error;
+    code->length    = header[6];
+    bc->code_offset = ftell(fp);
+
+    if (!lazy) {
+        if (read_code(bc, fp, 0, code->length) < 0)
+            goto error;
+        fclose(fp);
+        return bc;
+    }
+
+    size_t pc = 0;
+    for (size_t i = 0; i < bc->procedures->length; ++i) {
+        const Procedure *p = &bc->procedures->data[i];
+        if (p->start < pc || read_code(bc, fp, pc, p->start) < 0)
+            goto error;
+        if (p->start < p->end)
+            code->data[p->start] = OP_LOAD_PROC;
+        pc = p->end;
+    }
+    if (read_code(bc, fp, pc, code->length) < 0)
+        goto error;
+
+    bc->source = fp;
 
     return bc;
+
+error:
+    fclose(fp);
+    bc_free(bc);
+    return NULL;
+}
+
+int bc_load_procedure(Byte_Code *bc, size_t address)
+{
+    if (!bc->source)
+        return -1;
+
+    // Procedures are indexed in address order
+    size_t low = 0, high = bc->procedures->length;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (bc->procedures->data[mid].start < address)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    if (low == bc->procedures->length ||
+        bc->procedures->data[low].start != address)
+        return -1;
+
+    const Procedure *p = &bc->procedures->data[low];
+    return read_code(bc, bc->source, p->start, p->end);
 }
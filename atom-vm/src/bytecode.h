@@ -4,6 +4,7 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 // Dynamic array helpers
@@ -35,10 +36,30 @@
         (da)->data[(da)->length++] = (item);                                   \
     } while (0)
 
-#define LABEL_SIZE         64
-#define LABELS_TOTAL       128
-#define DATA_OFFSET        1024
-#define DATA_STRING_OFFSET 2048
+#define LABEL_SIZE              64
+#define LABELS_TOTAL            128
+#define DATA_OFFSET             1024
+#define DATA_STRING_OFFSET      2048
+
+// Default sizes in words of the VM memory, of the operand stack and of the
+// call stack, can be overridden by the bytecode header or on the command line
+#define DEFAULT_MEMORY_SIZE     65536
+#define DEFAULT_STACK_SIZE      256
+#define DEFAULT_CALL_STACK_SIZE 256
+
+// Binary container written by bc_dump, all fields are big-endian 64 bit words
+//
+// magic | version | entry point | memory size | stack size | call stack size
+// | code length | data length | procedures length | procedure index...
+// | data records... | code words...
+//
+// the procedure index holds the start and end (exclusive) address of each
+// .PROC body followed by its arity, with the top bit set for pure procedures,
+// each data record is type | address | value for constants and
+// buffers and type | address | length | bytes padded to a word for strings.
+// The code comes last so that single procedures can be read from it lazily
+#define BC_MAGIC                0x41544F4D // "ATOM"
+#define BC_VERSION              3
 
 typedef uint64_t Word;
 typedef enum {
@@ -63,7 +84,40 @@ typedef enum {
     OP_PRINT,
     OP_PRINT_CONST,
     OP_RET,
-    OP_HALT
+    OP_HALT,
+    OP_SWAP,
+    OP_OVER,
+    OP_ROT,
+    OP_DROP,
+    OP_PICK,
+    OP_ADD_I,
+    OP_SUB_I,
+    OP_MUL_I,
+    OP_LT,
+    OP_GT,
+    OP_LE,
+    OP_GE,
+    OP_JEQ_I,
+    OP_JNE_I,
+    OP_JLT_I,
+    OP_JLE_I,
+    OP_JGT_I,
+    OP_JGE_I,
+    // Internal, never emitted by the assembler: placeholder at the start of a
+    // procedure not loaded yet when the container is loaded lazily
+    OP_LOAD_PROC,
+    OP_MAP_NEW,
+    OP_MAP_PUT,
+    OP_MAP_GET,
+    OP_MAP_DEL,
+    OP_MAP_LEN,
+    OP_LOAD_IDX,
+    OP_STORE_IDX,
+    OP_LOAD_IDXS,
+    OP_STORE_IDXS,
+    OP_SPAWN,
+    OP_SYNC,
+    NUM_INSTRUCTIONS
 } Instruction_ID;
 
 //  These static maps are used to determine the token types during the lexical
@@ -114,11 +168,41 @@ typedef struct data_segment {
     size_t rd_string_addr_offset;
 } Data_Segment;
 
+// Maximum number of arguments of a `.PROC pure name/arity:` procedure, which
+// are the key of its memoized results
+#define PURE_MAX_ARITY 4
+
+// Code range of each .PROC, `end` is exclusive and is either the start of the
+// following procedure, the .main entry point or the end of the code segment.
+// Pure procedures consume `arity` values and leave a single result
+typedef struct procedure {
+    char name[LABEL_SIZE];
+    size_t start;
+    size_t end;
+    bool pure;
+    size_t arity;
+} Procedure;
+
+typedef struct procedures {
+    Procedure *data;
+    size_t length;
+    size_t capacity;
+} Procedures;
+
 typedef struct bytecode {
     size_t entry_point;
+    // Sizes in words requested for the VM regions
+    Word memory_size;
+    Word stack_size;
+    Word call_stack_size;
     Word_Segment *code_segment;
     Data_Segment *data_segment;
+    Procedures *procedures;
     Labels *labels;
+    // Container the procedure bodies are read from when loaded lazily, NULL
+    // once everything is in memory
+    FILE *source;
+    long code_offset;
 } Byte_Code;
 
 Byte_Code *bc_create(void);
@@ -129,8 +213,19 @@ Word *bc_code(const Byte_Code *bc);
 
 bool bc_nary_instruction(Instruction_ID instr);
 
-void bc_dump(const Byte_Code *bc, const char *path);
+// Number of operand words following the opcode in the code segment
+size_t bc_instruction_arity(Instruction_ID instr);
+
+int bc_dump(const Byte_Code *bc, const char *path);
+
+// Returns NULL if the file can't be read or isn't a bytecode container. In
+// lazy mode only the code outside of any .PROC is read, the first word of each
+// procedure is replaced by OP_LOAD_PROC and its body is read on first call by
+// bc_load_procedure
+Byte_Code *bc_load(const char *path, bool lazy);
 
-Byte_Code *bc_load(const char *path);
+// Read the body of the procedure starting at `address` from the container,
+// overwriting its OP_LOAD_PROC placeholder
+int bc_load_procedure(Byte_Code *bc, size_t address);
 
 #endif // BYECODE_H
@@ -0,0 +1,354 @@
+#include "cgen.h"
+#include "bytecode.h"
+#include <string.h>
+
+// Only targets of jumps and calls, return sites and the entry point get a
+// label, an unused label per instruction would just be noise (and a warning)
+#define FLAG_BOUNDARY    0x1
+#define FLAG_LABEL       0x2
+#define FLAG_RETURN      0x4
+
+static const char *const prelude =
+    "#include <stdint.h>\n"
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "\n"
+    "typedef uint64_t Word;\n"
+    "\n"
+    "static Word stack[%llu];\n"
+    "static Word call_stack[%llu];\n"
+    "\n"
+    "static inline void print_string_from_memory(const Word *memory,\n"
+    "                                            Word address)\n"
+    "{\n"
+    "    while (memory[address] != 0)\n"
+    "        putchar((char)(memory[address++] & 0xFF));\n"
+    "}\n"
+    "\n"
+    "_Noreturn static void execution_error(int code)\n"
+    "{\n"
+    "    fprintf(stderr, \"execution error %%d\\n\", code);\n"
+    "    abort();\n"
+    "}\n"
+    "\n";
+
+static int mark_labels(const Byte_Code *bc, unsigned char *flags)
+{
+    const Word *code = bc->code_segment->data;
+    size_t length    = bc->code_segment->length;
+
+    for (size_t pc = 0; pc < length; pc += 1 + bc_instruction_arity(code[pc])) {
+        if (code[pc] >= NUM_INSTRUCTIONS) {
+            fprintf(stderr, "unknown instruction %llu at %04lX\n", code[pc],
+                    pc);
+            return -1;
+        }
+        if (pc + bc_instruction_arity(code[pc]) >= length) {
+            fprintf(stderr, "truncated instruction at %04lX\n", pc);
+            return -1;
+        }
+        // Maps and tasks live in the VM, there's no runtime for them here
+        if ((code[pc] >= OP_MAP_NEW && code[pc] <= OP_MAP_LEN) ||
+            code[pc] == OP_SPAWN || code[pc] == OP_SYNC) {
+            fprintf(stderr, "%s at %04lX not supported in C output\n",
+                    instructions_table[code[pc]], pc);
+            return -1;
+        }
+        flags[pc] |= FLAG_BOUNDARY;
+    }
+
+    for (size_t pc = 0; pc < length; pc += 1 + bc_instruction_arity(code[pc])) {
+        size_t next = pc + 1 + bc_instruction_arity(code[pc]);
+        switch (code[pc]) {
+        case OP_CALL:
+            flags[next] |= FLAG_LABEL | FLAG_RETURN;
+            // fallthrough
+        case OP_JMP:
+        case OP_JEQ:
+        case OP_JNE:
+        case OP_JEQ_I:
+        case OP_JNE_I:
+        case OP_JLT_I:
+        case OP_JLE_I:
+        case OP_JGT_I:
+        case OP_JGE_I: {
+            Word target = code[next - 1];
+            if (target >= length || !(flags[target] & FLAG_BOUNDARY)) {
+                fprintf(stderr, "invalid jump target %04llX at %04lX\n",
+                        target, pc);
+                return -1;
+            }
+            flags[target] |= FLAG_LABEL;
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    if (bc->entry_point >= length ||
+        !(flags[bc->entry_point] & FLAG_BOUNDARY)) {
+        fprintf(stderr, "invalid entry point %04lX\n", bc->entry_point);
+        return -1;
+    }
+    flags[bc->entry_point] |= FLAG_LABEL;
+
+    return 0;
+}
+
+static void emit_memory_image(const Byte_Code *bc, FILE *out)
+{
+    fprintf(out, "static Word memory[%llu] = {\n", bc->memory_size);
+    for (size_t i = 0; i < bc->data_segment->length; ++i) {
+        const Data_Record *r = &bc->data_segment->data[i];
+        if (r->type == DT_CONSTANT) {
+            fprintf(out, "    [%llu] = UINT64_C(%llu),\n", r->address,
+                    r->as_int);
+        } else if (r->type == DT_STRING) {
+            for (size_t j = 0; j < strlen(r->as_str); ++j)
+                fprintf(out, "    [%llu] = %d,\n", r->address + j,
+                        (unsigned char)r->as_str[j]);
+        }
+        // Buffers are zero-initialized like the rest of the static storage
+    }
+    fprintf(out, "};\n\n");
+}
+
+static void emit_compare(FILE *out, const char *op, bool is_signed)
+{
+    if (is_signed)
+        fprintf(out, "sp--; sp[-1] = (int64_t)sp[-1] %s (int64_t)sp[0];", op);
+    else
+        fprintf(out, "sp--; sp[-1] = sp[-1] %s sp[0];", op);
+}
+
+static void emit_fused_branch(FILE *out, const char *op, bool is_signed,
+                              Word imm, Word target)
+{
+    if (is_signed)
+        fprintf(out, "if ((int64_t)*--sp %s INT64_C(%lld)) goto L_%04llX;", op,
+                (long long)imm, target);
+    else
+        fprintf(out, "if (*--sp %s UINT64_C(%llu)) goto L_%04llX;", op, imm,
+                target);
+}
+
+static void emit_instruction(const Byte_Code *bc, size_t pc, FILE *out)
+{
+    const Word *code = bc->code_segment->data;
+    Word arg         = bc_instruction_arity(code[pc]) > 0 ? code[pc + 1] : 0;
+
+    fprintf(out, "    ");
+    switch (code[pc]) {
+    case OP_LOAD:
+        fprintf(out, "sp[-1] = memory[sp[-1]];");
+        break;
+    case OP_LOAD_CONST:
+        fprintf(out, "*sp++ = memory[%llu];", arg);
+        break;
+    case OP_STORE:
+        fprintf(out, "sp -= 2; memory[sp[1]] = sp[0];");
+        break;
+    case OP_STORE_CONST:
+        fprintf(out, "memory[%llu] = *--sp;", arg);
+        break;
+    case OP_LOAD_IDX:
+        fprintf(out, "sp[-1] = memory[%llu + sp[-1]];", arg);
+        break;
+    case OP_STORE_IDX:
+        fprintf(out, "sp -= 2; memory[%llu + sp[1]] = sp[0];", arg);
+        break;
+    case OP_LOAD_IDXS:
+        fprintf(out, "sp[-1] = memory[%llu + sp[-1] * %llu];", arg,
+                code[pc + 2]);
+        break;
+    case OP_STORE_IDXS:
+        fprintf(out, "sp -= 2; memory[%llu + sp[1] * %llu] = sp[0];", arg,
+                code[pc + 2]);
+        break;
+    case OP_CALL:
+        fprintf(out, "*csp++ = %lu; goto L_%04llX;",
+                pc + 1 + bc_instruction_arity(OP_CALL), arg);
+        break;
+    case OP_PUSH:
+        // Same rule as the interpreter, resolved at compile time
+        if (arg >= DATA_STRING_OFFSET)
+            fprintf(out, "*sp++ = UINT64_C(%llu);", arg);
+        else
+            fprintf(out, "*sp++ = memory[%llu];", arg);
+        break;
+    case OP_PUSH_CONST:
+        fprintf(out, "*sp++ = UINT64_C(%llu);", arg);
+        break;
+    case OP_ADD:
+        fprintf(out, "sp--; sp[-1] += sp[0];");
+        break;
+    case OP_SUB:
+        fprintf(out, "sp--; sp[-1] -= sp[0];");
+        break;
+    case OP_MUL:
+        fprintf(out, "sp--; sp[-1] *= sp[0];");
+        break;
+    case OP_DIV:
+        fprintf(out, "sp--; if (sp[0] == 0) execution_error(1); "
+                     "sp[-1] /= sp[0];");
+        break;
+    case OP_ADD_I:
+        fprintf(out, "sp[-1] += UINT64_C(%llu);", arg);
+        break;
+    case OP_SUB_I:
+        fprintf(out, "sp[-1] -= UINT64_C(%llu);", arg);
+        break;
+    case OP_MUL_I:
+        fprintf(out, "sp[-1] *= UINT64_C(%llu);", arg);
+        break;
+    case OP_DUP:
+        fprintf(out, "sp[0] = sp[-1]; sp++;");
+        break;
+    case OP_INC:
+        fprintf(out, "sp[-1] += 1;");
+        break;
+    case OP_SWAP:
+        fprintf(out, "t = sp[-1]; sp[-1] = sp[-2]; sp[-2] = t;");
+        break;
+    case OP_OVER:
+        fprintf(out, "sp[0] = sp[-2]; sp++;");
+        break;
+    case OP_ROT:
+        fprintf(out, "t = sp[-3]; sp[-3] = sp[-2]; sp[-2] = sp[-1]; "
+                     "sp[-1] = t;");
+        break;
+    case OP_DROP:
+        fprintf(out, "sp--;");
+        break;
+    case OP_PICK:
+        fprintf(out, "sp[0] = sp[-1 - %llu]; sp++;", arg);
+        break;
+    case OP_EQ:
+        emit_compare(out, "==", false);
+        break;
+    case OP_LT:
+        emit_compare(out, "<", true);
+        break;
+    case OP_GT:
+        emit_compare(out, ">", true);
+        break;
+    case OP_LE:
+        emit_compare(out, "<=", true);
+        break;
+    case OP_GE:
+        emit_compare(out, ">=", true);
+        break;
+    case OP_JMP:
+        fprintf(out, "goto L_%04llX;", arg);
+        break;
+    case OP_JEQ:
+        fprintf(out, "if (sp[-1]) { sp--; goto L_%04llX; }", arg);
+        break;
+    case OP_JNE:
+        fprintf(out, "if (!sp[-1]) { sp--; goto L_%04llX; }", arg);
+        break;
+    case OP_JEQ_I:
+        emit_fused_branch(out, "==", false, arg, code[pc + 2]);
+        break;
+    case OP_JNE_I:
+        emit_fused_branch(out, "!=", false, arg, code[pc + 2]);
+        break;
+    case OP_JLT_I:
+        emit_fused_branch(out, "<", true, arg, code[pc + 2]);
+        break;
+    case OP_JLE_I:
+        emit_fused_branch(out, "<=", true, arg, code[pc + 2]);
+        break;
+    case OP_JGT_I:
+        emit_fused_branch(out, ">", true, arg, code[pc + 2]);
+        break;
+    case OP_JGE_I:
+        emit_fused_branch(out, ">=", true, arg, code[pc + 2]);
+        break;
+    case OP_MAKE_TUPLE:
+        fprintf(out, "for (Word n = *--sp, a = %llu; n > 0; --n) "
+                     "memory[a++] = *--sp;",
+                arg);
+        break;
+    case OP_PRINT:
+        fprintf(out, "t = *--sp; if (t >= %d) "
+                     "print_string_from_memory(memory, t); "
+                     "else printf(\"%%lli\", (long long)t); fflush(stdout);",
+                DATA_STRING_OFFSET);
+        break;
+    case OP_PRINT_CONST:
+        fprintf(out, "printf(\"%%lli\", (long long)*--sp); fflush(stdout);");
+        break;
+    // RET with nothing to return to ends the run, as in the interpreter
+    case OP_RET:
+        fprintf(out, "if (csp == call_stack) { "
+                     "result = sp > stack ? *--sp : 0; goto exit; } "
+                     "t = *--csp; goto dispatch;");
+        break;
+    case OP_HALT:
+        fprintf(out, "result = sp > stack ? *--sp : 0; goto exit;");
+        break;
+    }
+    fprintf(out, "\n");
+}
+
+int cgen_emit(const Byte_Code *bc, FILE *out)
+{
+    size_t length        = bc->code_segment->length;
+    unsigned char *flags = calloc(length + 1, sizeof(*flags));
+    if (!flags)
+        return -1;
+
+    if (mark_labels(bc, flags) < 0) {
+        free(flags);
+        return -1;
+    }
+
+    fprintf(out, prelude, bc->stack_size, bc->call_stack_size);
+    emit_memory_image(bc, out);
+
+    fprintf(out, "int main(void)\n{\n");
+    fprintf(out, "    Word *sp = stack, *csp = call_stack;\n");
+    fprintf(out, "    Word t = 0, result = 0;\n");
+    fprintf(out, "    (void)sp, (void)csp, (void)t, (void)result;\n");
+    fprintf(out, "    goto L_%04lX;\n\n", bc->entry_point);
+
+    const Word *code = bc->code_segment->data;
+    bool has_ret     = false;
+    bool has_halt    = false;
+    for (size_t pc = 0; pc < length; pc += 1 + bc_instruction_arity(code[pc])) {
+        if (flags[pc] & FLAG_LABEL)
+            fprintf(out, "L_%04lX:\n", pc);
+        emit_instruction(bc, pc, out);
+        has_ret  |= code[pc] == OP_RET;
+        has_halt |= code[pc] == OP_HALT;
+    }
+
+    // Falling off the end of the code segment, e.g. returning from a CALL
+    // placed as the last instruction
+    if (flags[length] & FLAG_LABEL)
+        fprintf(out, "L_%04lX:\n", length);
+    fprintf(out, "    execution_error(2);\n");
+
+    // RET jumps back through the return sites, which are only known here
+    if (has_ret) {
+        fprintf(out, "\ndispatch:\n    switch (t) {\n");
+        for (size_t pc = 0; pc <= length; ++pc) {
+            if (flags[pc] & FLAG_RETURN)
+                fprintf(out, "    case %lu: goto L_%04lX;\n", pc, pc);
+        }
+        fprintf(out, "    default: execution_error(2);\n    }\n");
+    }
+
+    if (has_halt || has_ret) {
+        fprintf(out, "\nexit:\n");
+        fprintf(out, "    printf(\"%%llu\\n\", (unsigned long long)result);\n");
+        fprintf(out, "    return 0;\n");
+    }
+    fprintf(out, "}\n");
+
+    free(flags);
+
+    return 0;
+}
@@ -0,0 +1,17 @@
+#ifndef CGEN_H
+#define CGEN_H
+
+#include <stdio.h>
+
+typedef struct bytecode Byte_Code;
+
+// Ahead-of-time translation of a program to a standalone C translation unit,
+// each instruction becomes a labeled statement, jumps and calls are plain
+// gotos and RET goes through a switch over the known return sites. The memory
+// image is emitted as static data so the result only depends on libc.
+//
+// Returns 0 on success, -1 if the program can't be translated (e.g. a jump in
+// the middle of an instruction)
+int cgen_emit(const Byte_Code *bc, FILE *out);
+
+#endif
@@ -0,0 +1,120 @@
+#include "hooks.h"
+#include <stdlib.h>
+#include <string.h>
+
+void hooks_set_handler(Hooks *h, Hook_Handler handler, void *ctx)
+{
+    h->handler = handler;
+    h->ctx     = ctx;
+}
+
+int hooks_break(Hooks *h, Word pc)
+{
+    if (pc >= h->breaks_length) {
+        size_t length = h->breaks_length ? h->breaks_length : 64;
+        while (length <= pc)
+            length *= 2;
+        bool *breaks = realloc(h->breaks, length * sizeof(*breaks));
+        if (!breaks)
+            return -1;
+        memset(breaks + h->breaks_length, 0,
+               (length - h->breaks_length) * sizeof(*breaks));
+        h->breaks        = breaks;
+        h->breaks_length = length;
+    }
+
+    if (!h->breaks[pc]) {
+        h->breaks[pc] = true;
+        h->breaks_count++;
+    }
+
+    return 0;
+}
+
+void hooks_clear_break(Hooks *h, Word pc)
+{
+    if (pc < h->breaks_length && h->breaks[pc]) {
+        h->breaks[pc] = false;
+        h->breaks_count--;
+    }
+}
+
+void hooks_step(Hooks *h, bool on) { h->step = on; }
+
+int hooks_watch(Hooks *h, Word addr)
+{
+    for (size_t i = 0; i < h->watches.length; ++i) {
+        if (h->watches.data[i].addr == addr)
+            return 0;
+    }
+
+    if (h->watches.length == h->watches.capacity) {
+        size_t capacity = h->watches.capacity ? h->watches.capacity * 2 : 4;
+        Watch *data =
+            realloc(h->watches.data, capacity * sizeof(*h->watches.data));
+        if (!data)
+            return -1;
+        h->watches.data     = data;
+        h->watches.capacity = capacity;
+    }
+
+    h->watches.data[h->watches.length++] = (Watch){.addr = addr};
+
+    return 0;
+}
+
+void hooks_clear_watch(Hooks *h, Word addr)
+{
+    for (size_t i = 0; i < h->watches.length; ++i) {
+        if (h->watches.data[i].addr == addr) {
+            h->watches.data[i] = h->watches.data[--h->watches.length];
+            return;
+        }
+    }
+}
+
+void hooks_free(Hooks *h)
+{
+    free(h->breaks);
+    free(h->watches.data);
+    *h = (Hooks){0};
+}
+
+void hooks_sync(Hooks *h, const Word *memory)
+{
+    for (size_t i = 0; i < h->watches.length; ++i)
+        h->watches.data[i].value = memory[h->watches.data[i].addr];
+}
+
+static bool hooks_fire(Hooks *h, const Hook_Event *e)
+{
+    return !h->handler || h->handler(e, h->ctx);
+}
+
+bool hooks_check(Hooks *h, const Word *memory, Word last, Word pc)
+{
+    // The handler may clear a watch, walking backwards keeps the swap with
+    // the last one from skipping any
+    for (size_t i = h->watches.length; i > 0; --i) {
+        Watch *w = &h->watches.data[i - 1];
+        if (memory[w->addr] == w->value)
+            continue;
+
+        Hook_Event e = {.kind      = HOOK_WATCH,
+                        .pc        = last,
+                        .addr      = w->addr,
+                        .old_value = w->value,
+                        .new_value = memory[w->addr]};
+        w->value     = e.new_value;
+        if (!hooks_fire(h, &e))
+            return false;
+    }
+
+    if (h->step || (pc < h->breaks_length && h->breaks[pc])) {
+        Hook_Event e = {.kind = h->step ? HOOK_STEP : HOOK_BREAK, .pc = pc};
+        if (!hooks_fire(h, &e))
+            return false;
+    }
+
+    return true;
+}
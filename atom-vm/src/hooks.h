@@ -0,0 +1,72 @@
+#ifndef HOOKS_H
+#define HOOKS_H
+
+#include "bytecode.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum { HOOK_BREAK, HOOK_STEP, HOOK_WATCH } Hook_Kind;
+
+// Breakpoints and single steps fire before the instruction at `pc` runs,
+// watchpoints right after the instruction at `pc` changed the word at `addr`
+typedef struct hook_event {
+    Hook_Kind kind;
+    Word pc;
+    Word addr;
+    Word old_value;
+    Word new_value;
+} Hook_Event;
+
+// Returning false stops the program
+typedef bool (*Hook_Handler)(const Hook_Event *e, void *ctx);
+
+typedef struct watch {
+    Word addr;
+    // Value seen after the last instruction run
+    Word value;
+} Watch;
+
+typedef struct hooks {
+    Hook_Handler handler;
+    void *ctx;
+    bool step;
+    // One flag per code address, grown on demand
+    bool *breaks;
+    size_t breaks_length;
+    size_t breaks_count;
+    struct {
+        Watch *data;
+        size_t length;
+        size_t capacity;
+    } watches;
+} Hooks;
+
+void hooks_set_handler(Hooks *h, Hook_Handler handler, void *ctx);
+
+// Returns -1 if out of memory
+int hooks_break(Hooks *h, Word pc);
+void hooks_clear_break(Hooks *h, Word pc);
+
+void hooks_step(Hooks *h, bool on);
+
+// Returns -1 if out of memory
+int hooks_watch(Hooks *h, Word addr);
+void hooks_clear_watch(Hooks *h, Word addr);
+
+void hooks_free(Hooks *h);
+
+// Take the current value of every watched word as the reference one, done
+// each time the interpreter switches to the instrumented loop
+void hooks_sync(Hooks *h, const Word *memory);
+
+// Report the watched words changed by the instruction at `last`, then a
+// breakpoint or single step at `pc`, returns false if the handler asked to
+// stop
+bool hooks_check(Hooks *h, const Word *memory, Word last, Word pc);
+
+static inline bool hooks_active(const Hooks *h)
+{
+    return h->step || h->breaks_count > 0 || h->watches.length > 0;
+}
+
+#endif // HOOKS_H
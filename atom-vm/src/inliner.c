@@ -0,0 +1,211 @@
+#include "inliner.h"
+#include "bytecode.h"
+#include <stdio.h>
+#include <string.h>
+
+typedef struct candidate {
+    bool inlinable;
+    // Size in words of the copy of the body and offset of each word of the
+    // original body within the copy, the body being rewritten as it's copied
+    size_t size;
+    size_t *offsets;
+} Candidate;
+
+static bool is_jump(Word op)
+{
+    return op == OP_JMP || op == OP_JEQ || op == OP_JNE ||
+           (op >= OP_JEQ_I && op <= OP_JGE_I);
+}
+
+// Index of the operand holding the destination of a jump or a call
+static size_t target_operand(Word op)
+{
+    return op >= OP_JEQ_I && op <= OP_JGE_I ? 2 : 1;
+}
+
+static void analyse(const Byte_Code *bc, const Procedure *p,
+                    const bool *boundary, size_t threshold, Candidate *c)
+{
+    const Word *code    = bc_code(bc);
+    size_t instructions = 0;
+    Word last           = OP_HALT;
+
+    c->inlinable        = false;
+    if (p->start >= p->end)
+        return;
+
+    for (size_t pc = p->start; pc < p->end;
+         pc += 1 + bc_instruction_arity(code[pc])) {
+        Word op = code[pc];
+        if (op == OP_CALL || op == OP_SPAWN || op == OP_LOAD_PROC ||
+            pc + bc_instruction_arity(op) >= p->end)
+            return;
+        if (is_jump(op)) {
+            Word target = code[pc + target_operand(op)];
+            if (target < p->start || target >= p->end || !boundary[target])
+                return;
+        }
+        if (op != OP_RET)
+            instructions++;
+        last = op;
+    }
+
+    // Falling off the end of the body would run the following procedure in
+    // the original code and the instruction following the call in the copy
+    if (last != OP_RET || instructions > threshold)
+        return;
+
+    c->offsets = calloc(p->end - p->start + 1, sizeof(*c->offsets));
+    if (!c->offsets)
+        return;
+
+    size_t size = 0;
+    for (size_t pc = p->start; pc < p->end;
+         pc += 1 + bc_instruction_arity(code[pc])) {
+        c->offsets[pc - p->start] = size;
+        if (code[pc] != OP_RET)
+            size += 1 + bc_instruction_arity(code[pc]);
+        else if (pc + 1 < p->end)
+            // RET before the end of the body, becomes a JMP past the copy
+            size += 1 + bc_instruction_arity(OP_JMP);
+    }
+    c->offsets[p->end - p->start] = size;
+    c->size                       = size;
+    c->inlinable                  = true;
+}
+
+static long find_procedure(const Procedures *procs, Word address)
+{
+    size_t low = 0, high = procs->length;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (procs->data[mid].start < address)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (low < procs->length && procs->data[low].start == address)
+        return (long)low;
+    return -1;
+}
+
+static void copy_body(const Byte_Code *bc, const Procedure *p,
+                      const Candidate *c, Word_Segment *out)
+{
+    const Word *code = bc_code(bc);
+    size_t base      = out->length;
+
+    for (size_t pc = p->start; pc < p->end;
+         pc += 1 + bc_instruction_arity(code[pc])) {
+        Word op = code[pc];
+        if (op == OP_RET) {
+            if (pc + 1 < p->end) {
+                da_push(out, (Word)OP_JMP);
+                da_push(out, base + c->size);
+            }
+            continue;
+        }
+        da_push(out, op);
+        for (size_t k = 1; k <= bc_instruction_arity(op); ++k) {
+            if (is_jump(op) && k == target_operand(op))
+                da_push(out, base + c->offsets[code[pc + k] - p->start]);
+            else
+                da_push(out, code[pc + k]);
+        }
+    }
+}
+
+size_t inline_procedures(Byte_Code *bc, size_t threshold)
+{
+    // Lazily loaded code isn't all there to be analysed
+    if (threshold == 0 || bc->procedures->length == 0 || bc->source)
+        return 0;
+
+    const Word *code    = bc_code(bc);
+    size_t length       = bc->code_segment->length;
+    Procedures *procs   = bc->procedures;
+    size_t inlined      = 0;
+    bool *boundary      = calloc(length + 1, sizeof(*boundary));
+    size_t *map         = calloc(length + 1, sizeof(*map));
+    Candidate *cands    = calloc(procs->length, sizeof(*cands));
+    Word_Segment out    = {0};
+    // Positions in the new code of the jump targets still to be rebased
+    Word_Segment fixups = {0};
+    if (!boundary || !map || !cands || bc->entry_point >= length)
+        goto exit;
+
+    for (size_t pc = 0; pc < length; pc += 1 + bc_instruction_arity(code[pc])) {
+        if (code[pc] >= NUM_INSTRUCTIONS ||
+            pc + bc_instruction_arity(code[pc]) >= length)
+            goto exit;
+        boundary[pc] = true;
+    }
+    boundary[length] = true;
+
+    // Every jump has to land on an instruction to be rebased
+    for (size_t pc = 0; pc < length; pc += 1 + bc_instruction_arity(code[pc])) {
+        if ((is_jump(code[pc]) || code[pc] == OP_CALL ||
+             code[pc] == OP_SPAWN) &&
+            (code[pc + target_operand(code[pc])] >= length ||
+             !boundary[code[pc + target_operand(code[pc])]]))
+            goto exit;
+    }
+
+    for (size_t i = 0; i < procs->length; ++i)
+        analyse(bc, &procs->data[i], boundary, threshold, &cands[i]);
+
+    size_t capacity = length * 2 + 1;
+    da_init(&out, capacity);
+    capacity = 16;
+    da_init(&fixups, capacity);
+    if (!out.data || !fixups.data)
+        goto exit;
+
+    for (size_t pc = 0; pc < length; pc += 1 + bc_instruction_arity(code[pc])) {
+        Word op = code[pc];
+        map[pc] = out.length;
+
+        if (op == OP_CALL) {
+            long i = find_procedure(procs, code[pc + 1]);
+            if (i >= 0 && cands[i].inlinable) {
+                copy_body(bc, &procs->data[i], &cands[i], &out);
+                inlined++;
+                continue;
+            }
+        }
+
+        if (is_jump(op) || op == OP_CALL || op == OP_SPAWN)
+            da_push(&fixups, out.length + target_operand(op));
+        for (size_t k = 0; k <= bc_instruction_arity(op); ++k)
+            da_push(&out, code[pc + k]);
+    }
+    map[length] = out.length;
+
+    if (inlined == 0)
+        goto exit;
+
+    for (size_t i = 0; i < fixups.length; ++i)
+        out.data[fixups.data[i]] = map[out.data[fixups.data[i]]];
+
+    bc->entry_point = map[bc->entry_point];
+    for (size_t i = 0; i < procs->length; ++i) {
+        procs->data[i].start = map[procs->data[i].start];
+        procs->data[i].end   = map[procs->data[i].end];
+    }
+
+    // Swap the segments, the old code is released below
+    Word_Segment tmp  = *bc->code_segment;
+    *bc->code_segment = out;
+    out               = tmp;
+
+exit:
+    for (size_t i = 0; cands && i < procs->length; ++i)
+        free(cands[i].offsets);
+    free(cands);
+    free(boundary);
+    free(map);
+    free(out.data);
+    free(fixups.data);
+
+    return inlined;
+}
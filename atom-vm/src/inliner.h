@@ -0,0 +1,18 @@
+#ifndef INLINER_H
+#define INLINER_H
+
+#include <stddef.h>
+
+typedef struct bytecode Byte_Code;
+
+// Replace each CALL to a small .PROC with a copy of its body. Candidates are
+// leaf procedures (no CALL, hence no recursion) of at most `threshold`
+// instructions, RET excluded, whose jumps all stay within their body. Jump
+// targets in the copies and across the whole program are rebased, a RET in
+// the middle of a copied body becomes a JMP past the end of the copy.
+//
+// The procedures are left in place for any caller reaching them other than
+// by a CALL, returns the number of call sites inlined
+size_t inline_procedures(Byte_Code *bc, size_t threshold);
+
+#endif
@@ -0,0 +1,682 @@
+#include "ir.h"
+#include <stdio.h>
+#include <string.h>
+
+// Range of stack positions, relative to the start of a block, that the
+// translator is able to track. Blocks going deeper than that are left to the
+// stack interpreter
+#define IR_WINDOW     128
+
+#define FLAG_BOUNDARY 0x1
+#define FLAG_LEADER   0x2
+
+static const char *const ir_ops_table[NUM_IR_OPS] = {
+    "MOV",  "MOVI", "LOAD", "LOADI", "STORE", "STOREI",      "LOADX", "STOREX",
+    "ADD",  "SUB",  "MUL",  "DIV",   "ADDI",  "SUBI",        "MULI",  "EQ",
+    "LT",   "GT",   "LE",   "GE",    "PRINT", "PRINT_CONST", "MAP",   "ADJ",
+    "JMP",  "JT",   "JF",   "JEQI",  "JNEI",  "JLTI",        "JLEI",  "JGTI",
+    "JGEI", "CALL", "RET",  "HALT"};
+
+typedef enum { V_SLOT, V_IMM } Value_Kind;
+
+// Symbolic content of a stack position during the translation of a block,
+// either the value held in a register or a constant not yet materialized
+typedef struct value {
+    Value_Kind kind;
+    int32_t slot;
+    Word imm;
+} Value;
+
+typedef struct translator {
+    const Byte_Code *bc;
+    IR_Program *ir;
+    // Each block is translated twice, the first pass only measures its
+    // maximum depth so that on the second one, which actually emits the
+    // instructions, temporaries can be placed right above it
+    bool emit;
+    bool failed;
+    Value values[IR_WINDOW * 2];
+    int32_t depth;
+    int32_t low;
+    int32_t max_depth;
+    int32_t temp_base;
+    int32_t temps;
+} Translator;
+
+#define value_at(t, pos) (&(t)->values[IR_WINDOW + (pos)])
+
+static void emit(Translator *t, IR_Op op, int32_t dst, int32_t a, int32_t b,
+                 Word imm)
+{
+    if (!t->emit)
+        return;
+
+    IR_Instruction i = {.op = op, .dst = dst, .a = a, .b = b, .imm = imm};
+    da_push(t->ir, i);
+}
+
+static void push(Translator *t, Value v)
+{
+    if (t->depth >= IR_WINDOW) {
+        t->failed = true;
+        return;
+    }
+    *value_at(t, t->depth++) = v;
+    if (t->depth > t->max_depth)
+        t->max_depth = t->depth;
+}
+
+static Value pop(Translator *t)
+{
+    if (t->depth <= -IR_WINDOW) {
+        t->failed = true;
+        return (Value){.kind = V_IMM, .imm = 0};
+    }
+    t->depth--;
+    if (t->depth < t->low)
+        t->low = t->depth;
+    return *value_at(t, t->depth);
+}
+
+static Value *peek(Translator *t, int32_t n)
+{
+    int32_t pos = t->depth - 1 - n;
+    if (pos < -IR_WINDOW || pos >= IR_WINDOW) {
+        t->failed = true;
+        return value_at(t, 0);
+    }
+    if (pos < t->low)
+        t->low = pos;
+    return value_at(t, pos);
+}
+
+static int32_t new_temp(Translator *t)
+{
+    int32_t slot = t->temp_base + t->temps++;
+    if (slot >= IR_WINDOW)
+        t->failed = true;
+    return slot;
+}
+
+// Return the register holding the value, constants are materialized into a
+// temporary
+static int32_t to_reg(Translator *t, Value v)
+{
+    if (v.kind == V_SLOT)
+        return v.slot;
+
+    int32_t temp = new_temp(t);
+    emit(t, IR_MOVI, temp, 0, 0, v.imm);
+    return temp;
+}
+
+static bool is_slot(const Value *v, int32_t slot)
+{
+    return v->kind == V_SLOT && v->slot == slot;
+}
+
+// Before overwriting a register, any other live position still referring to
+// its current content (e.g. after a SWAP) gets its own copy
+static void protect(Translator *t, int32_t slot)
+{
+    int32_t temp = -1;
+    for (int32_t i = t->low; i < t->depth; ++i) {
+        Value *v = value_at(t, i);
+        if (i == slot || !is_slot(v, slot))
+            continue;
+        if (temp < 0) {
+            temp = new_temp(t);
+            emit(t, IR_MOV, temp, slot, 0, 0);
+        }
+        v->slot = temp;
+    }
+}
+
+// Write the result of an operation in the register of the new top of the
+// stack
+static void result(Translator *t, IR_Op op, int32_t a, int32_t b, Word imm)
+{
+    int32_t slot = t->depth;
+    protect(t, slot);
+    emit(t, op, slot, a, b, imm);
+    push(t, (Value){.kind = V_SLOT, .slot = slot});
+}
+
+// Write back every live position to its own slot and return the net stack
+// effect of the block, to be applied to `bp` by the terminator
+static int32_t flush(Translator *t)
+{
+    // Values referring to a slot that is about to be overwritten are saved
+    // first, e.g. the two positions swapped by a SWAP
+    for (int32_t i = t->low; i < t->depth; ++i) {
+        Value *v = value_at(t, i);
+        if (v->kind != V_SLOT || v->slot == i || v->slot < t->low ||
+            v->slot >= t->depth || is_slot(value_at(t, v->slot), v->slot))
+            continue;
+        int32_t temp = new_temp(t);
+        emit(t, IR_MOV, temp, v->slot, 0, 0);
+        v->slot = temp;
+    }
+
+    for (int32_t i = t->low; i < t->depth; ++i) {
+        Value *v = value_at(t, i);
+        if (v->kind == V_IMM)
+            emit(t, IR_MOVI, i, 0, 0, v->imm);
+        else if (v->slot != i)
+            emit(t, IR_MOV, i, v->slot, 0, 0);
+    }
+
+    return t->depth;
+}
+
+// Operations with no register form are run on the real stack: every
+// live position is written back to its slot, the operation pops and pushes
+// there and the block goes on with the results in their own slots
+static void translate_stack_op(Translator *t, Word op, int32_t pops,
+                               int32_t pushes)
+{
+    flush(t);
+    for (int32_t i = t->low; i < t->depth; ++i)
+        *value_at(t, i) = (Value){.kind = V_SLOT, .slot = i};
+
+    emit(t, IR_MAP, 0, t->depth, 0, op);
+    for (int32_t i = 0; i < pops; ++i)
+        (void)pop(t);
+    for (int32_t i = 0; i < pushes; ++i)
+        push(t, (Value){.kind = V_SLOT, .slot = t->depth});
+}
+
+// Register holding an array index scaled by the stride of the access
+static int32_t scaled_index(Translator *t, int32_t slot, Word stride)
+{
+    if (stride == 1)
+        return slot;
+
+    int32_t temp = new_temp(t);
+    emit(t, IR_MULI, temp, slot, 0, stride);
+    return temp;
+}
+
+static bool fold(Instruction_ID op, Word left, Word right, Word *res)
+{
+    switch (op) {
+    case OP_ADD:
+        *res = left + right;
+        return true;
+    case OP_SUB:
+        *res = left - right;
+        return true;
+    case OP_MUL:
+        *res = left * right;
+        return true;
+    case OP_DIV:
+        // Leave it to the runtime to report the error
+        if (right == 0)
+            return false;
+        *res = left / right;
+        return true;
+    case OP_EQ:
+        *res = left == right;
+        return true;
+    case OP_LT:
+        *res = (int64_t)left < (int64_t)right;
+        return true;
+    case OP_GT:
+        *res = (int64_t)left > (int64_t)right;
+        return true;
+    case OP_LE:
+        *res = (int64_t)left <= (int64_t)right;
+        return true;
+    case OP_GE:
+        *res = (int64_t)left >= (int64_t)right;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void translate_binary(Translator *t, Instruction_ID op)
+{
+    static const IR_Op reg_ops[NUM_INSTRUCTIONS] = {
+        [OP_ADD] = IR_ADD, [OP_SUB] = IR_SUB, [OP_MUL] = IR_MUL,
+        [OP_DIV] = IR_DIV, [OP_EQ] = IR_EQ,   [OP_LT] = IR_LT,
+        [OP_GT] = IR_GT,   [OP_LE] = IR_LE,   [OP_GE] = IR_GE};
+
+    Value right = pop(t);
+    Value left  = pop(t);
+    Word res    = 0;
+
+    if (left.kind == V_IMM && right.kind == V_IMM &&
+        fold(op, left.imm, right.imm, &res)) {
+        push(t, (Value){.kind = V_IMM, .imm = res});
+        return;
+    }
+
+    // Addition and multiplication are commutative, a constant on either side
+    // can use the immediate form
+    if (left.kind == V_IMM && (op == OP_ADD || op == OP_MUL)) {
+        Value tmp = left;
+        left      = right;
+        right     = tmp;
+    }
+
+    if (right.kind == V_IMM && (op == OP_ADD || op == OP_SUB || op == OP_MUL)) {
+        IR_Op iop = op == OP_ADD ? IR_ADDI : op == OP_SUB ? IR_SUBI : IR_MULI;
+        result(t, iop, to_reg(t, left), 0, right.imm);
+        return;
+    }
+
+    int32_t a = to_reg(t, left);
+    int32_t b = to_reg(t, right);
+    result(t, reg_ops[op], a, b, 0);
+}
+
+// Translate a single stack instruction, returns true if it ends the block
+static bool translate_instruction(Translator *t, const Word *code, size_t pc)
+{
+    static const IR_Op fused_ops[NUM_INSTRUCTIONS] = {
+        [OP_JEQ_I] = IR_JEQI, [OP_JNE_I] = IR_JNEI, [OP_JLT_I] = IR_JLTI,
+        [OP_JLE_I] = IR_JLEI, [OP_JGT_I] = IR_JGTI, [OP_JGE_I] = IR_JGEI};
+
+    Word op = code[pc];
+
+    switch (op) {
+    case OP_LOAD: {
+        Value addr = pop(t);
+        if (addr.kind == V_IMM)
+            result(t, IR_LOADI, 0, 0, addr.imm);
+        else
+            result(t, IR_LOAD, addr.slot, 0, 0);
+        break;
+    }
+    case OP_LOAD_CONST:
+        result(t, IR_LOADI, 0, 0, code[pc + 1]);
+        break;
+    case OP_STORE: {
+        Value addr  = pop(t);
+        Value value = pop(t);
+        if (addr.kind == V_IMM)
+            emit(t, IR_STOREI, 0, to_reg(t, value), 0, addr.imm);
+        else
+            emit(t, IR_STORE, 0, addr.slot, to_reg(t, value), 0);
+        break;
+    }
+    case OP_STORE_CONST: {
+        Value value = pop(t);
+        emit(t, IR_STOREI, 0, to_reg(t, value), 0, code[pc + 1]);
+        break;
+    }
+    case OP_LOAD_IDX:
+    case OP_LOAD_IDXS: {
+        Word stride = op == OP_LOAD_IDXS ? code[pc + 2] : 1;
+        Value index = pop(t);
+        if (index.kind == V_IMM)
+            result(t, IR_LOADI, 0, 0, code[pc + 1] + index.imm * stride);
+        else
+            result(t, IR_LOADX, scaled_index(t, index.slot, stride), 0,
+                   code[pc + 1]);
+        break;
+    }
+    case OP_STORE_IDX:
+    case OP_STORE_IDXS: {
+        Word stride = op == OP_STORE_IDXS ? code[pc + 2] : 1;
+        Value index = pop(t);
+        Value value = pop(t);
+        if (index.kind == V_IMM)
+            emit(t, IR_STOREI, 0, to_reg(t, value), 0,
+                 code[pc + 1] + index.imm * stride);
+        else
+            emit(t, IR_STOREX, 0, scaled_index(t, index.slot, stride),
+                 to_reg(t, value), code[pc + 1]);
+        break;
+    }
+    case OP_PUSH:
+        // Same rule as the stack interpreter, string pointers are pushed as
+        // they are, anything else is dereferenced
+        if (code[pc + 1] >= DATA_STRING_OFFSET)
+            push(t, (Value){.kind = V_IMM, .imm = code[pc + 1]});
+        else
+            result(t, IR_LOADI, 0, 0, code[pc + 1]);
+        break;
+    case OP_PUSH_CONST:
+        push(t, (Value){.kind = V_IMM, .imm = code[pc + 1]});
+        break;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_EQ:
+    case OP_LT:
+    case OP_GT:
+    case OP_LE:
+    case OP_GE:
+        translate_binary(t, op);
+        break;
+    case OP_ADD_I:
+    case OP_SUB_I:
+    case OP_MUL_I:
+        push(t, (Value){.kind = V_IMM, .imm = code[pc + 1]});
+        translate_binary(t, op == OP_ADD_I   ? OP_ADD
+                            : op == OP_SUB_I ? OP_SUB
+                                             : OP_MUL);
+        break;
+    case OP_INC:
+        push(t, (Value){.kind = V_IMM, .imm = 1});
+        translate_binary(t, OP_ADD);
+        break;
+    case OP_DUP: {
+        Value v = *peek(t, 0);
+        push(t, v);
+        break;
+    }
+    case OP_SWAP: {
+        Value *right = peek(t, 0);
+        Value *left  = peek(t, 1);
+        Value tmp    = *right;
+        *right       = *left;
+        *left        = tmp;
+        break;
+    }
+    case OP_OVER: {
+        Value v = *peek(t, 1);
+        push(t, v);
+        break;
+    }
+    case OP_ROT: {
+        Value *c = peek(t, 0);
+        Value *b = peek(t, 1);
+        Value *a = peek(t, 2);
+        Value tmp = *a;
+        *a        = *b;
+        *b        = *c;
+        *c        = tmp;
+        break;
+    }
+    case OP_DROP:
+        (void)pop(t);
+        break;
+    case OP_PICK: {
+        Value v = *peek(t, code[pc + 1]);
+        push(t, v);
+        break;
+    }
+    case OP_MAKE_TUPLE: {
+        Value size = pop(t);
+        if (size.kind != V_IMM) {
+            t->failed = true;
+            break;
+        }
+        for (Word i = 0; i < size.imm && !t->failed; ++i) {
+            Value v = pop(t);
+            emit(t, IR_STOREI, 0, to_reg(t, v), 0, code[pc + 1] + i);
+        }
+        break;
+    }
+    case OP_PRINT:
+    case OP_PRINT_CONST: {
+        Value v = pop(t);
+        emit(t, op == OP_PRINT ? IR_PRINT : IR_PRINT_CONST, 0, to_reg(t, v), 0,
+             0);
+        break;
+    }
+    case OP_MAP_NEW:
+    case OP_MAP_LEN:
+        translate_stack_op(t, op, 1, 1);
+        break;
+    case OP_MAP_PUT:
+        translate_stack_op(t, op, 3, 0);
+        break;
+    case OP_MAP_GET:
+        translate_stack_op(t, op, 2, 2);
+        break;
+    case OP_MAP_DEL:
+        translate_stack_op(t, op, 2, 1);
+        break;
+    case OP_JMP:
+        emit(t, IR_JMP, code[pc + 1], flush(t), 0, 0);
+        return true;
+    case OP_JEQ:
+        emit(t, IR_JT, code[pc + 1], flush(t), 0, 0);
+        return true;
+    case OP_JNE:
+        emit(t, IR_JF, code[pc + 1], flush(t), 0, 0);
+        return true;
+    case OP_JEQ_I:
+    case OP_JNE_I:
+    case OP_JLT_I:
+    case OP_JLE_I:
+    case OP_JGT_I:
+    case OP_JGE_I:
+        emit(t, fused_ops[op], code[pc + 2], flush(t), 0, code[pc + 1]);
+        return true;
+    case OP_CALL:
+        // The bytecode address is kept to look up pure procedures
+        emit(t, IR_CALL, code[pc + 1], flush(t), 0, code[pc + 1]);
+        return true;
+    case OP_RET:
+        emit(t, IR_RET, 0, flush(t), 0, 0);
+        return true;
+    case OP_HALT:
+        emit(t, IR_HALT, 0, flush(t), 0, 0);
+        return true;
+    default:
+        t->failed = true;
+        break;
+    }
+
+    return false;
+}
+
+// Translate from `start` up to the next leader or block terminator, returns
+// the address of the instruction following the block
+static size_t translate_block(Translator *t, size_t start, const uint8_t *flags)
+{
+    const Word *code = bc_code(t->bc);
+    size_t length    = t->bc->code_segment->length;
+    size_t pc        = start;
+
+    t->depth         = 0;
+    t->low           = 0;
+    t->max_depth     = 0;
+    t->temps         = 0;
+    for (int32_t i = -IR_WINDOW; i < IR_WINDOW; ++i)
+        *value_at(t, i) = (Value){.kind = V_SLOT, .slot = i};
+
+    while (pc < length && !t->failed) {
+        bool terminator = translate_instruction(t, code, pc);
+        pc += 1 + bc_instruction_arity(code[pc]);
+        if (terminator)
+            return pc;
+        if (pc < length && (flags[pc] & FLAG_LEADER)) {
+            int32_t adj = flush(t);
+            if (adj != 0)
+                emit(t, IR_ADJ, 0, adj, 0, 0);
+            return pc;
+        }
+    }
+
+    // Falling off the end of the code segment
+    t->failed = true;
+    return pc;
+}
+
+static bool is_terminator(Word op)
+{
+    return op == OP_JMP || op == OP_JEQ || op == OP_JNE || op == OP_CALL ||
+           op == OP_RET || op == OP_HALT || (op >= OP_JEQ_I && op <= OP_JGE_I);
+}
+
+static bool is_branch(Word op)
+{
+    return op == OP_JMP || op == OP_JEQ || op == OP_JNE || op == OP_CALL ||
+           (op >= OP_JEQ_I && op <= OP_JGE_I);
+}
+
+// Mark the instruction boundaries and the basic block leaders, that is the
+// start of .main and of each .PROC, the target of every jump and call and
+// any instruction following one that ends a block
+static bool mark_leaders(const Byte_Code *bc, uint8_t *flags, size_t *count)
+{
+    const Word *code = bc_code(bc);
+    size_t length    = bc->code_segment->length;
+
+    for (size_t pc = 0; pc < length; pc += 1 + bc_instruction_arity(code[pc])) {
+        if (code[pc] >= NUM_INSTRUCTIONS ||
+            pc + bc_instruction_arity(code[pc]) >= length)
+            return false;
+        flags[pc] |= FLAG_BOUNDARY;
+        (*count)++;
+    }
+
+    if (bc->entry_point >= length || !(flags[bc->entry_point] & FLAG_BOUNDARY))
+        return false;
+
+    flags[0] |= FLAG_LEADER;
+    flags[bc->entry_point] |= FLAG_LEADER;
+    for (size_t i = 0; i < bc->procedures->length; ++i) {
+        if (bc->procedures->data[i].start < length)
+            flags[bc->procedures->data[i].start] |= FLAG_LEADER;
+    }
+
+    for (size_t pc = 0; pc < length; pc += 1 + bc_instruction_arity(code[pc])) {
+        size_t next = pc + 1 + bc_instruction_arity(code[pc]);
+        if (is_branch(code[pc])) {
+            Word target = code[next - 1];
+            if (target >= length || !(flags[target] & FLAG_BOUNDARY))
+                return false;
+            flags[target] |= FLAG_LEADER;
+        }
+        if (is_terminator(code[pc]) && next < length)
+            flags[next] |= FLAG_LEADER;
+    }
+
+    return true;
+}
+
+IR_Program *ir_translate(const Byte_Code *bc)
+{
+    size_t length  = bc->code_segment->length;
+    uint8_t *flags = calloc(length + 1, sizeof(*flags));
+    size_t *pc2ir  = calloc(length + 1, sizeof(*pc2ir));
+    IR_Program *ir = calloc(1, sizeof(*ir));
+    if (!flags || !pc2ir || !ir)
+        goto error;
+
+    size_t capacity = length + 1;
+    da_init(ir, capacity);
+
+    if (!mark_leaders(bc, flags, &ir->source_length))
+        goto error;
+
+    Translator t = {.bc = bc, .ir = ir};
+    size_t pc    = 0;
+    while (pc < length) {
+        pc2ir[pc] = ir->length;
+
+        t.emit    = false;
+        translate_block(&t, pc, flags);
+        if (t.failed)
+            goto error;
+
+        t.emit      = true;
+        t.temp_base = t.max_depth;
+        pc = translate_block(&t, pc, flags);
+        if (t.failed)
+            goto error;
+    }
+
+    // Jump targets were emitted as bytecode addresses, they're all leaders
+    // and thus have an IR counterpart
+    for (size_t i = 0; i < ir->length; ++i) {
+        IR_Instruction *ins = &ir->data[i];
+        if (ins->op == IR_JMP || ins->op == IR_JT || ins->op == IR_JF ||
+            ins->op == IR_CALL || (ins->op >= IR_JEQI && ins->op <= IR_JGEI))
+            ins->dst = pc2ir[ins->dst];
+    }
+    ir->entry_point = pc2ir[bc->entry_point];
+
+    free(flags);
+    free(pc2ir);
+
+    return ir;
+
+error:
+    free(flags);
+    free(pc2ir);
+    if (ir)
+        ir_free(ir);
+    return NULL;
+}
+
+void ir_free(IR_Program *ir)
+{
+    free(ir->data);
+    free(ir);
+}
+
+void ir_disassemble(const IR_Program *ir)
+{
+    for (size_t i = 0; i < ir->length; ++i) {
+        const IR_Instruction *ins = &ir->data[i];
+        if (ir->entry_point == i)
+            printf(".main\n");
+        printf("\t%04lX %-11s", i, ir_ops_table[ins->op]);
+        switch (ins->op) {
+        case IR_MOV:
+        case IR_LOAD:
+            printf(" r%d, r%d", ins->dst, ins->a);
+            break;
+        case IR_MOVI:
+        case IR_LOADI:
+            printf(" r%d, %llu", ins->dst, ins->imm);
+            break;
+        case IR_STORE:
+            printf(" r%d, r%d", ins->a, ins->b);
+            break;
+        case IR_STOREI:
+            printf(" %llu, r%d", ins->imm, ins->a);
+            break;
+        case IR_LOADX:
+            printf(" r%d, %llu[r%d]", ins->dst, ins->imm, ins->a);
+            break;
+        case IR_STOREX:
+            printf(" %llu[r%d], r%d", ins->imm, ins->a, ins->b);
+            break;
+        case IR_ADDI:
+        case IR_SUBI:
+        case IR_MULI:
+            printf(" r%d, r%d, %llu", ins->dst, ins->a, ins->imm);
+            break;
+        case IR_PRINT:
+        case IR_PRINT_CONST:
+            printf(" r%d", ins->a);
+            break;
+        case IR_MAP:
+            printf(" r%d, %s", ins->a, instructions_table[ins->imm]);
+            break;
+        case IR_ADJ:
+        case IR_RET:
+        case IR_HALT:
+            printf(" bp%+d", ins->a);
+            break;
+        case IR_JMP:
+        case IR_JT:
+        case IR_JF:
+        case IR_CALL:
+            printf(" bp%+d, [%04X]", ins->a, ins->dst);
+            break;
+        case IR_JEQI:
+        case IR_JNEI:
+        case IR_JLTI:
+        case IR_JLEI:
+        case IR_JGTI:
+        case IR_JGEI:
+            printf(" bp%+d, %llu, [%04X]", ins->a, ins->imm, ins->dst);
+            break;
+        default:
+            printf(" r%d, r%d, r%d", ins->dst, ins->a, ins->b);
+            break;
+        }
+        printf("\n");
+    }
+}
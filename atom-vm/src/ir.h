@@ -0,0 +1,87 @@
+#ifndef IR_H
+#define IR_H
+
+#include "bytecode.h"
+#include <stdint.h>
+
+// Register based intermediate representation, the stack bytecode of the .main
+// block and of each .PROC is translated at load time one basic block at a
+// time. Within a block the stack depth is known statically, so every stack
+// slot becomes a register addressed relative to the stack top at the start of
+// the block (`bp`), negative registers being the values inherited from the
+// previous block. Pushes and pops of constants and stack shuffles disappear,
+// only the operations actually computing something are emitted.
+//
+// Blocks communicate only through the real stack: at the end of each block
+// the values are written back to their slot and `bp` is adjusted by the net
+// stack effect of the block.
+typedef enum {
+    IR_MOV,         // r[dst] = r[a]
+    IR_MOVI,        // r[dst] = imm
+    IR_LOAD,        // r[dst] = memory[r[a]]
+    IR_LOADI,       // r[dst] = memory[imm]
+    IR_STORE,       // memory[r[a]] = r[b]
+    IR_STOREI,      // memory[imm] = r[a]
+    IR_LOADX,       // r[dst] = memory[imm + r[a]]
+    IR_STOREX,      // memory[imm + r[a]] = r[b]
+    IR_ADD,         // r[dst] = r[a] + r[b]
+    IR_SUB,         // r[dst] = r[a] - r[b]
+    IR_MUL,         // r[dst] = r[a] * r[b]
+    IR_DIV,         // r[dst] = r[a] / r[b]
+    IR_ADDI,        // r[dst] = r[a] + imm
+    IR_SUBI,        // r[dst] = r[a] - imm
+    IR_MULI,        // r[dst] = r[a] * imm
+    IR_EQ,          // r[dst] = r[a] == r[b]
+    IR_LT,          // r[dst] = r[a] < r[b]
+    IR_GT,          // r[dst] = r[a] > r[b]
+    IR_LE,          // r[dst] = r[a] <= r[b]
+    IR_GE,          // r[dst] = r[a] >= r[b]
+    IR_PRINT,       // print r[a] as a string pointer or as a number
+    IR_PRINT_CONST, // print r[a] as a number
+    IR_MAP,         // run the MAP_* instruction imm with bp + a as the stack
+                    // top, live values being flushed to their slots first
+    // Block terminators, all of them first move bp by `a` slots, jump
+    // targets in `dst` are indexes of IR instructions
+    IR_ADJ,  // fall through to the next block
+    IR_JMP,  // goto dst
+    IR_JT,   // if bp[-1] pop and goto dst
+    IR_JF,   // if !bp[-1] pop and goto dst
+    IR_JEQI, // pop, goto dst if == imm
+    IR_JNEI, // pop, goto dst if != imm
+    IR_JLTI, // pop, goto dst if < imm
+    IR_JLEI, // pop, goto dst if <= imm
+    IR_JGTI, // pop, goto dst if > imm
+    IR_JGEI, // pop, goto dst if >= imm
+    IR_CALL, // push the next instruction on the call stack, goto dst, imm
+             // holds the bytecode address of the procedure
+    IR_RET,  // goto the instruction popped from the call stack
+    IR_HALT, // pop the result and stop
+    NUM_IR_OPS
+} IR_Op;
+
+typedef struct ir_instruction {
+    IR_Op op;
+    int32_t dst, a, b;
+    Word imm;
+} IR_Instruction;
+
+typedef struct ir_program {
+    IR_Instruction *data;
+    size_t length;
+    size_t capacity;
+    size_t entry_point;
+    // Number of stack instructions translated, for statistics only
+    size_t source_length;
+} IR_Program;
+
+// Translate the whole code segment, returns NULL if the bytecode uses
+// something that can't be resolved statically (e.g. a jump in the middle of
+// an instruction or a MAKE_TUPLE with a size only known at runtime), in which
+// case it has to run on the stack interpreter
+IR_Program *ir_translate(const Byte_Code *bc);
+
+void ir_free(IR_Program *ir);
+
+void ir_disassemble(const IR_Program *ir);
+
+#endif // IR_H
@@ -0,0 +1,173 @@
+#include "map.h"
+#include <stdlib.h>
+
+#define MAP_INITIAL_CAPACITY 16
+
+static uint32_t mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (uint32_t)h;
+}
+
+static uint32_t map_hash(const Map *m, Word key)
+{
+    if (m->kind == MAP_INT_KEYS)
+        return mix(key);
+
+    // FNV-1a over the characters of the string
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (Word i = key; i < m->memory_size && m->memory[i] != 0; ++i)
+        h = (h ^ m->memory[i]) * 0x100000001b3ULL;
+    return mix(h);
+}
+
+static bool map_key_equal(const Map *m, Word a, Word b)
+{
+    if (a == b)
+        return true;
+    if (m->kind == MAP_INT_KEYS)
+        return false;
+
+    for (;; ++a, ++b) {
+        Word ca = a < m->memory_size ? m->memory[a] : 0;
+        Word cb = b < m->memory_size ? m->memory[b] : 0;
+        if (ca != cb)
+            return false;
+        if (ca == 0)
+            return true;
+    }
+}
+
+static int map_resize(Map *m, size_t capacity)
+{
+    Map_Slot *old   = m->slots;
+    size_t old_size = old ? m->mask + 1 : 0;
+
+    m->slots        = calloc(capacity, sizeof(*m->slots));
+    if (!m->slots) {
+        m->slots = old;
+        return -1;
+    }
+    m->mask   = capacity - 1;
+    m->length = 0;
+
+    for (size_t i = 0; i < old_size; ++i) {
+        if (old[i].dist != 0)
+            map_put(m, old[i].key, old[i].value);
+    }
+    free(old);
+
+    return 0;
+}
+
+Map *map_create(Map_Kind kind, const Word *memory, size_t memory_size)
+{
+    Map *m = calloc(1, sizeof(*m));
+    if (!m)
+        return NULL;
+
+    m->kind        = kind;
+    m->memory      = memory;
+    m->memory_size = memory_size;
+    if (map_resize(m, MAP_INITIAL_CAPACITY) < 0) {
+        free(m);
+        return NULL;
+    }
+
+    return m;
+}
+
+void map_free(Map *m)
+{
+    if (!m)
+        return;
+    free(m->slots);
+    free(m);
+}
+
+// Robin Hood insertion: walking the probe sequence, an entry closer to its
+// home slot than the one being inserted gives its place up and is carried
+// further instead, which keeps every probe sequence short
+int map_put(Map *m, Word key, Word value)
+{
+    // Grow past a 7/8 load factor
+    if ((m->length + 1) * 8 > (m->mask + 1) * 7 &&
+        map_resize(m, (m->mask + 1) * 2) < 0)
+        return -1;
+
+    Map_Slot entry = {.key = key, .value = value, .hash = map_hash(m, key)};
+    bool carried   = false;
+    entry.dist     = 1;
+
+    for (size_t i = entry.hash & m->mask;; i = (i + 1) & m->mask) {
+        Map_Slot *s = &m->slots[i];
+        if (s->dist == 0) {
+            *s = entry;
+            m->length++;
+            return 0;
+        }
+        // Only the key being inserted can already be in the table
+        if (!carried && s->hash == entry.hash &&
+            map_key_equal(m, s->key, entry.key)) {
+            s->value = entry.value;
+            return 0;
+        }
+        if (s->dist < entry.dist) {
+            Map_Slot tmp = *s;
+            *s           = entry;
+            entry        = tmp;
+            carried      = true;
+        }
+        entry.dist++;
+    }
+}
+
+static Map_Slot *map_find(const Map *m, Word key)
+{
+    uint32_t hash = map_hash(m, key);
+    uint32_t dist = 1;
+
+    // An entry further from home than the probed one would have taken its
+    // place, the key can't be past it
+    for (size_t i = hash & m->mask; m->slots[i].dist >= dist;
+         i = (i + 1) & m->mask, ++dist) {
+        Map_Slot *s = &m->slots[i];
+        if (s->hash == hash && map_key_equal(m, s->key, key))
+            return s;
+    }
+
+    return NULL;
+}
+
+bool map_get(const Map *m, Word key, Word *value)
+{
+    const Map_Slot *s = map_find(m, key);
+    if (!s)
+        return false;
+
+    *value = s->value;
+    return true;
+}
+
+// Backward shift deletion, the entries following the removed one are moved
+// one slot closer to home until an empty slot or one already at home, no
+// tombstones are left behind
+bool map_del(Map *m, Word key)
+{
+    Map_Slot *s = map_find(m, key);
+    if (!s)
+        return false;
+
+    size_t i = s - m->slots;
+    for (size_t next = (i + 1) & m->mask; m->slots[next].dist > 1;
+         i = next, next = (next + 1) & m->mask) {
+        m->slots[i] = m->slots[next];
+        m->slots[i].dist--;
+    }
+    m->slots[i] = (Map_Slot){0};
+    m->length--;
+
+    return true;
+}
@@ -0,0 +1,43 @@
+#ifndef MAP_H
+#define MAP_H
+
+#include "bytecode.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum { MAP_INT_KEYS, MAP_STRING_KEYS } Map_Kind;
+
+// Robin Hood open-addressing table from a Word key to a Word value. Integer
+// maps compare keys by value, string maps treat the key as a pointer to a nul
+// terminated string in the VM memory (one character per word, like PRINT) and
+// compare the strings, which must not change while used as keys
+typedef struct map_slot {
+    Word key;
+    Word value;
+    uint32_t hash;
+    // Distance from the home slot + 1, 0 marks an empty slot
+    uint32_t dist;
+} Map_Slot;
+
+typedef struct map {
+    Map_Kind kind;
+    Map_Slot *slots;
+    size_t mask;
+    size_t length;
+    // Memory the string keys point into
+    const Word *memory;
+    size_t memory_size;
+} Map;
+
+Map *map_create(Map_Kind kind, const Word *memory, size_t memory_size);
+
+void map_free(Map *m);
+
+// Returns -1 if out of memory
+int map_put(Map *m, Word key, Word value);
+
+bool map_get(const Map *m, Word key, Word *value);
+
+bool map_del(Map *m, Word key);
+
+#endif // MAP_H
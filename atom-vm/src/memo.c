@@ -0,0 +1,62 @@
+#include "memo.h"
+#include <string.h>
+
+static size_t memo_hash(size_t proc, const Word *args, size_t arity)
+{
+    // FNV-1a over the words, followed by a final avalanche to spread the
+    // small consecutive integers most arguments are
+    uint64_t h = 0xcbf29ce484222325ULL ^ proc;
+    for (size_t i = 0; i < arity; ++i)
+        h = (h ^ args[i]) * 0x100000001b3ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+int memo_init(Memo_Cache *m, size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+
+    m->entries = calloc(size, sizeof(*m->entries));
+    if (!m->entries)
+        return -1;
+
+    m->mask   = size - 1;
+    m->hits   = 0;
+    m->misses = 0;
+
+    return 0;
+}
+
+void memo_free(Memo_Cache *m)
+{
+    free(m->entries);
+    m->entries = NULL;
+}
+
+bool memo_lookup(Memo_Cache *m, size_t proc, const Word *args, size_t arity,
+                 Word *result)
+{
+    const Memo_Entry *e = &m->entries[memo_hash(proc, args, arity) & m->mask];
+    if (e->proc != proc + 1 ||
+        memcmp(e->args, args, arity * sizeof(*args)) != 0) {
+        m->misses++;
+        return false;
+    }
+
+    m->hits++;
+    *result = e->result;
+    return true;
+}
+
+void memo_store(Memo_Cache *m, size_t proc, const Word *args, size_t arity,
+                Word result)
+{
+    Memo_Entry *e = &m->entries[memo_hash(proc, args, arity) & m->mask];
+    e->proc       = proc + 1;
+    e->result     = result;
+    memcpy(e->args, args, arity * sizeof(*args));
+}
@@ -0,0 +1,36 @@
+#ifndef MEMO_H
+#define MEMO_H
+
+#include "bytecode.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Results of the calls to `.PROC pure` procedures, keyed by the procedure and
+// the values of its arguments. The cache is direct-mapped with a fixed number
+// of entries, a colliding call simply evicts the previous result
+typedef struct memo_entry {
+    // Index of the procedure + 1, 0 marks an empty entry
+    Word proc;
+    Word args[PURE_MAX_ARITY];
+    Word result;
+} Memo_Entry;
+
+typedef struct memo_cache {
+    Memo_Entry *entries;
+    size_t mask;
+    uint64_t hits;
+    uint64_t misses;
+} Memo_Cache;
+
+// Capacity is rounded up to the next power of two
+int memo_init(Memo_Cache *m, size_t capacity);
+
+void memo_free(Memo_Cache *m);
+
+bool memo_lookup(Memo_Cache *m, size_t proc, const Word *args, size_t arity,
+                 Word *result);
+
+void memo_store(Memo_Cache *m, size_t proc, const Word *args, size_t arity,
+                Word result);
+
+#endif // MEMO_H
@@ -1,3 +1,4 @@
+#define _DEFAULT_SOURCE 1
 #include "parser.h"
 #include <ctype.h>
 #include <errno.h>
@@ -21,6 +22,7 @@ typedef enum {
     TOKEN_SECTION,
     TOKEN_PROC_DEF,
     TOKEN_PROC,
+    TOKEN_PROC_ATTR,
     TOKEN_DIRECTIVE,
     TOKEN_COMMA,
     TOKEN_NEWLINE,
@@ -33,11 +35,12 @@ static const char *directives_table[] = {"db", "dw", "dd", "dq", "rb",
                                          "rw", "rd", "rq", NULL};
 
 static const char *tokens[]           = {
-    "TOKEN_LABEL",    "TOKEN_INSTR",   "TOKEN_STRING",
-    "TOKEN_CONSTANT", "TOKEN_ADDRESS", "TOKEN_SECTION",
-    "TOKEN_PROC_DEF", "TOKEN_PROC",    "TOKEN_DIRECTIVE",
-    "TOKEN_COMMA",    "TOKEN_NEWLINE", "TOKEN_COMMENT",
-    "TOKEN_UNKNOWN",  "TOKEN_EOF",     NULL};
+    "TOKEN_LABEL",     "TOKEN_INSTR",     "TOKEN_STRING",
+    "TOKEN_CONSTANT",  "TOKEN_ADDRESS",   "TOKEN_SECTION",
+    "TOKEN_PROC_DEF",  "TOKEN_PROC",      "TOKEN_PROC_ATTR",
+    "TOKEN_DIRECTIVE", "TOKEN_COMMA",     "TOKEN_NEWLINE",
+    "TOKEN_COMMENT",   "TOKEN_UNKNOWN",   "TOKEN_EOF",
+    NULL};
 
 // =============
 // LEXER APIs
@@ -88,11 +91,12 @@ static inline char lexer_next_char(Lexer *l)
 }
 
 // Assume nul characteer always present
-#define is_label(token)    ((token)[strlen(token) - 1] == LABEL_END)
-#define is_section(token)  ((token)[0] == SECTION_START)
-#define is_proc_def(token) (strncasecmp((token), ".PROC", strlen(token)) == 0)
-#define is_comment(token)  ((token)[0] == COMMENT_START)
-#define is_hexvalue(token) (strncasecmp(token, "0x", 2) == 0)
+#define is_label(token)     ((token)[strlen(token) - 1] == LABEL_END)
+#define is_section(token)   ((token)[0] == SECTION_START)
+#define is_proc_def(token)  (strncasecmp((token), ".PROC", strlen(token)) == 0)
+#define is_proc_attr(token) (strcasecmp((token), "pure") == 0)
+#define is_comment(token)   ((token)[0] == COMMENT_START)
+#define is_hexvalue(token)  (strncasecmp(token, "0x", 2) == 0)
 
 static bool is_label_name(const char *str)
 {
@@ -211,7 +215,11 @@ static int lexer_next(Lexer *l, Token *t, Token_Type prev)
         }
 
         if (is_label(t->value)) {
-            t->type = prev == TOKEN_PROC_DEF ? TOKEN_PROC : TOKEN_LABEL;
+            t->type = prev == TOKEN_PROC_DEF || prev == TOKEN_PROC_ATTR
+                          ? TOKEN_PROC
+                          : TOKEN_LABEL;
+        } else if (prev == TOKEN_PROC_DEF && is_proc_attr(t->value)) {
+            t->type = TOKEN_PROC_ATTR;
         } else if (is_proc_def(t->value)) {
             t->type = TOKEN_PROC_DEF;
         } else if (is_section(t->value)) {
@@ -292,6 +300,9 @@ typedef struct symbol_entry {
 struct unresolved_symbol {
     char name[SYMBOL_NAME_SIZE];
     int addr;
+    // Constant added to the address of the label, e.g. the field of a tuple
+    // in LOAD_IDXS points+1, 2
+    size_t offset;
 };
 
 typedef struct unresolved_symbol_list {
@@ -352,11 +363,18 @@ ssize_t symbol_get(const void *name)
 
 static void symbol_add_unresolved(const char *name, int addr)
 {
-    if (!symbol_table.unresolved_list.data)
-        symbol_table.unresolved_list.data =
-            calloc(4, sizeof(*symbol_table.unresolved_list.data));
+    if (!symbol_table.unresolved_list.data) {
+        size_t capacity = 4;
+        da_init(&symbol_table.unresolved_list, capacity);
+    }
     struct unresolved_symbol symbol = {.addr = addr};
-    snprintf(symbol.name, 64, "%s:", name);
+    const char *plus                = strchr(name, '+');
+    int length                      = strlen(name);
+    if (plus) {
+        length        = plus - name;
+        symbol.offset = strtoul(plus + 1, NULL, 0);
+    }
+    snprintf(symbol.name, 64, "%.*s:", length, name);
     da_push(&symbol_table.unresolved_list, symbol);
 }
 
@@ -386,6 +404,10 @@ int parser_init(FILE *fp, Parser *p)
     p->current_directive = D_DB;
     p->current           = &tokens->data[0];
     p->current_address   = 0;
+    p->pool_records      = 0;
+    p->pool_hits         = 0;
+    p->pool_saved        = 0;
+    memset(p->pool, 0, sizeof(p->pool));
 
     return 0;
 
@@ -433,10 +455,12 @@ static bool assert_next_token(const Parser *p)
                 parser_expect(p, TOKEN_NEWLINE));
     case TOKEN_COMMA:
         return (parser_expect(p, TOKEN_CONSTANT) ||
+                parser_expect(p, TOKEN_ADDRESS) ||
                 parser_expect(p, TOKEN_COMMENT) ||
                 parser_expect(p, TOKEN_NEWLINE));
     case TOKEN_ADDRESS:
-        return (parser_expect(p, TOKEN_COMMENT) ||
+        return (parser_expect(p, TOKEN_COMMA) ||
+                parser_expect(p, TOKEN_COMMENT) ||
                 parser_expect(p, TOKEN_NEWLINE));
     case TOKEN_COMMENT:
         return (parser_expect(p, TOKEN_NEWLINE) || parser_expect(p, TOKEN_EOF));
@@ -447,6 +471,9 @@ static bool assert_next_token(const Parser *p)
         return (parser_expect(p, TOKEN_COMMENT) ||
                 parser_expect(p, TOKEN_NEWLINE));
     case TOKEN_PROC_DEF:
+        return (parser_expect(p, TOKEN_PROC) ||
+                parser_expect(p, TOKEN_PROC_ATTR));
+    case TOKEN_PROC_ATTR:
         return parser_expect(p, TOKEN_PROC);
     default:
         break;
@@ -466,10 +493,18 @@ static Instruction_ID parse_instruction(const char *str)
 {
     if (strncasecmp(str, "LOAD_CONST", 10) == 0)
         return OP_LOAD_CONST;
+    if (strncasecmp(str, "LOAD_IDXS", 9) == 0)
+        return OP_LOAD_IDXS;
+    if (strncasecmp(str, "LOAD_IDX", 8) == 0)
+        return OP_LOAD_IDX;
     if (strncasecmp(str, "LOAD", 4) == 0)
         return OP_LOAD;
     if (strncasecmp(str, "STORE_CONST", 11) == 0)
         return OP_STORE_CONST;
+    if (strncasecmp(str, "STORE_IDXS", 10) == 0)
+        return OP_STORE_IDXS;
+    if (strncasecmp(str, "STORE_IDX", 9) == 0)
+        return OP_STORE_IDX;
     if (strncasecmp(str, "STORE", 5) == 0)
         return OP_STORE;
     if (strncasecmp(str, "CALL", 4) == 0)
@@ -478,10 +513,20 @@ static Instruction_ID parse_instruction(const char *str)
         return OP_PUSH_CONST;
     if (strncasecmp(str, "PUSH", 4) == 0)
         return OP_PUSH;
+    if (strncasecmp(str, "ADD_I", 5) == 0)
+        return OP_ADD_I;
     if (strncasecmp(str, "ADD", 3) == 0)
         return OP_ADD;
+    if (strncasecmp(str, "SPAWN", 5) == 0)
+        return OP_SPAWN;
+    if (strncasecmp(str, "SYNC", 4) == 0)
+        return OP_SYNC;
+    if (strncasecmp(str, "SUB_I", 5) == 0)
+        return OP_SUB_I;
     if (strncasecmp(str, "SUB", 3) == 0)
         return OP_SUB;
+    if (strncasecmp(str, "MUL_I", 5) == 0)
+        return OP_MUL_I;
     if (strncasecmp(str, "MUL", 3) == 0)
         return OP_MUL;
     if (strncasecmp(str, "DIV", 3) == 0)
@@ -492,10 +537,22 @@ static Instruction_ID parse_instruction(const char *str)
         return OP_RET;
     if (strncasecmp(str, "JMP", 3) == 0)
         return OP_JMP;
+    if (strncasecmp(str, "JNE_I", 5) == 0)
+        return OP_JNE_I;
     if (strncasecmp(str, "JNE", 3) == 0)
         return OP_JNE;
+    if (strncasecmp(str, "JLT_I", 5) == 0)
+        return OP_JLT_I;
+    if (strncasecmp(str, "JLE_I", 5) == 0)
+        return OP_JLE_I;
+    if (strncasecmp(str, "JGT_I", 5) == 0)
+        return OP_JGT_I;
+    if (strncasecmp(str, "JGE_I", 5) == 0)
+        return OP_JGE_I;
     if (strncasecmp(str, "MAKE_TUPLE", 10) == 0)
         return OP_MAKE_TUPLE;
+    if (strncasecmp(str, "JEQ_I", 5) == 0)
+        return OP_JEQ_I;
     if (strncasecmp(str, "JEQ", 3) == 0)
         return OP_JEQ;
     if (strncasecmp(str, "RET", 3) == 0)
@@ -504,12 +561,40 @@ static Instruction_ID parse_instruction(const char *str)
         return OP_DUP;
     if (strncasecmp(str, "EQ", 2) == 0)
         return OP_EQ;
+    if (strncasecmp(str, "LT", 2) == 0)
+        return OP_LT;
+    if (strncasecmp(str, "GT", 2) == 0)
+        return OP_GT;
+    if (strncasecmp(str, "LE", 2) == 0)
+        return OP_LE;
+    if (strncasecmp(str, "GE", 2) == 0)
+        return OP_GE;
     if (strncasecmp(str, "PRINT_CONST", 11) == 0)
         return OP_PRINT_CONST;
     if (strncasecmp(str, "PRINT", 5) == 0)
         return OP_PRINT;
     if (strncasecmp(str, "HALT", 4) == 0)
         return OP_HALT;
+    if (strncasecmp(str, "SWAP", 4) == 0)
+        return OP_SWAP;
+    if (strncasecmp(str, "OVER", 4) == 0)
+        return OP_OVER;
+    if (strncasecmp(str, "ROT", 3) == 0)
+        return OP_ROT;
+    if (strncasecmp(str, "DROP", 4) == 0)
+        return OP_DROP;
+    if (strncasecmp(str, "PICK", 4) == 0)
+        return OP_PICK;
+    if (strncasecmp(str, "MAP_NEW", 7) == 0)
+        return OP_MAP_NEW;
+    if (strncasecmp(str, "MAP_PUT", 7) == 0)
+        return OP_MAP_PUT;
+    if (strncasecmp(str, "MAP_GET", 7) == 0)
+        return OP_MAP_GET;
+    if (strncasecmp(str, "MAP_DEL", 7) == 0)
+        return OP_MAP_DEL;
+    if (strncasecmp(str, "MAP_LEN", 7) == 0)
+        return OP_MAP_LEN;
     return -1;
 }
 
@@ -553,17 +638,67 @@ static Directive parse_directive(const char *value)
     return -1;
 }
 
+// Constant pool, read-only data (DB, DW, DD, DQ) with the same type and value
+// is stored once and every label defined on it refers to the same address,
+// generated code tends to repeat the same literals over and over. Each bucket
+// chains the indexes of the records in the data segment
+struct pool_entry {
+    size_t record;
+    struct pool_entry *next;
+};
+
+static unsigned pool_hash(const Data_Record *r)
+{
+    if (r->type == DT_STRING)
+        return simple_hash((const uint8_t *)r->as_str) % POOL_TABLE_SIZE;
+    return (r->as_int * 0x9e3779b97f4a7c15ULL >> 32) % POOL_TABLE_SIZE;
+}
+
+// Return the address of the record already pooled with the same content, or
+// add it to the data segment and to the pool
+static Word pool_intern(Parser *p, Byte_Code *bc, const Data_Record *record,
+                        size_t words)
+{
+    unsigned index = pool_hash(record);
+    for (Pool_Entry *e = p->pool[index]; e; e = e->next) {
+        const Data_Record *r = &bc->data_segment->data[e->record];
+        if (r->type == record->type &&
+            (r->type == DT_STRING ? strcmp(r->as_str, record->as_str) == 0
+                                  : r->as_int == record->as_int)) {
+            p->pool_hits++;
+            p->pool_saved += words;
+            return r->address;
+        }
+    }
+
+    Pool_Entry *entry = calloc(1, sizeof(*entry));
+    if (entry) {
+        entry->record        = bc->data_segment->length;
+        entry->next     = p->pool[index];
+        p->pool[index] = entry;
+    }
+
+    da_push(bc->data_segment, *record);
+    p->pool_records++;
+    return record->address;
+}
+
 // RD_DATA_OFFSET 1024
-static void store_constant(Byte_Code *bc, uint64_t constant)
+static Word store_constant(Parser *p, Byte_Code *bc, uint64_t constant)
 {
     Data_Record record = {.type    = DT_CONSTANT,
-                          .address = bc->data_segment->rd_data_addr_offset++,
+                          .address = bc->data_segment->rd_data_addr_offset,
                           .as_int  = constant};
-    da_push(bc->data_segment, record);
+
+    Word address       = pool_intern(p, bc, &record, 1);
+    if (address == record.address)
+        bc->data_segment->rd_data_addr_offset++;
+    return address;
 }
 
 // RD_STRING_OFFSET 2048
-static void store_string(Byte_Code *bc, const char *data, size_t len)
+static Word store_string(Parser *p, Byte_Code *bc, const char *data,
+                         size_t len)
 {
     Data_Record record = {.type    = DT_STRING,
                           .address = bc->data_segment->rd_string_addr_offset};
@@ -572,11 +707,14 @@ static void store_string(Byte_Code *bc, const char *data, size_t len)
     while (len--)
         record.as_str[i++] = *data++;
 
-    // nul
+    // nul, a word is reserved for it in memory too so that consecutive
+    // strings don't run into each other
     record.as_str[i] = 0;
-    bc->data_segment->rd_string_addr_offset += i;
 
-    da_push(bc->data_segment, record);
+    Word address     = pool_intern(p, bc, &record, i + 1);
+    if (address == record.address)
+        bc->data_segment->rd_string_addr_offset += i + 1;
+    return address;
 }
 
 // - 1 byte (half-word)
@@ -638,13 +776,12 @@ static int parse_data_section_token(Parser *p, Byte_Code *bc)
 
             cur = parser_next(p);
 
-            if (cur->type == TOKEN_CONSTANT) {
-                symbol_put(label_name, bc->data_segment->rd_data_addr_offset);
-                store_constant(bc, parse_constant(cur->value));
-            } else {
-                symbol_put(label_name, bc->data_segment->rd_string_addr_offset);
-                store_string(bc, cur->value, cur->value_len);
-            }
+            if (cur->type == TOKEN_CONSTANT)
+                symbol_put(label_name,
+                           store_constant(p, bc, parse_constant(cur->value)));
+            else
+                symbol_put(label_name, store_string(p, bc, cur->value,
+                                                    cur->value_len));
         }
         break;
     }
@@ -669,6 +806,143 @@ parser_error:
     return -1;
 }
 
+// Procedures are recorded in source order, their end is only known once the
+// whole code segment has been parsed, see `resolve_procedures_end`
+static void add_procedure(Byte_Code *bc, const char *label, size_t address,
+                          bool pure, size_t arity)
+{
+    Procedure proc = {
+        .start = address, .end = address, .pure = pure, .arity = arity};
+    snprintf(proc.name, LABEL_SIZE, "%.*s", (int)(strlen(label) - 1), label);
+    da_push(bc->procedures, proc);
+}
+
+// Split a `name/arity:` procedure label into the `name:` symbol and the
+// arity, which is optional and defaults to 0
+static int parse_procedure_label(const char *value, char *name, size_t *arity)
+{
+    const char *slash = strchr(value, '/');
+    if (!slash) {
+        snprintf(name, LABEL_SIZE, "%s", value);
+        *arity = 0;
+        return 0;
+    }
+
+    char *end = NULL;
+    errno     = 0;
+    *arity    = strtoul(slash + 1, &end, 10);
+    if (errno != 0 || end == slash + 1 || *end != LABEL_END)
+        return -1;
+
+    snprintf(name, LABEL_SIZE, "%.*s:", (int)(slash - value), value);
+    return 0;
+}
+
+// A pure procedure is memoized by the VM on its arguments, it can't have side
+// effects nor call any impure procedure. Memory reads are allowed, e.g. for
+// lookup tables, but are expected to only touch data that never changes
+static int check_pure_procedures(const Byte_Code *bc)
+{
+    const Procedures *procs = bc->procedures;
+    const Word *code        = bc->code_segment->data;
+
+    for (size_t i = 0; i < procs->length; ++i) {
+        const Procedure *proc = &procs->data[i];
+        if (!proc->pure)
+            continue;
+
+        for (size_t pc = proc->start; pc < proc->end;
+             pc += 1 + bc_instruction_arity(code[pc])) {
+            Word op = code[pc];
+            // Maps change between calls, even reading one isn't pure. Tasks
+            // run procedures the check doesn't follow
+            bool map  = op >= OP_MAP_NEW && op <= OP_MAP_LEN;
+            bool task = op == OP_SPAWN || op == OP_SYNC;
+            if (op == OP_STORE || op == OP_STORE_CONST ||
+                op == OP_STORE_IDX || op == OP_STORE_IDXS || op == OP_PRINT ||
+                op == OP_PRINT_CONST || op == OP_MAKE_TUPLE || map || task) {
+                fprintf(stderr, "pure procedure %s uses %s\n", proc->name,
+                        instructions_table[op]);
+                return -1;
+            }
+            // Code outside of the body isn't checked, jumping there could run
+            // anything
+            bool fused = op >= OP_JEQ_I && op <= OP_JGE_I;
+            if (op == OP_JMP || op == OP_JEQ || op == OP_JNE || fused) {
+                Word target = code[pc + (fused ? 2 : 1)];
+                if (target < proc->start || target >= proc->end) {
+                    fprintf(stderr, "pure procedure %s jumps out of its body\n",
+                            proc->name);
+                    return -1;
+                }
+            }
+            if (op != OP_CALL)
+                continue;
+
+            const Procedure *callee = NULL;
+            for (size_t j = 0; j < procs->length && !callee; ++j) {
+                if (procs->data[j].start == code[pc + 1])
+                    callee = &procs->data[j];
+            }
+            if (!callee || !callee->pure) {
+                fprintf(stderr, "pure procedure %s calls impure code\n",
+                        proc->name);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// A task runs a procedure on the arguments it declares, SPAWN can only target
+// the start of a .PROC
+static int check_spawn_targets(const Byte_Code *bc)
+{
+    const Procedures *procs = bc->procedures;
+    const Word *code        = bc->code_segment->data;
+    size_t length           = bc->code_segment->length;
+
+    for (size_t pc = 0; pc < length; pc += 1 + bc_instruction_arity(code[pc])) {
+        if (code[pc] != OP_SPAWN)
+            continue;
+
+        bool found = false;
+        for (size_t i = 0; i < procs->length && !found; ++i)
+            found = procs->data[i].start == code[pc + 1];
+        if (!found) {
+            fprintf(stderr, "SPAWN at %04lX doesn't target a procedure\n", pc);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void resolve_procedures_end(Byte_Code *bc)
+{
+    Procedures *procs = bc->procedures;
+    for (size_t i = 0; i < procs->length; ++i) {
+        size_t end = i + 1 < procs->length ? procs->data[i + 1].start
+                                           : bc->code_segment->length;
+        if (bc->entry_point > procs->data[i].start && bc->entry_point < end)
+            end = bc->entry_point;
+        procs->data[i].end = end;
+    }
+}
+
+static void parse_operand(Parser *p, Byte_Code *bc)
+{
+    Token *cur = parser_next(p);
+    if (is_label_name(cur->value)) {
+        symbol_add_unresolved(cur->value, p->current_address);
+        da_push(bc->code_segment, -1);
+    } else {
+        da_push(bc->code_segment, parse_constant(cur->value));
+    }
+    p->current_address++;
+}
+
 static int parse_main_section_token(Parser *p, Byte_Code *bc)
 {
     Token *cur = parser_current(p);
@@ -677,27 +951,55 @@ static int parse_main_section_token(Parser *p, Byte_Code *bc)
     case TOKEN_LABEL:
         symbol_put(cur->value, p->current_address);
         break;
-    case TOKEN_PROC_DEF:
+    case TOKEN_PROC_DEF: {
+        bool pure = false;
+        if (parser_expect(p, TOKEN_PROC_ATTR)) {
+            parser_advance(p);
+            pure = true;
+        }
         if (!parser_expect(p, TOKEN_PROC))
             goto parser_error;
         cur = parser_next(p);
-        symbol_put(cur->value, p->current_address);
+
+        char name[LABEL_SIZE];
+        size_t arity = 0;
+        if (parse_procedure_label(cur->value, name, &arity) < 0 ||
+            (pure && (!strchr(cur->value, '/') || arity > PURE_MAX_ARITY))) {
+            fprintf(stderr,
+                    "invalid procedure %s at line %lu, pure procedures "
+                    "need an arity between 0 and %d e.g. fib/1:\n",
+                    cur->value, p->lines, PURE_MAX_ARITY);
+            return -1;
+        }
+        symbol_put(name, p->current_address);
+        add_procedure(bc, name, p->current_address, pure, arity);
         break;
+    }
     case TOKEN_INSTR: {
         Instruction_ID op_code = parse_instruction(cur->value);
+        size_t operands        = 0;
+        if (op_code < 0 || op_code >= NUM_INSTRUCTIONS) {
+            fprintf(stderr, "unknown instruction %s at line %lu\n", cur->value,
+                    p->lines);
+            return -1;
+        }
         da_push(bc->code_segment, op_code);
         p->current_address++;
-        if (parser_expect(p, TOKEN_CONSTANT) ||
-            parser_expect(p, TOKEN_ADDRESS)) {
-            cur = parser_next(p);
-            if (is_label_name(cur->value)) {
-                symbol_add_unresolved(cur->value, p->current_address);
-                da_push(bc->code_segment, -1);
-                p->current_address++;
-            } else {
-                da_push(bc->code_segment, parse_constant(cur->value));
-                p->current_address++;
-            }
+        // Operands are comma separated, e.g. the fused compare and branch
+        // instructions take both an immediate and a jump target
+        while (parser_expect(p, TOKEN_CONSTANT) ||
+               parser_expect(p, TOKEN_ADDRESS)) {
+            parse_operand(p, bc);
+            operands++;
+            if (!parser_expect(p, TOKEN_COMMA))
+                break;
+            parser_advance(p);
+        }
+        if (operands != bc_instruction_arity(op_code)) {
+            fprintf(stderr, "%s expects %lu operand(s), got %lu at line %lu\n",
+                    instructions_table[op_code],
+                    bc_instruction_arity(op_code), operands, p->lines);
+            return -1;
         }
         break;
     }
@@ -762,6 +1064,7 @@ Byte_Code *parser_run(Parser *p)
     }
 
     bc->entry_point = entry_point;
+    resolve_procedures_end(bc);
 
     // 2nd pass to resolve symbols
     for (size_t i = 0; i < symbol_table.unresolved_list.length; ++i) {
@@ -773,8 +1076,17 @@ Byte_Code *parser_run(Parser *p)
         }
 
         bc->code_segment->data[symbol_table.unresolved_list.data[i].addr] =
-            addr;
+            addr + symbol_table.unresolved_list.data[i].offset;
     }
+
+    if (check_pure_procedures(bc) < 0 || check_spawn_targets(bc) < 0)
+        return NULL;
+
+    if (p->pool_records > 0)
+        printf("[*] Constant pool: %lu records, %lu duplicates folded, %lu "
+               "words saved\n",
+               p->pool_records, p->pool_hits, p->pool_saved);
+
     return bc;
 
 parser_error:
@@ -786,7 +1098,19 @@ parser_error:
     return NULL;
 }
 
-void parser_free(Parser *p) { lexer_token_list_free((Token_List *)p->tokens); }
+void parser_free(Parser *p)
+{
+    for (size_t i = 0; i < POOL_TABLE_SIZE; ++i) {
+        Pool_Entry *e = p->pool[i];
+        while (e) {
+            Pool_Entry *next = e->next;
+            free(e);
+            e = next;
+        }
+        p->pool[i] = NULL;
+    }
+    lexer_token_list_free((Token_List *)p->tokens);
+}
 
 void parser_print_tokens(const Parser *p)
 {
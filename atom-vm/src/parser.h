@@ -5,12 +5,15 @@
 #include <stdlib.h>
 
 typedef struct token Token;
+typedef struct pool_entry Pool_Entry;
 typedef struct token_list {
     Token *data;
     size_t length;
     size_t capacity;
 } Token_List;
 
+#define POOL_TABLE_SIZE 256
+
 // Struct representing the parser for source code, which processes a list of
 // tokens and maintains state such as current token, current address, and label
 // information.
@@ -26,6 +29,14 @@ typedef struct parser {
     Directive current_directive;
     // Current address in the bytecode or source being parsed
     size_t current_address;
+    // Constant pool of the read-only data records, each bucket chains the
+    // indexes of the records in the data segment
+    Pool_Entry *pool[POOL_TABLE_SIZE];
+    // Constant pool statistics: read-only data records written, duplicates
+    // folded into an existing one and memory words saved by doing so
+    size_t pool_records;
+    size_t pool_hits;
+    size_t pool_saved;
 } Parser;
 
 int parser_init(FILE *fp, Parser *p);
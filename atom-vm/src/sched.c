@@ -0,0 +1,238 @@
+#include "sched.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define DEQUE_SIZE 4096
+// Failed attempts at finding a task before an idle worker goes to sleep
+#define IDLE_SPINS 64
+
+// Chase-Lev work-stealing deque with a fixed capacity, the memory orderings
+// follow "Correct and Efficient Work-Stealing for Weak Memory Models"
+// (Lê, Pop, Cohen, Zappa Nardelli, PPoPP 2013)
+typedef struct deque {
+    atomic_long top;
+    atomic_long bottom;
+    _Atomic(Task *) buffer[DEQUE_SIZE];
+} Deque;
+
+typedef struct worker {
+    Deque deque;
+    pthread_t thread;
+    uint64_t seed;
+} Worker;
+
+static Worker *workers       = NULL;
+static size_t workers_length = 0;
+static size_t threads        = 0;
+static atomic_bool stopping  = false;
+static Task_Runner runner    = NULL;
+static void (*worker_enter)(void);
+static void (*worker_leave)(void);
+
+// Idle workers sleep on `wakeup` until a task is queued: `queued` counts the
+// tasks pushed and not taken yet, `sleeping` the workers waiting. Both are
+// seq_cst, a spawner either sees a sleeper or the sleeper sees the task
+static atomic_long queued        = 0;
+static atomic_long sleeping      = 0;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup     = PTHREAD_COND_INITIALIZER;
+
+static _Thread_local Worker *self = NULL;
+
+static bool deque_push(Deque *d, Task *t)
+{
+    long b   = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&d->top, memory_order_acquire);
+    if (b - top >= DEQUE_SIZE)
+        return false;
+
+    // Release rather than the fence of the paper, same code on x86 and
+    // understood by ThreadSanitizer
+    atomic_store_explicit(&d->buffer[b % DEQUE_SIZE], t, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_release);
+    return true;
+}
+
+static Task *deque_take(Deque *d)
+{
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+    if (top > b) {
+        // Empty
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    Task *t = atomic_load_explicit(&d->buffer[b % DEQUE_SIZE],
+                                   memory_order_relaxed);
+    if (top == b) {
+        // Last task, race against the thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+                                                     memory_order_seq_cst,
+                                                     memory_order_relaxed))
+            t = NULL;
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return t;
+}
+
+static Task *deque_steal(Deque *d)
+{
+    long top = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (top >= b)
+        return NULL;
+
+    Task *t = atomic_load_explicit(&d->buffer[top % DEQUE_SIZE],
+                                   memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed))
+        return NULL;
+    return t;
+}
+
+static uint64_t next_random(uint64_t *seed)
+{
+    // xorshift64
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return *seed;
+}
+
+static Task *find_task(void)
+{
+    Task *t = deque_take(&self->deque);
+    if (!t && workers_length > 1) {
+        size_t start = next_random(&self->seed) % workers_length;
+        for (size_t i = 0; i < workers_length && !t; ++i) {
+            Worker *victim = &workers[(start + i) % workers_length];
+            if (victim != self)
+                t = deque_steal(&victim->deque);
+        }
+    }
+    if (t)
+        atomic_fetch_sub(&queued, 1);
+    return t;
+}
+
+static void idle(void)
+{
+    pthread_mutex_lock(&idle_lock);
+    atomic_fetch_add(&sleeping, 1);
+    while (atomic_load(&queued) == 0 &&
+           !atomic_load_explicit(&stopping, memory_order_acquire))
+        pthread_cond_wait(&wakeup, &idle_lock);
+    atomic_fetch_sub(&sleeping, 1);
+    pthread_mutex_unlock(&idle_lock);
+}
+
+static void run(Task *t)
+{
+    runner(t);
+    atomic_store_explicit(&t->done, true, memory_order_release);
+}
+
+static void *worker_loop(void *arg)
+{
+    self = arg;
+    if (worker_enter)
+        worker_enter();
+
+    for (size_t misses = 0;
+         !atomic_load_explicit(&stopping, memory_order_acquire);) {
+        Task *t = find_task();
+        if (t) {
+            run(t);
+            misses = 0;
+        } else if (++misses < IDLE_SPINS) {
+            sched_yield();
+        } else {
+            idle();
+            misses = 0;
+        }
+    }
+
+    if (worker_leave)
+        worker_leave();
+    return NULL;
+}
+
+int sched_init(size_t count, Task_Runner run_task, void (*enter)(void),
+               void (*leave)(void))
+{
+    workers = calloc(count ? count : 1, sizeof(*workers));
+    if (!workers)
+        return -1;
+
+    runner         = run_task;
+    worker_enter   = enter;
+    worker_leave   = leave;
+    workers_length = count ? count : 1;
+    self           = &workers[0];
+    atomic_store(&stopping, false);
+    atomic_store(&queued, 0);
+
+    for (size_t i = 0; i < workers_length; ++i)
+        workers[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+
+    // Go on with the threads started so far if any fails, the deques of the
+    // missing workers just stay empty
+    for (threads = 1; threads < workers_length; ++threads) {
+        if (pthread_create(&workers[threads].thread, NULL, worker_loop,
+                           &workers[threads]) != 0)
+            break;
+    }
+
+    return 0;
+}
+
+void sched_shutdown(void)
+{
+    if (!workers)
+        return;
+
+    atomic_store_explicit(&stopping, true, memory_order_release);
+    pthread_mutex_lock(&idle_lock);
+    pthread_cond_broadcast(&wakeup);
+    pthread_mutex_unlock(&idle_lock);
+    for (size_t i = 1; i < threads; ++i)
+        pthread_join(workers[i].thread, NULL);
+
+    free(workers);
+    workers        = NULL;
+    workers_length = 0;
+    threads        = 0;
+}
+
+void sched_spawn(Task *t)
+{
+    if (!deque_push(&self->deque, t)) {
+        run(t);
+        return;
+    }
+
+    atomic_fetch_add(&queued, 1);
+    if (atomic_load(&sleeping) > 0) {
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_signal(&wakeup);
+        pthread_mutex_unlock(&idle_lock);
+    }
+}
+
+bool sched_help(void)
+{
+    Task *t = find_task();
+    if (!t)
+        return false;
+
+    run(t);
+    return true;
+}
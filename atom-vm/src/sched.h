@@ -0,0 +1,38 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include "bytecode.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// A .PROC started by SPAWN, run to its final RET on a stack of its own by
+// whichever worker gets to it first, then collected by its parent at SYNC
+typedef struct task {
+    Word proc;
+    Word result;
+    int status;
+    atomic_bool done;
+    size_t arity;
+    Word args[];
+} Task;
+
+typedef void (*Task_Runner)(Task *t);
+
+// Fork-join scheduler, each worker owns a Chase-Lev deque: it pushes and
+// takes its own tasks at the bottom, LIFO, while idle workers steal from the
+// top of a random victim. The calling thread is worker 0, `workers` - 1
+// threads are started, `enter` and `leave` run on each of them
+int sched_init(size_t workers, Task_Runner run, void (*enter)(void),
+               void (*leave)(void));
+
+void sched_shutdown(void);
+
+// Queue a task on the deque of the calling worker, it's run right away if the
+// deque is full
+void sched_spawn(Task *t);
+
+// Run one queued task, either from the calling worker's deque or stolen from
+// another one, returns false if none was found
+bool sched_help(void);
+
+#endif // SCHED_H
@@ -0,0 +1,77 @@
+#define _POSIX_C_SOURCE 200809L
+#include "trace.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+Trace_Ring trace_ring = {.records = NULL, .mask = 0, .total = 0, .fd = -1};
+
+static const int dump_signals[] = {SIGINT,  SIGTERM, SIGSEGV,
+                                   SIGBUS,  SIGFPE,  SIGABRT};
+
+static void trace_signal_handler(int sig)
+{
+    trace_dump();
+    // The handler is installed with SA_RESETHAND, re-raising falls back to
+    // the default action
+    raise(sig);
+}
+
+static void trace_atexit(void) { trace_dump(); }
+
+int trace_init(const char *path, size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+
+    trace_ring.records = calloc(size, sizeof(*trace_ring.records));
+    if (!trace_ring.records)
+        return -1;
+
+    trace_ring.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (trace_ring.fd < 0) {
+        free(trace_ring.records);
+        trace_ring.records = NULL;
+        return -1;
+    }
+
+    trace_ring.mask  = size - 1;
+    trace_ring.total = 0;
+
+    struct sigaction sa;
+    memset(&sa, 0x00, sizeof(sa));
+    sa.sa_handler = trace_signal_handler;
+    sa.sa_flags   = SA_RESETHAND;
+    sigemptyset(&sa.sa_mask);
+    for (size_t i = 0; i < sizeof(dump_signals) / sizeof(*dump_signals); ++i)
+        sigaction(dump_signals[i], &sa, NULL);
+
+    atexit(trace_atexit);
+
+    return 0;
+}
+
+void trace_dump(void)
+{
+    if (trace_ring.fd < 0)
+        return;
+
+    uint64_t capacity   = trace_ring.mask + 1;
+    uint64_t count      = trace_ring.total < capacity ? trace_ring.total
+                                                      : capacity;
+    Trace_Header header = {.magic    = TRACE_MAGIC,
+                           .version  = TRACE_VERSION,
+                           .capacity = capacity,
+                           .total    = trace_ring.total};
+
+    // Overwrite any previous dump, this can run more than once e.g. on an
+    // error return followed by the exit handler
+    if (pwrite(trace_ring.fd, &header, sizeof(header), 0) < 0)
+        return;
+    if (pwrite(trace_ring.fd, trace_ring.records,
+               count * sizeof(*trace_ring.records), sizeof(header)) < 0)
+        return;
+}
@@ -0,0 +1,57 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "bytecode.h"
+#include <stdint.h>
+
+#define TRACE_MAGIC            0x43525441 // "ATRC"
+#define TRACE_VERSION          1
+#define TRACE_DEFAULT_CAPACITY (1 << 16)
+
+// A single executed instruction, 16 bytes to keep the ring index a simple
+// mask and each record naturally aligned
+typedef struct trace_record {
+    uint32_t pc;
+    uint32_t opcode;
+    Word tos;
+} Trace_Record;
+
+// Fixed-size header written in front of the records on dump, all the fields
+// are in host byte order as the trace is meant to be decoded on the same
+// machine (or at least the same architecture) that produced it
+typedef struct trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+    // Total number of records written since the start, the ring holds the
+    // last min(total, capacity) of them
+    uint64_t total;
+} Trace_Header;
+
+typedef struct trace_ring {
+    Trace_Record *records;
+    uint64_t mask;
+    uint64_t total;
+    int fd;
+} Trace_Ring;
+
+extern Trace_Ring trace_ring;
+
+// Open the dump file and allocate the ring, capacity is rounded up to the
+// next power of two. Also registers the exit and signal handlers so that the
+// buffer is dumped however the program terminates
+int trace_init(const char *path, size_t capacity);
+
+// Write the header and the ring content to the dump file, only uses
+// async-signal-safe calls so it can be called from a signal handler
+void trace_dump(void);
+
+static inline void trace_record(uint32_t pc, uint32_t opcode, Word tos)
+{
+    Trace_Record *r = &trace_ring.records[trace_ring.total++ & trace_ring.mask];
+    r->pc           = pc;
+    r->opcode       = opcode;
+    r->tos          = tos;
+}
+
+#endif // TRACE_H
@@ -1,50 +1,250 @@
+#define _DEFAULT_SOURCE 1
 #include "assembler.h"
 #include "bytecode.h"
+#include "hooks.h"
+#include "inliner.h"
+#include "ir.h"
+#include "map.h"
+#include "memo.h"
+#include "probes.h"
+#include "sched.h"
+#include "trace.h"
+#include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
-#define STACK_SIZE  256
-#define MEMORY_SIZE 65535
-
-typedef enum { SUCCESS, E_DIV_BY_ZERO, E_UNKNOWN_INSTRUCTION } Interpret_Result;
+typedef enum {
+    SUCCESS,
+    E_DIV_BY_ZERO,
+    E_UNKNOWN_INSTRUCTION,
+    E_LOAD_PROCEDURE,
+    E_INVALID_MAP,
+    E_OUT_OF_MEMORY,
+    E_INVALID_TASK,
+    E_STOPPED,
+    // Internal, the instrumented loop hands over to the plain one
+    E_SWITCH
+} Interpret_Result;
 
 typedef struct {
     // Instruction stack
-    Word stack[STACK_SIZE];
+    Word *stack;
     Word *stack_top;
+    size_t stack_size;
     // Memory
-    Word memory[MEMORY_SIZE];
+    Word *memory;
+    size_t memory_size;
     // Instruction pointer
     Word *ip;
     // Call stack for functions
-    Word call_stack[STACK_SIZE];
+    Word *call_stack;
     Word *cstack_top;
+    size_t call_stack_size;
     // Result register
     Word result;
 } Vm;
 
-static Vm vm = {.ip = NULL, .stack_top = NULL, .cstack_top = NULL};
+// Each worker thread runs its tasks on a VM of its own, sharing the memory of
+// the main one
+static _Thread_local Vm vm = {0};
+
+// Set when a trace file is requested, every dispatched instruction is then
+// recorded in the trace ring buffer before being executed
+static _Thread_local bool tracing = false;
+
+// Breakpoints, single step and watchpoints of the thread, worker threads start
+// with none. Like tracing they're only looked at by the instrumented loop
+static _Thread_local Hooks hooks = {0};
+
+static inline bool vm_instrumented(void)
+{
+    return tracing || hooks_active(&hooks);
+}
+
+// Return addresses of memoized calls are tagged on the call stack, RET then
+// records the result of the call in the cache
+#define MEMO_RETURN       (1ULL << 63)
+#define MEMO_DEFAULT_SIZE 4096
+
+// Arguments of a memoized call in progress, they're consumed by the procedure
+// and needed again to store its result
+typedef struct memo_frame {
+    size_t proc;
+    Word args[PURE_MAX_ARITY];
+} Memo_Frame;
+
+static Memo_Cache memo;
+// Index + 1 of the pure procedure starting at each code address, 0 for any
+// other address. NULL if memoization is off or there are no pure procedures
+static size_t *memo_procs      = NULL;
+static const Procedures *procs = NULL;
+static Memo_Frame *memo_frames = NULL;
+static Memo_Frame *memo_top    = NULL;
+
+// Heap of the maps created by MAP_NEW, a map handle is its index + 1 so that
+// 0 is never a valid one. Maps live until the end of the run
+typedef struct map_heap {
+    Map **data;
+    size_t length;
+    size_t capacity;
+} Map_Heap;
+
+static Map_Heap heap = {0};
+
+// Tasks spawned by the task running on a thread and not synced yet
+typedef struct task_list {
+    Task **data;
+    size_t length;
+    size_t capacity;
+} Task_List;
+
+// Set when worker threads run tasks next to the main one, map instructions
+// then take the heap lock
+static bool parallel             = false;
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static Byte_Code *program        = NULL;
+// Memory and sizes the worker VMs start from
+static Vm shared_vm;
+static Task_List main_tasks              = {0};
+static _Thread_local Task_List *children = NULL;
+// Stacks of a task, mapped between guard pages like the main ones. Those of
+// finished tasks are kept on a per thread list for the next ones
+typedef struct task_stacks {
+    struct task_stacks *next;
+    Word *stack;
+    Word *call_stack;
+} Task_Stacks;
+
+static _Thread_local Task_Stacks *free_stacks = NULL;
+
+// Map a zero-filled region of `words` words surrounded by two inaccessible
+// guard pages, so that running off either end of a stack faults right away
+// instead of silently corrupting whatever sits next to it. Pages are only
+// backed on first touch, regions of at least VM_HUGEPAGE_MIN bytes are hinted
+// to use transparent huge pages to keep TLB misses down
+#define VM_HUGEPAGE_MIN (2 << 20)
+
+static Word *vm_map(size_t words)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = (words * sizeof(Word) + page - 1) & ~(page - 1);
+
+    uint8_t *base =
+        mmap(NULL, size + 2 * page, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    if (mprotect(base + page, size, PROT_READ | PROT_WRITE) < 0) {
+        munmap(base, size + 2 * page);
+        return NULL;
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (size >= VM_HUGEPAGE_MIN)
+        madvise(base + page, size, MADV_HUGEPAGE);
+#endif
+
+    return (Word *)(base + page);
+}
+
+static void vm_unmap(Word *region, size_t words)
+{
+    if (!region)
+        return;
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = (words * sizeof(Word) + page - 1) & ~(page - 1);
+    munmap((uint8_t *)region - page, size + 2 * page);
+}
+
+// Fresh anonymous mappings are already zeroed by the kernel, nothing to clear
+static int vm_init(size_t memory_size, size_t stack_size,
+                   size_t call_stack_size)
+{
+    vm.memory          = vm_map(memory_size);
+    vm.stack           = vm_map(stack_size);
+    vm.call_stack      = vm_map(call_stack_size);
+    vm.memory_size     = memory_size;
+    vm.stack_size      = stack_size;
+    vm.call_stack_size = call_stack_size;
+    vm.ip              = NULL;
+    vm.stack_top       = NULL;
+    vm.cstack_top      = NULL;
+
+    return vm.memory && vm.stack && vm.call_stack ? 0 : -1;
+}
+
+static void vm_heap_free(void)
+{
+    for (size_t i = 0; i < heap.length; ++i)
+        map_free(heap.data[i]);
+    free(heap.data);
+    heap = (Map_Heap){0};
+}
+
+static void vm_task_stacks_free(Task_Stacks *s)
+{
+    vm_unmap(s->stack, vm.stack_size);
+    vm_unmap(s->call_stack, vm.call_stack_size);
+    free(s);
+}
 
-static void vm_init(void)
+static Task_Stacks *vm_task_stacks(void)
 {
-    memset(vm.stack, 0x00, STACK_SIZE * sizeof(Word));
-    memset(vm.memory, 0x00, MEMORY_SIZE * sizeof(Word));
-    memset(vm.call_stack, 0x00, STACK_SIZE * sizeof(Word));
-    vm.ip         = NULL;
-    vm.stack_top  = NULL;
-    vm.cstack_top = NULL;
+    Task_Stacks *s = free_stacks;
+    if (s) {
+        free_stacks = s->next;
+        return s;
+    }
+
+    s = calloc(1, sizeof(*s));
+    if (!s)
+        return NULL;
+    s->stack      = vm_map(vm.stack_size);
+    s->call_stack = vm_map(vm.call_stack_size);
+    if (!s->stack || !s->call_stack) {
+        vm_task_stacks_free(s);
+        return NULL;
+    }
+    return s;
+}
+
+// Release the stacks kept by the calling thread
+static void vm_task_stacks_release(void)
+{
+    while (free_stacks) {
+        Task_Stacks *next = free_stacks->next;
+        vm_task_stacks_free(free_stacks);
+        free_stacks = next;
+    }
+}
+
+static void vm_free(void)
+{
+    vm_task_stacks_release();
+    vm_unmap(vm.memory, vm.memory_size);
+    vm_unmap(vm.stack, vm.stack_size);
+    vm_unmap(vm.call_stack, vm.call_stack_size);
+    vm_heap_free();
 }
 
 static void vm_reset(Byte_Code *bc)
 {
     Word *bytecode = bc_code(bc);
-    vm             = (Vm){.stack_top  = vm.stack,
-                          .cstack_top = vm.call_stack,
-                          .ip         = bytecode + bc->entry_point};
+    vm.stack_top   = vm.stack;
+    vm.cstack_top  = vm.call_stack;
+    vm.ip          = bytecode + bc->entry_point;
+    vm.result      = 0;
+    memo_top       = memo_frames;
+    vm_heap_free();
+    PROBE3(reset, bc->entry_point, vm.memory_size, bc->data_segment->length);
 
     for (size_t i = 0; i < bc->data_segment->length; ++i) {
         if (bc->data_segment->data[i].type == DT_CONSTANT) {
@@ -71,17 +271,18 @@ static void vm_reset(Byte_Code *bc)
 #define vm_pop()       (*--vm.stack_top)
 #define vm_tos()       (vm.stack_top - 1)
 #define vm_peek()      (*(vm.stack_top - 1))
+#define vm_depth()     (vm.stack_top - vm.stack)
 
-// static void vm_print_stack(void)
-// {
-//     printf("[");
-//     Word *sp = vm.stack;
-//     while (sp != vm.stack_top) {
-//         printf("%llu,", *sp);
-//         ++sp;
-//     }
-//     printf("]\n");
-// }
+static void vm_print_stack(void)
+{
+    printf("[");
+    Word *sp = vm.stack;
+    while (sp != vm.stack_top) {
+        printf("%llu,", *sp);
+        ++sp;
+    }
+    printf("]\n");
+}
 
 static bool string_pointer(Word value) { return value >= DATA_STRING_OFFSET; }
 
@@ -100,174 +301,524 @@ static void print_string_from_memory(Word address)
     }
 }
 
+static int vm_memo_init(const Byte_Code *bc, size_t capacity)
+{
+    size_t pure = 0;
+    for (size_t i = 0; i < bc->procedures->length; ++i)
+        pure += bc->procedures->data[i].pure;
+    if (capacity == 0 || pure == 0)
+        return 0;
+
+    if (memo_init(&memo, capacity) < 0)
+        return -1;
+
+    memo_procs  = calloc(bc->code_segment->length + 1, sizeof(*memo_procs));
+    memo_frames = calloc(vm.call_stack_size, sizeof(*memo_frames));
+    if (!memo_procs || !memo_frames)
+        return -1;
+
+    procs    = bc->procedures;
+    memo_top = memo_frames;
+    for (size_t i = 0; i < procs->length; ++i) {
+        if (procs->data[i].pure)
+            memo_procs[procs->data[i].start] = i + 1;
+    }
+
+    return 0;
+}
+
+static void vm_memo_free(void)
+{
+    if (!memo_procs)
+        return;
+    memo_free(&memo);
+    free(memo_procs);
+    free(memo_frames);
+}
+
+// Called on CALL with the stack pointer and the return address, returns true
+// if the result was found in the cache, in which case it already replaced the
+// arguments on the stack and the call has to be skipped
+static bool vm_memo_call(Word addr, Word **sp, Word *ret)
+{
+    if (!memo_procs || !memo_procs[addr])
+        return false;
+
+    size_t proc  = memo_procs[addr] - 1;
+    size_t arity = procs->data[proc].arity;
+    Word *args   = *sp - arity;
+    Word result  = 0;
+    if (memo_lookup(&memo, proc, args, arity, &result)) {
+        *args = result;
+        *sp   = args + 1;
+        return true;
+    }
+
+    memo_top->proc = proc;
+    memcpy(memo_top->args, args, arity * sizeof(*args));
+    memo_top++;
+    *ret |= MEMO_RETURN;
+
+    return false;
+}
+
+// Called on RET with the popped return address, returns it untagged
+static Word vm_memo_return(Word addr, const Word *sp)
+{
+    if (!(addr & MEMO_RETURN))
+        return addr;
+
+    memo_top--;
+    memo_store(&memo, memo_top->proc, memo_top->args,
+               procs->data[memo_top->proc].arity, sp[-1]);
+
+    return addr & ~MEMO_RETURN;
+}
+
+static Map *vm_map_handle(Word handle)
+{
+    return handle > 0 && handle <= heap.length ? heap.data[handle - 1] : NULL;
+}
+
+static Interpret_Result vm_map_locked(Word op, Word **sp)
+{
+    Word *top = *sp;
+    Map *m    = NULL;
+    Word value;
+
+    switch (op) {
+    case OP_MAP_NEW: {
+        // ( kind -- map )
+        if (top[-1] > MAP_STRING_KEYS)
+            return E_INVALID_MAP;
+        if (heap.length == heap.capacity) {
+            size_t capacity = heap.capacity ? heap.capacity * 2 : 8;
+            Map **data      = realloc(heap.data, capacity * sizeof(*data));
+            if (!data)
+                return E_OUT_OF_MEMORY;
+            heap.data     = data;
+            heap.capacity = capacity;
+        }
+        m = map_create(top[-1], vm.memory, vm.memory_size);
+        if (!m)
+            return E_OUT_OF_MEMORY;
+        heap.data[heap.length++] = m;
+        top[-1]                  = heap.length;
+        break;
+    }
+    case OP_MAP_PUT:
+        // ( map key value -- )
+        if (!(m = vm_map_handle(top[-3])))
+            return E_INVALID_MAP;
+        if (map_put(m, top[-2], top[-1]) < 0)
+            return E_OUT_OF_MEMORY;
+        top -= 3;
+        break;
+    case OP_MAP_GET:
+        // ( map key -- value found ), value is 0 if the key is missing
+        if (!(m = vm_map_handle(top[-2])))
+            return E_INVALID_MAP;
+        top[-1] = map_get(m, top[-1], &value);
+        top[-2] = top[-1] ? value : 0;
+        break;
+    case OP_MAP_DEL:
+        // ( map key -- found )
+        if (!(m = vm_map_handle(top[-2])))
+            return E_INVALID_MAP;
+        top[-2] = map_del(m, top[-1]);
+        top--;
+        break;
+    case OP_MAP_LEN:
+        // ( map -- length )
+        if (!(m = vm_map_handle(top[-1])))
+            return E_INVALID_MAP;
+        top[-1] = m->length;
+        break;
+    default:
+        return E_UNKNOWN_INSTRUCTION;
+    }
+
+    *sp = top;
+    return SUCCESS;
+}
+
+// Run one of the MAP_* instructions on the stack topped at `*sp`, shared by
+// both interpreters
+static Interpret_Result vm_map_execute(Word op, Word **sp)
+{
+    if (!parallel)
+        return vm_map_locked(op, sp);
+
+    pthread_mutex_lock(&heap_lock);
+    Interpret_Result r = vm_map_locked(op, sp);
+    pthread_mutex_unlock(&heap_lock);
+    return r;
+}
+
+static long vm_find_procedure(const Procedures *procs, Word address)
+{
+    size_t low = 0, high = procs->length;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (procs->data[mid].start < address)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low < procs->length && procs->data[low].start == address ? low : -1;
+}
+
+// ( args... -- ) queue a task running the procedure at `addr` on the
+// arguments it declares, its result is pushed by the SYNC that follows
+static Interpret_Result vm_spawn(Byte_Code *bc, Word addr)
+{
+    // The arguments have to be on the stack already
+    long i = vm_find_procedure(bc->procedures, addr);
+    if (i < 0 || bc->procedures->data[i].arity > (size_t)vm_depth())
+        return E_INVALID_TASK;
+
+    size_t arity = bc->procedures->data[i].arity;
+    Task *t      = calloc(1, sizeof(*t) + arity * sizeof(Word));
+    if (!t)
+        return E_OUT_OF_MEMORY;
+
+    if (!children->data) {
+        size_t capacity = 4;
+        da_init(children, capacity);
+    }
+
+    t->proc       = addr;
+    t->arity      = arity;
+    vm.stack_top -= arity;
+    memcpy(t->args, vm.stack_top, arity * sizeof(Word));
+    da_push(children, t);
+    sched_spawn(t);
+
+    return SUCCESS;
+}
+
+// Wait for every task spawned since the last SYNC, pushing their results in
+// spawn order. Instead of blocking, the waiting thread runs queued tasks, the
+// one waited for is likely on its own deque
+static Interpret_Result vm_sync(bool push)
+{
+    Interpret_Result r = SUCCESS;
+
+    for (size_t i = 0; children && i < children->length; ++i) {
+        Task *t = children->data[i];
+        while (!atomic_load_explicit(&t->done, memory_order_acquire)) {
+            if (!sched_help())
+                sched_yield();
+        }
+        if (t->status != SUCCESS)
+            r = t->status;
+        else if (push)
+            vm_push(t->result);
+        free(t);
+    }
+    if (children)
+        children->length = 0;
+
+    return r;
+}
+
+#define VM_RUN_NAME   vm_run_plain
+#define VM_RUN_HOOKED 0
+#include "vm_run.h"
+#undef VM_RUN_NAME
+#undef VM_RUN_HOOKED
+
+#define VM_RUN_NAME   vm_run_hooked
+#define VM_RUN_HOOKED 1
+#include "vm_run.h"
+#undef VM_RUN_NAME
+#undef VM_RUN_HOOKED
+
+// Interpreter loops indexed by vm_instrumented(), attaching the first hook or
+// dropping the last one swaps them, so the plain loop carries no check at all
+static Interpret_Result (*const dispatch_table[])(Byte_Code *) = {
+    vm_run_plain, vm_run_hooked};
+
+static Interpret_Result vm_run(Byte_Code *bc)
+{
+    Interpret_Result r;
+    do
+        r = dispatch_table[vm_instrumented()](bc);
+    while (r == E_SWITCH);
+    if (r != SUCCESS)
+        PROBE3(error, vm.ip - bc_code(bc), r, vm_depth());
+
+    return r;
+}
+
 Interpret_Result vm_interpret(Byte_Code *bc)
 {
-    Word *bytecode = bc_code(bc);
     vm_reset(bc);
-    size_t pc = bc->entry_point;
+    children = &main_tasks;
+
+    Interpret_Result r = vm_run(bc);
+    // Tasks never synced still have to finish before the program does
+    if (r == SUCCESS)
+        r = vm_sync(false);
+    return r;
+}
+
+// Run a task to completion on the calling thread, on a stack of its own, the
+// VM state of whatever was running before is restored afterwards
+static void vm_run_task(Task *t)
+{
+    Vm saved               = vm;
+    Task_List *saved_tasks = children;
+    Task_List tasks        = {0};
+    Task_Stacks *stacks    = vm_task_stacks();
+    if (!stacks) {
+        t->status = E_OUT_OF_MEMORY;
+        return;
+    }
+
+    memcpy(stacks->stack, t->args, t->arity * sizeof(Word));
+    vm.stack      = stacks->stack;
+    vm.stack_top  = stacks->stack + t->arity;
+    vm.call_stack = stacks->call_stack;
+    vm.cstack_top = vm.call_stack;
+    vm.ip         = bc_code(program) + t->proc;
+    children      = &tasks;
+
+    t->status     = vm_run(program);
+    t->result     = vm.result;
+    if (t->status == SUCCESS)
+        t->status = vm_sync(false);
+
+    free(tasks.data);
+    stacks->next = free_stacks;
+    free_stacks  = stacks;
+    children     = saved_tasks;
+    vm           = saved;
+}
+
+static void vm_worker_enter(void) { vm = shared_vm; }
+
+static void vm_worker_leave(void) { vm_task_stacks_release(); }
+
+// Run the register translation of the bytecode, registers live on the same
+// stack as the one used by the stack interpreter, addressed relative to `bp`
+Interpret_Result vm_interpret_ir(Byte_Code *bc, const IR_Program *ir)
+{
+    vm_reset(bc);
+
+    const IR_Instruction *code = ir->data;
+    size_t i                   = ir->entry_point;
+    Word *bp                   = vm.stack_top;
+    Interpret_Result r         = SUCCESS;
 
     for (;;) {
-        switch (vm_next()) {
-        case OP_LOAD: {
-            Word addr = vm_pop();
-            vm_push(vm.memory[addr]);
-            pc++;
+        const IR_Instruction *ins = &code[i++];
+        switch (ins->op) {
+        case IR_MOV:
+            bp[ins->dst] = bp[ins->a];
             break;
-        }
-        case OP_LOAD_CONST: {
-            Word addr = vm_next();
-            vm_push(vm.memory[addr]);
-            pc += 2;
+        case IR_MOVI:
+            bp[ins->dst] = ins->imm;
             break;
-        }
-        case OP_STORE: {
-            Word addr       = vm_pop();
-            Word value      = vm_pop();
-            vm.memory[addr] = value;
-            pc++;
+        case IR_LOAD:
+            bp[ins->dst] = vm.memory[bp[ins->a]];
             break;
-        }
-        case OP_STORE_CONST: {
-            Word value      = vm_pop();
-            Word addr       = vm_next();
-            vm.memory[addr] = value;
-            pc += 2;
+        case IR_LOADI:
+            bp[ins->dst] = vm.memory[ins->imm];
             break;
-        }
-        case OP_CALL: {
-            Word addr = vm_next();
-            pc += 2;
-            *vm.cstack_top++ = pc;
-            pc               = addr;
-            vm.ip            = bytecode + addr;
+        case IR_STORE:
+            vm.memory[bp[ins->a]] = bp[ins->b];
             break;
-        }
-        case OP_PUSH: {
-            Word arg = vm_next();
-            // Assume PUSH can be used only for data pointers for now
-            if (string_pointer(arg))
-                vm_push(arg);
-            else
-                vm_push(vm.memory[arg]);
-            pc += 2;
+        case IR_STOREI:
+            vm.memory[ins->imm] = bp[ins->a];
             break;
-        }
-        case OP_PUSH_CONST: {
-            Word arg = vm_next();
-            vm_push(arg);
-            pc += 2;
+        case IR_LOADX:
+            bp[ins->dst] = vm.memory[ins->imm + bp[ins->a]];
             break;
-        }
-        case OP_ADD: {
-            Word right = vm_pop();
-            *vm_tos() += right;
-            pc++;
+        case IR_STOREX:
+            vm.memory[ins->imm + bp[ins->a]] = bp[ins->b];
             break;
-        }
-        case OP_SUB: {
-            Word right = vm_pop();
-            *vm_tos() -= right;
-            pc++;
+        case IR_ADD:
+            bp[ins->dst] = bp[ins->a] + bp[ins->b];
             break;
-        }
-        case OP_MUL: {
-            Word right = vm_pop();
-            *vm_tos() *= right;
-            pc++;
+        case IR_SUB:
+            bp[ins->dst] = bp[ins->a] - bp[ins->b];
             break;
-        }
-        case OP_DIV: {
-            Word right = vm_pop();
-            if (right == 0)
-                return E_DIV_BY_ZERO;
-            *vm_tos() /= right;
-            pc++;
+        case IR_MUL:
+            bp[ins->dst] = bp[ins->a] * bp[ins->b];
             break;
-        }
-        case OP_DUP: {
-            vm_push(vm_peek());
-            pc++;
+        case IR_DIV:
+            if (bp[ins->b] == 0) {
+                r = E_DIV_BY_ZERO;
+                goto error;
+            }
+            bp[ins->dst] = bp[ins->a] / bp[ins->b];
             break;
-        }
-        case OP_INC: {
-            *vm_tos() += 1;
-            pc++;
+        case IR_ADDI:
+            bp[ins->dst] = bp[ins->a] + ins->imm;
             break;
-        }
-        case OP_EQ: {
-            Word arg  = vm_pop();
-            *vm_tos() = vm_peek() == arg;
-            pc++;
+        case IR_SUBI:
+            bp[ins->dst] = bp[ins->a] - ins->imm;
             break;
-        }
-        case OP_JMP: {
-            vm.ip = bytecode + vm_next();
-            pc += 2;
+        case IR_MULI:
+            bp[ins->dst] = bp[ins->a] * ins->imm;
             break;
-        }
-        case OP_JEQ: {
-            pc++;
-            if (vm_peek()) {
-                (void)vm_pop();
-                pc    = vm_next();
-                vm.ip = bytecode + pc;
-            }
+        case IR_EQ:
+            bp[ins->dst] = bp[ins->a] == bp[ins->b];
             break;
-        }
-        case OP_JNE:
-            pc++;
-            if (!vm_peek()) {
-                (void)vm_pop();
-                pc    = vm_next();
-                vm.ip = bytecode + pc;
-            }
+        case IR_LT:
+            bp[ins->dst] = (int64_t)bp[ins->a] < (int64_t)bp[ins->b];
             break;
-        case OP_MAKE_TUPLE: {
-            Word address    = vm_next();
-            Word tuple_size = vm_pop();
-            while (tuple_size-- > 0) {
-                vm.memory[address++] = vm_pop();
-            }
-            pc += 2;
+        case IR_GT:
+            bp[ins->dst] = (int64_t)bp[ins->a] > (int64_t)bp[ins->b];
             break;
-        }
-        case OP_PRINT: {
-            Word address = vm_pop();
-            if (string_pointer(address)) {
-                print_string_from_memory(address);
-            } else {
-                printf("%lli", address);
-            }
+        case IR_LE:
+            bp[ins->dst] = (int64_t)bp[ins->a] <= (int64_t)bp[ins->b];
+            break;
+        case IR_GE:
+            bp[ins->dst] = (int64_t)bp[ins->a] >= (int64_t)bp[ins->b];
+            break;
+        case IR_PRINT:
+            PROBE4(print, i - 1, OP_PRINT, bp - vm.stack, bp[ins->a]);
+            if (string_pointer(bp[ins->a]))
+                print_string_from_memory(bp[ins->a]);
+            else
+                printf("%lli", bp[ins->a]);
             fflush(stdout);
-            pc++;
             break;
-        }
-        case OP_PRINT_CONST: {
-            Word address = vm_pop();
-            printf("%lli", address);
+        case IR_PRINT_CONST:
+            PROBE4(print, i - 1, OP_PRINT_CONST, bp - vm.stack, bp[ins->a]);
+            printf("%lli", bp[ins->a]);
             fflush(stdout);
-            pc++;
+            break;
+        case IR_MAP: {
+            Word *sp = bp + ins->a;
+            r        = vm_map_execute(ins->imm, &sp);
+            if (r != SUCCESS)
+                goto error;
             break;
         }
-        case OP_RET: {
-            Word addr = *(--vm.cstack_top);
-            vm.ip     = bytecode + addr;
-            pc        = addr;
+        case IR_ADJ:
+            bp += ins->a;
+            break;
+        case IR_JMP:
+            bp += ins->a;
+            i = ins->dst;
+            break;
+        case IR_JT:
+            bp += ins->a;
+            if (bp[-1]) {
+                --bp;
+                i = ins->dst;
+            }
+            break;
+        case IR_JF:
+            bp += ins->a;
+            if (!bp[-1]) {
+                --bp;
+                i = ins->dst;
+            }
+            break;
+        case IR_JEQI:
+            bp += ins->a;
+            if (*--bp == ins->imm)
+                i = ins->dst;
+            break;
+        case IR_JNEI:
+            bp += ins->a;
+            if (*--bp != ins->imm)
+                i = ins->dst;
+            break;
+        case IR_JLTI:
+            bp += ins->a;
+            if ((int64_t)*--bp < (int64_t)ins->imm)
+                i = ins->dst;
+            break;
+        case IR_JLEI:
+            bp += ins->a;
+            if ((int64_t)*--bp <= (int64_t)ins->imm)
+                i = ins->dst;
+            break;
+        case IR_JGTI:
+            bp += ins->a;
+            if ((int64_t)*--bp > (int64_t)ins->imm)
+                i = ins->dst;
+            break;
+        case IR_JGEI:
+            bp += ins->a;
+            if ((int64_t)*--bp >= (int64_t)ins->imm)
+                i = ins->dst;
+            break;
+        case IR_CALL: {
+            Word ret = i;
+            bp += ins->a;
+            PROBE4(call, i - 1, OP_CALL, bp - vm.stack, ins->imm);
+            if (vm_memo_call(ins->imm, &bp, &ret))
+                break;
+            *vm.cstack_top++ = ret;
+            i                = ins->dst;
             break;
         }
-        case OP_HALT:
-            pc++;
+        case IR_RET:
+            bp += ins->a;
+            PROBE4(ret, i - 1, OP_RET, bp - vm.stack,
+                   vm.cstack_top - vm.call_stack);
+            if (vm.cstack_top == vm.call_stack)
+                goto exit;
+            i = vm_memo_return(*(--vm.cstack_top), bp);
+            break;
+        case IR_HALT:
+            bp += ins->a;
+            PROBE3(halt, i - 1, OP_HALT, bp - vm.stack);
             goto exit;
         default:
-            return E_UNKNOWN_INSTRUCTION;
+            r = E_UNKNOWN_INSTRUCTION;
+            goto error;
         }
     }
 
 exit:
 
-    vm.result = vm_pop();
+    vm.stack_top = bp;
+    vm.result    = vm.stack_top > vm.stack ? vm_pop() : 0;
 
     return SUCCESS;
+
+error:
+
+    PROBE3(error, i - 1, r, bp - vm.stack);
+    return r;
+}
+
+// Print each hook event with the instruction it refers to and the stack, then
+// carry on
+static bool vm_hook_print(const Hook_Event *e, void *ctx)
+{
+    static const char *const kinds[] = {"break", "step", "watch"};
+    const Byte_Code *bc              = ctx;
+
+    printf("[%s]", kinds[e->kind]);
+    if (e->kind == HOOK_WATCH)
+        printf(" %04llX: %llu -> %llu after", e->addr, e->old_value,
+               e->new_value);
+    asm_disassemble_instruction(bc, e->pc);
+    printf(" ");
+    vm_print_stack();
+
+    return true;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [--trace <file>] [--trace-size <records>] "
+            "[--no-regir] [--memory <words>] [--stack <words>] "
+            "[--call-stack <words>] [--lazy] [--inline <instructions>] "
+            "[--memo-size <entries>] [--workers <threads>] "
+            "[--break <address>] [--watch <address>] [--step] "
+            "<source.atom | bytecode | -->\n",
+            name);
+    exit(EXIT_FAILURE);
 }
 
 int main(int argc, char **argv)
@@ -277,28 +828,193 @@ int main(int argc, char **argv)
         abort();
 
     char *source_path = NULL;
+    char *trace_path  = NULL;
+    size_t trace_size = TRACE_DEFAULT_CAPACITY;
+    bool from_stdin   = false;
+    bool regir        = true;
+    bool lazy         = false;
+    size_t inline_max = 0;
+    size_t memo_size  = MEMO_DEFAULT_SIZE;
+    // 0 means one per online CPU
+    size_t workers    = 0;
     Byte_Code *bc     = NULL;
+    IR_Program *ir    = NULL;
+    // 0 means the size from the bytecode (or the default one) is used
+    Word memory_size     = 0;
+    Word stack_size      = 0;
+    Word call_stack_size = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp("--trace", argv[i]) == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp("--trace-size", argv[i]) == 0 && i + 1 < argc) {
+            trace_size = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp("--memory", argv[i]) == 0 && i + 1 < argc) {
+            memory_size = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp("--stack", argv[i]) == 0 && i + 1 < argc) {
+            stack_size = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp("--call-stack", argv[i]) == 0 && i + 1 < argc) {
+            call_stack_size = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp("--inline", argv[i]) == 0 && i + 1 < argc) {
+            inline_max = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp("--memo-size", argv[i]) == 0 && i + 1 < argc) {
+            memo_size = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp("--workers", argv[i]) == 0 && i + 1 < argc) {
+            workers = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp("--break", argv[i]) == 0 && i + 1 < argc) {
+            if (hooks_break(&hooks, strtoull(argv[++i], NULL, 0)) < 0)
+                abort();
+        } else if (strcmp("--watch", argv[i]) == 0 && i + 1 < argc) {
+            if (hooks_watch(&hooks, strtoull(argv[++i], NULL, 0)) < 0)
+                abort();
+        } else if (strcmp("--step", argv[i]) == 0) {
+            hooks_step(&hooks, true);
+        } else if (strcmp("--lazy", argv[i]) == 0) {
+            lazy = true;
+        } else if (strcmp("--no-regir", argv[i]) == 0) {
+            regir = false;
+        } else if (strcmp("--", argv[i]) == 0) {
+            from_stdin = true;
+        } else if (strncmp("--", argv[i], 2) == 0) {
+            usage(argv[0]);
+        } else {
+            source_path = argv[i];
+        }
+    }
 
-    if (strncmp("--", argv[1], 2) == 0) {
+    if (from_stdin) {
         bc = asm_compile_from_stdin(1);
     } else {
-        source_path = argv[1];
-        bc          = asm_compile(source_path, 1);
+        if (!source_path)
+            usage(argv[0]);
+        // Either a container produced by aasm or an assembly source
+        bc = bc_load(source_path, lazy);
+        if (!bc)
+            bc = asm_compile(source_path, 1);
     }
 
-    vm_init();
-
-    // Byte_Code *bc = asm_compile(source_path, 1);
     if (!bc)
         abort();
 
-    asm_disassemble(bc);
+    PROBE2(load, bc->code_segment->length, bc->data_segment->length);
 
-    if (vm_interpret(bc) < 0)
+    if (memory_size)
+        bc->memory_size = memory_size;
+    if (stack_size)
+        bc->stack_size = stack_size;
+    if (call_stack_size)
+        bc->call_stack_size = call_stack_size;
+
+    for (size_t i = 0; i < bc->data_segment->length; ++i) {
+        const Data_Record *d = &bc->data_segment->data[i];
+        Word end = d->address + (d->type == DT_STRING ? strlen(d->as_str)
+                                 : d->type == DT_BUFFER ? d->as_int
+                                                        : 1);
+        if (end > bc->memory_size) {
+            fprintf(stderr, "data segment doesn't fit in %llu words\n",
+                    bc->memory_size);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (size_t i = 0; i < hooks.watches.length; ++i) {
+        if (hooks.watches.data[i].addr >= bc->memory_size) {
+            fprintf(stderr, "watched address %llu out of memory\n",
+                    hooks.watches.data[i].addr);
+            exit(EXIT_FAILURE);
+        }
+    }
+    hooks_set_handler(&hooks, vm_hook_print, bc);
+
+    if (vm_init(bc->memory_size, bc->stack_size, bc->call_stack_size) < 0) {
+        fprintf(stderr, "unable to allocate the VM memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Worker threads are only started for programs spawning tasks, procedures
+    // of lazily loaded ones aren't known yet, their tasks run on the main
+    // thread. The memo cache isn't shared between threads
+    bool spawns = false;
+    for (size_t pc = 0; !bc->source && pc < bc->code_segment->length;
+         pc += 1 + bc_instruction_arity(bc_code(bc)[pc]))
+        spawns |= bc_code(bc)[pc] == OP_SPAWN;
+    if (!spawns)
+        workers = 1;
+    else if (workers == 0)
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers > 1)
+        memo_size = 0;
+
+    if (inline_max > 0) {
+        size_t inlined = inline_procedures(bc, inline_max);
+        printf("[*] Inlined %lu call sites\n", inlined);
+    }
+
+    // Indexed by code address, built once inlining moved the procedures
+    if (vm_memo_init(bc, memo_size) < 0) {
+        fprintf(stderr, "unable to allocate the memoization cache\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Disassembling would defeat the purpose of loading lazily
+    if (!bc->source)
+        asm_disassemble(bc);
+
+    if (trace_path) {
+        if (trace_init(trace_path, trace_size) < 0) {
+            fprintf(stderr, "unable to open trace file %s\n", trace_path);
+            exit(EXIT_FAILURE);
+        }
+        tracing = true;
+    }
+
+    // Tracing and hooks refer to stack bytecode addresses, they always run on
+    // the stack interpreter, as do lazily loaded programs whose procedures
+    // aren't known until called
+    if (regir && !vm_instrumented() && !bc->source) {
+        ir = ir_translate(bc);
+        if (ir) {
+            printf("=====================\n");
+            printf("[*] Register IR: %lu stack instructions -> %lu IR "
+                   "instructions\n",
+                   ir->source_length, ir->length);
+            printf("=====================\n");
+            ir_disassemble(ir);
+        }
+    }
+
+    program   = bc;
+    shared_vm = vm;
+    parallel  = workers > 1;
+    if (sched_init(workers, vm_run_task, vm_worker_enter,
+                   vm_worker_leave) < 0) {
+        fprintf(stderr, "unable to start the workers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    Interpret_Result r = ir ? vm_interpret_ir(bc, ir) : vm_interpret(bc);
+    sched_shutdown();
+    // The trace leads up to the failing instruction
+    if (r != SUCCESS) {
+        fprintf(stderr, "execution error %d\n", r);
+        trace_dump();
         abort();
+    }
+
+    // Hit ratio, to tune --memo-size
+    if (memo_procs)
+        printf("[*] Memo cache: %llu hits, %llu misses\n", memo.hits,
+               memo.misses);
 
     printf("%llu\n", vm.result);
+    if (ir)
+        ir_free(ir);
     bc_free(bc);
+    vm_memo_free();
+    vm_worker_leave();
+    free(main_tasks.data);
+    hooks_free(&hooks);
+    vm_free();
 
     return 0;
 }
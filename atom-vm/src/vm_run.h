@@ -0,0 +1,344 @@
+// Body of the stack interpreter loop, included twice by vm.c: as the plain
+// loop, run while nothing observes the program, and with VM_RUN_HOOKED set as
+// the instrumented one, which checks the hooks and records the trace before
+// each instruction. No include guard on purpose
+//
+// Run from vm.ip up to HALT, or to a RET leaving the call stack empty which
+// ends a task. The instrumented loop also returns E_STOPPED if a hook handler
+// asks to stop, and E_SWITCH as soon as nothing is left to observe
+static Interpret_Result VM_RUN_NAME(Byte_Code *bc)
+{
+    Word *bytecode = bc_code(bc);
+#if VM_RUN_HOOKED
+    Word last = vm.ip - bytecode;
+    hooks_sync(&hooks, vm.memory);
+#endif
+
+    for (;;) {
+#if VM_RUN_HOOKED
+        Word pc = vm.ip - bytecode;
+        if (!hooks_check(&hooks, vm.memory, last, pc))
+            return E_STOPPED;
+        if (!vm_instrumented())
+            return E_SWITCH;
+        last = pc;
+        if (tracing)
+            trace_record(pc, *vm.ip, vm.stack_top > vm.stack ? vm_peek() : 0);
+#endif
+        switch (vm_next()) {
+        case OP_LOAD: {
+            Word addr = vm_pop();
+            vm_push(vm.memory[addr]);
+            break;
+        }
+        case OP_LOAD_CONST: {
+            Word addr = vm_next();
+            vm_push(vm.memory[addr]);
+            break;
+        }
+        case OP_STORE: {
+            Word addr       = vm_pop();
+            Word value      = vm_pop();
+            vm.memory[addr] = value;
+            break;
+        }
+        case OP_STORE_CONST: {
+            Word value      = vm_pop();
+            Word addr       = vm_next();
+            vm.memory[addr] = value;
+            break;
+        }
+        case OP_LOAD_IDX: {
+            Word base  = vm_next();
+            Word index = vm_pop();
+            vm_push(vm.memory[base + index]);
+            break;
+        }
+        case OP_STORE_IDX: {
+            Word base               = vm_next();
+            Word index              = vm_pop();
+            vm.memory[base + index] = vm_pop();
+            break;
+        }
+        case OP_LOAD_IDXS: {
+            Word base   = vm_next();
+            Word stride = vm_next();
+            Word index  = vm_pop();
+            vm_push(vm.memory[base + index * stride]);
+            break;
+        }
+        case OP_STORE_IDXS: {
+            Word base                        = vm_next();
+            Word stride                      = vm_next();
+            Word index                       = vm_pop();
+            vm.memory[base + index * stride] = vm_pop();
+            break;
+        }
+        case OP_CALL: {
+            Word addr = vm_next();
+            Word ret  = vm.ip - bytecode;
+            PROBE4(call, ret - 2, OP_CALL, vm_depth(), addr);
+            if (vm_memo_call(addr, &vm.stack_top, &ret))
+                break;
+            *vm.cstack_top++ = ret;
+            vm.ip            = bytecode + addr;
+            break;
+        }
+        case OP_PUSH: {
+            Word arg = vm_next();
+            // Assume PUSH can be used only for data pointers for now
+            if (string_pointer(arg))
+                vm_push(arg);
+            else
+                vm_push(vm.memory[arg]);
+            break;
+        }
+        case OP_PUSH_CONST: {
+            Word arg = vm_next();
+            vm_push(arg);
+            break;
+        }
+        case OP_ADD: {
+            Word right = vm_pop();
+            *vm_tos() += right;
+            break;
+        }
+        case OP_SUB: {
+            Word right = vm_pop();
+            *vm_tos() -= right;
+            break;
+        }
+        case OP_MUL: {
+            Word right = vm_pop();
+            *vm_tos() *= right;
+            break;
+        }
+        case OP_DIV: {
+            Word right = vm_pop();
+            if (right == 0)
+                return E_DIV_BY_ZERO;
+            *vm_tos() /= right;
+            break;
+        }
+        case OP_ADD_I: {
+            *vm_tos() += vm_next();
+            break;
+        }
+        case OP_SUB_I: {
+            *vm_tos() -= vm_next();
+            break;
+        }
+        case OP_MUL_I: {
+            *vm_tos() *= vm_next();
+            break;
+        }
+        case OP_DUP: {
+            Word value = vm_peek();
+            vm_push(value);
+            break;
+        }
+        case OP_SWAP: {
+            Word right          = vm_peek();
+            *vm_tos()           = *(vm.stack_top - 2);
+            *(vm.stack_top - 2) = right;
+            break;
+        }
+        case OP_OVER: {
+            Word value = *(vm.stack_top - 2);
+            vm_push(value);
+            break;
+        }
+        case OP_ROT: {
+            // ( a b c -- b c a )
+            Word a              = *(vm.stack_top - 3);
+            *(vm.stack_top - 3) = *(vm.stack_top - 2);
+            *(vm.stack_top - 2) = vm_peek();
+            *vm_tos()           = a;
+            break;
+        }
+        case OP_DROP: {
+            (void)vm_pop();
+            break;
+        }
+        case OP_PICK: {
+            // PICK 0 is equivalent to DUP
+            Word depth = vm_next();
+            Word value = *(vm.stack_top - 1 - depth);
+            vm_push(value);
+            break;
+        }
+        case OP_INC: {
+            *vm_tos() += 1;
+            break;
+        }
+        case OP_EQ: {
+            Word arg  = vm_pop();
+            *vm_tos() = vm_peek() == arg;
+            break;
+        }
+        case OP_LT: {
+            Word right = vm_pop();
+            *vm_tos()  = (int64_t)vm_peek() < (int64_t)right;
+            break;
+        }
+        case OP_GT: {
+            Word right = vm_pop();
+            *vm_tos()  = (int64_t)vm_peek() > (int64_t)right;
+            break;
+        }
+        case OP_LE: {
+            Word right = vm_pop();
+            *vm_tos()  = (int64_t)vm_peek() <= (int64_t)right;
+            break;
+        }
+        case OP_GE: {
+            Word right = vm_pop();
+            *vm_tos()  = (int64_t)vm_peek() >= (int64_t)right;
+            break;
+        }
+        case OP_JMP: {
+            Word addr = vm_next();
+            vm.ip     = bytecode + addr;
+            break;
+        }
+        case OP_JEQ: {
+            Word addr = vm_next();
+            if (vm_peek()) {
+                (void)vm_pop();
+                vm.ip = bytecode + addr;
+            }
+            break;
+        }
+        case OP_JNE: {
+            Word addr = vm_next();
+            if (!vm_peek()) {
+                (void)vm_pop();
+                vm.ip = bytecode + addr;
+            }
+            break;
+        }
+        // Fused compare-with-immediate and branch, the value is always
+        // consumed and no boolean is materialized on the stack
+        case OP_JEQ_I: {
+            Word imm  = vm_next();
+            Word addr = vm_next();
+            if (vm_pop() == imm)
+                vm.ip = bytecode + addr;
+            break;
+        }
+        case OP_JNE_I: {
+            Word imm  = vm_next();
+            Word addr = vm_next();
+            if (vm_pop() != imm)
+                vm.ip = bytecode + addr;
+            break;
+        }
+        case OP_JLT_I: {
+            int64_t imm = vm_next();
+            Word addr   = vm_next();
+            if ((int64_t)vm_pop() < imm)
+                vm.ip = bytecode + addr;
+            break;
+        }
+        case OP_JLE_I: {
+            int64_t imm = vm_next();
+            Word addr   = vm_next();
+            if ((int64_t)vm_pop() <= imm)
+                vm.ip = bytecode + addr;
+            break;
+        }
+        case OP_JGT_I: {
+            int64_t imm = vm_next();
+            Word addr   = vm_next();
+            if ((int64_t)vm_pop() > imm)
+                vm.ip = bytecode + addr;
+            break;
+        }
+        case OP_JGE_I: {
+            int64_t imm = vm_next();
+            Word addr   = vm_next();
+            if ((int64_t)vm_pop() >= imm)
+                vm.ip = bytecode + addr;
+            break;
+        }
+        case OP_MAKE_TUPLE: {
+            Word address    = vm_next();
+            Word tuple_size = vm_pop();
+            while (tuple_size-- > 0) {
+                vm.memory[address++] = vm_pop();
+            }
+            break;
+        }
+        case OP_PRINT: {
+            Word address = vm_pop();
+            PROBE4(print, vm.ip - 1 - bytecode, OP_PRINT, vm_depth(), address);
+            if (string_pointer(address)) {
+                print_string_from_memory(address);
+            } else {
+                printf("%lli", address);
+            }
+            fflush(stdout);
+            break;
+        }
+        case OP_PRINT_CONST: {
+            Word address = vm_pop();
+            PROBE4(print, vm.ip - 1 - bytecode, OP_PRINT_CONST, vm_depth(),
+                   address);
+            printf("%lli", address);
+            fflush(stdout);
+            break;
+        }
+        case OP_RET: {
+            PROBE4(ret, vm.ip - 1 - bytecode, OP_RET, vm_depth(),
+                   vm.cstack_top - vm.call_stack);
+            if (vm.cstack_top == vm.call_stack)
+                goto exit;
+            Word addr = vm_memo_return(*(--vm.cstack_top), vm.stack_top);
+            vm.ip     = bytecode + addr;
+            break;
+        }
+        case OP_SPAWN: {
+            Interpret_Result r = vm_spawn(bc, vm_next());
+            if (r != SUCCESS)
+                return r;
+            break;
+        }
+        case OP_SYNC: {
+            Interpret_Result r = vm_sync(true);
+            if (r != SUCCESS)
+                return r;
+            break;
+        }
+        case OP_LOAD_PROC: {
+            // First call of a procedure of a lazily loaded container, read
+            // its body over this placeholder and run it
+            if (bc_load_procedure(bc, vm.ip - 1 - bytecode) < 0)
+                return E_LOAD_PROCEDURE;
+            vm.ip--;
+            break;
+        }
+        case OP_MAP_NEW:
+        case OP_MAP_PUT:
+        case OP_MAP_GET:
+        case OP_MAP_DEL:
+        case OP_MAP_LEN: {
+            Interpret_Result r = vm_map_execute(vm.ip[-1], &vm.stack_top);
+            if (r != SUCCESS)
+                return r;
+            break;
+        }
+        case OP_HALT:
+            PROBE3(halt, vm.ip - 1 - bytecode, OP_HALT, vm_depth());
+            goto exit;
+        default:
+            return E_UNKNOWN_INSTRUCTION;
+        }
+    }
+
+exit:
+
+    // Programs may halt with nothing left on the stack
+    vm.result = vm.stack_top > vm.stack ? vm_pop() : 0;
+
+    return SUCCESS;
+}
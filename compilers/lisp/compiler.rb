@@ -154,6 +154,12 @@ class OperatorNode
     "/" => "DIV",
   }
 
+  IMMEDIATE_OPERATORS = {
+    "+" => "ADD_I",
+    "-" => "SUB_I",
+    "*" => "MUL_I",
+  }
+
   def initialize(operator, operands)
     @operator = operator
     @operands = operands
@@ -171,6 +177,10 @@ class OperatorNode
   def asm_operator
     "#{OPERATORS[@operator]}"
   end
+
+  def asm_immediate_operator
+    IMMEDIATE_OPERATORS[@operator]
+  end
 end
 
 class Parser
@@ -309,26 +319,29 @@ class Compiler
   end
 
   def generate_operator_asm(node)
-    asm = node.operands.map { |operand| run(operand) }
+    operands = node.operands
+    # Commutative operators can freely move the integer literals to the end of the operand
+    # list, to be applied as immediates to the accumulated result
+    if node.commutative? && node.asm_immediate_operator
+      literals, others = operands.partition { |operand| operand.is_a?(IntegerNode) }
+      operands = others + literals
+    end
     # Order of the operands matters when they're non-commutative, e.g. 5 - 10 != 10 - 5
     # also S-exp are really a cumulative application of the operator to a possibly infinite
-    # number of operands and each operand can be a nested S-exp.
-    if node.commutative?
-      (node.operands.length - 1).times do | _|
+    # number of operands and each operand can be a nested S-exp. Evaluate the first one and
+    # fold the others into it left to right, e.g. (- 5 2 1) => (5 - 2) - 1, so that at most
+    # two values are on the stack at any time. Integer operands are folded with the
+    # immediate form of the operator when there's one, saving a PUSH_CONST each.
+    asm = [run(operands.first)]
+    operands.drop(1).each do |operand|
+      if operand.is_a?(IntegerNode) && node.asm_immediate_operator
+        asm << "    %04d #{node.asm_immediate_operator} #{operand.value}" % @pc
+        @pc += 2
+      else
+        asm << run(operand)
         asm << "    %04d #{node.asm_operator}" % @pc
         @pc += 1
       end
-    else
-      # Dumb trick, when multiple operands for non-commutative operations such as subtraction or
-      # division, just sum all of them but last and apply the actual operator at the end
-      (node.operands.length - 2).times do |_|
-        asm << "    %04d ADD" % @pc
-        @pc += 1
-      end
-
-      asm << "    %04d #{node.asm_operator}" % @pc
-      @pc += 1
-
     end
     asm
   end
@@ -58,9 +58,43 @@ struct instruction_line bc_decode_instruction(qword e_instr)
     return data_decode_instruction(e_instr);
 }
 
+Instr_Semantic bc_vector_operands(hword op)
+{
+    switch (op) {
+    case OP_VLD:
+    case OP_VST:
+        return IS_DST_REG;
+    case OP_VSUM:
+        return IS_SRC_REG;
+    case OP_VADD:
+    case OP_VSUB:
+    case OP_VMUL:
+    case OP_VAND:
+    case OP_VXOR:
+    case OP_VCEQ:
+    case OP_VCGT:
+        return IS_SEM_REG_REG;
+    default:
+        return IS_ATOM;
+    }
+}
+
+size_t bc_instruction_words(hword op)
+{
+    return op == OP_MOVQ ? 2 : 1;
+}
+
 void bc_push_instruction(Byte_Code *bc, struct instruction_line *i)
 {
+    // The literal goes in the next word whole, the source field stays 0
+    bool wide     = bc_instruction_words(i->op) == 2;
+    qword literal = i->src;
+    if (wide)
+        i->src = 0;
+
     da_push(bc->code_segment, bc_encode_instruction(i));
+    if (wide)
+        da_push(bc->code_segment, literal);
 }
 
 qword *bc_code(const Byte_Code *const bc)
@@ -128,11 +162,16 @@ typedef struct {
 } Instruction_Def;
 
 static const char *reg_to_str[NUM_REGISTERS]    = {"AX", "BX", "CX", "DX"};
+static const char *vreg_to_str[NUM_VREGISTERS]  = {"V0", "V1", "V2", "V3",
+                                                   "V4", "V5", "V6", "V7"};
 
 static const char *instr_defs[NUM_INSTRUCTIONS] = {
-    "NOP", "CLF", "CMP", "MOV", "PSH", "POP", "ADD",  "SUB", "MUL",     "DIV",
-    "MOD", "INC", "DEC", "AND", "BOR", "XOR", "NOT",  "SHL", "SHR",     "JMP",
-    "JEQ", "JNE", "JLE", "JLT", "JGE", "JGT", "CALL", "RET", "SYSCALL", "HLT",
+    "NOP",   "CLF",  "CMP",  "MOV",  "PSH",     "POP",  "ADD",  "SUB",
+    "MUL",   "DIV",  "MOD",  "INC",  "DEC",     "AND",  "BOR",  "XOR",
+    "NOT",   "SHL",  "SHR",  "JMP",  "JEQ",     "JNE",  "JLE",  "JLT",
+    "JGE",   "JGT",  "CALL", "RET",  "SYSCALL", "HLT",  "VLD",  "VST",
+    "VSUM",  "VADD", "VSUB", "VMUL", "VAND",    "VXOR", "VCEQ", "VCGT",
+    "SPAWN", "JOIN", "XADD", "XCHG", "CMPXCHG", "MOVQ",
 };
 
 static const char *instruction_line_show(const struct instruction_line *instr,
@@ -143,7 +182,10 @@ static const char *instruction_line_show(const struct instruction_line *instr,
         return NULL;
     }
 
-    const char *iname = instr_defs[instr->op];
+    const char *iname     = instr_defs[instr->op];
+    Instr_Semantic vector = bc_vector_operands(instr->op);
+    const char **dst_regs = vector & IS_DST_REG ? vreg_to_str : reg_to_str;
+    const char **src_regs = vector & IS_SRC_REG ? vreg_to_str : reg_to_str;
 
     switch (instr->sem) {
     case IS_ATOM:
@@ -153,24 +195,24 @@ static const char *instruction_line_show(const struct instruction_line *instr,
         snprintf(dst, INSTR_SHOW_LEN, "%s %lli", iname, instr->src);
         break;
     case IS_SRC_REG:
-        snprintf(dst, INSTR_SHOW_LEN, "%s %s", iname, reg_to_str[instr->dst]);
+        snprintf(dst, INSTR_SHOW_LEN, "%s %s", iname, dst_regs[instr->dst]);
         break;
     case IS_SRC_MEM:
         snprintf(dst, INSTR_SHOW_LEN, "%s [0x%lli]", iname, instr->dst);
         break;
     case IS_DST_REG:
-        snprintf(dst, INSTR_SHOW_LEN, "%s %s", iname, reg_to_str[instr->dst]);
+        snprintf(dst, INSTR_SHOW_LEN, "%s %s", iname, dst_regs[instr->dst]);
         break;
     case IS_DST_MEM:
         snprintf(dst, INSTR_SHOW_LEN, "%s [0x%lli]", iname, instr->dst);
         break;
     case IS_SEM_REG_REG:
-        snprintf(dst, INSTR_SHOW_LEN, "%s %s %s", iname, reg_to_str[instr->dst],
-                 reg_to_str[instr->src]);
+        snprintf(dst, INSTR_SHOW_LEN, "%s %s %s", iname,
+                 dst_regs[instr->dst], src_regs[instr->src]);
         break;
     case IS_SEM_REG_MEM:
         snprintf(dst, INSTR_SHOW_LEN, "%s [0x%lli] %s", iname, instr->dst,
-                 reg_to_str[instr->src]);
+                 src_regs[instr->src]);
         break;
     case IS_SEM_IMM_MEM:
         snprintf(dst, INSTR_SHOW_LEN, "%s [0x%lli] %lli", iname, instr->dst,
@@ -178,11 +220,17 @@ static const char *instruction_line_show(const struct instruction_line *instr,
         break;
     case IS_SEM_MEM_REG:
         snprintf(dst, INSTR_SHOW_LEN, "%s %s [0x%lli]", iname,
-                 reg_to_str[instr->dst], instr->src);
+                 dst_regs[instr->dst], instr->src);
         break;
     case IS_SEM_IMM_REG:
-        snprintf(dst, INSTR_SHOW_LEN, "%s %s %lli", iname,
-                 reg_to_str[instr->dst], instr->src);
+        // Wide literals are mostly bit patterns, shown in hex
+        snprintf(dst, INSTR_SHOW_LEN,
+                 instr->op == OP_MOVQ ? "%s %s 0x%llX" : "%s %s %lli", iname,
+                 dst_regs[instr->dst], instr->src);
+        break;
+    case IS_SEM_IREG_REG:
+        snprintf(dst, INSTR_SHOW_LEN, "%s %s [%s]", iname,
+                 dst_regs[instr->dst], reg_to_str[instr->src]);
         break;
     default:
         break;
@@ -191,6 +239,24 @@ static const char *instruction_line_show(const struct instruction_line *instr,
     return dst;
 }
 
+static void word_show(size_t i, const char *instr, qword word)
+{
+    printf("0x%04lX\t%-15s %02X %02X %02X %02X %02X %02X %02X %02X  "
+           "0x%04lX",
+           i, instr,
+           (unsigned short)(word >> 56 & 0xFF),
+           (unsigned short)(word >> 48 & 0xFF),
+           (unsigned short)(word >> 40 & 0xFF),
+           (unsigned short)(word >> 32 & 0xFF),
+           (unsigned short)(word >> 24 & 0xFF),
+           (unsigned short)(word >> 16 & 0xFF),
+           (unsigned short)(word >> 8 & 0xFF),
+           (unsigned short)(word >> 0 & 0xFF),
+           (unsigned long)i * sizeof(qword));
+
+    printf("\n");
+}
+
 void bc_disassemble(const Byte_Code *const bc)
 {
 
@@ -204,22 +270,16 @@ void bc_disassemble(const Byte_Code *const bc)
 
     while (i < bc->code_segment->length) {
         memset(instr_str, 0x00, sizeof(instr_str));
-        const struct instruction_line ins = bc_decode_instruction(code[i]);
-        printf("0x%04lX\t%-16s%02X %02X %02X %02X %02X %02X %02X %02X  "
-               "0x%04lX",
-               i, instruction_line_show(&ins, instr_str),
-               (unsigned short)(code[i] >> 56 & 0xFF),
-               (unsigned short)(code[i] >> 48 & 0xFF),
-               (unsigned short)(code[i] >> 40 & 0xFF),
-               (unsigned short)(code[i] >> 32 & 0xFF),
-               (unsigned short)(code[i] >> 24 & 0xFF),
-               (unsigned short)(code[i] >> 16 & 0xFF),
-               (unsigned short)(code[i] >> 8 & 0xFF),
-               (unsigned short)(code[i] >> 0 & 0xFF),
-               (unsigned long)i * sizeof(qword));
-
-        printf("\n");
-        i++;
+        struct instruction_line ins = bc_decode_instruction(code[i]);
+        // The literal of a wide instruction is shown with it and on its own
+        // word, a truncated one is shown as 0
+        bool wide = bc_instruction_words(ins.op) == 2;
+        if (wide)
+            ins.src = i + 1 < bc->code_segment->length ? code[i + 1] : 0;
+        word_show(i, instruction_line_show(&ins, instr_str), code[i]);
+        if (wide && i + 1 < bc->code_segment->length)
+            word_show(i + 1, "", code[i + 1]);
+        i += bc_instruction_words(ins.op);
     }
 }
 
@@ -69,6 +69,22 @@ typedef enum {
     OP_RET,          // Return from subroutine
     OP_SYSCALL,      // System call
     OP_HLT,          // Halt the execution
+    OP_VLD,          // Load a vector register from memory
+    OP_VST,          // Store a vector register to memory
+    OP_VSUM,         // Sum the lanes of a vector register into a register
+    OP_VADD,         // Lane-wise add of two vector registers
+    OP_VSUB,         // Lane-wise subtract of two vector registers
+    OP_VMUL,         // Lane-wise multiply of two vector registers
+    OP_VAND,         // Lane-wise bitwise AND of two vector registers
+    OP_VXOR,         // Lane-wise bitwise XOR of two vector registers
+    OP_VCEQ,         // Lane-wise compare for equal to a mask
+    OP_VCGT,         // Lane-wise compare for greater than to a mask
+    OP_SPAWN,        // Start a thread at an address
+    OP_JOIN,         // Wait for a thread to halt
+    OP_XADD,         // Atomic fetch and add of a register to memory
+    OP_XCHG,         // Atomic exchange of a register with memory
+    OP_CMPXCHG,      // Atomic compare with AX and exchange
+    OP_MOVQ,         // Move the 64 bit literal following it into a register
     NUM_INSTRUCTIONS // Total number of instructions
 } Instruction_Set;
 
@@ -76,6 +92,21 @@ typedef enum {
 // machine.
 typedef enum { R_AX, R_BX, R_CX, R_DX, NUM_REGISTERS } Register;
 
+// Vector registers, each holding VECTOR_LANES qwords
+typedef enum {
+    R_V0,
+    R_V1,
+    R_V2,
+    R_V3,
+    R_V4,
+    R_V5,
+    R_V6,
+    R_V7,
+    NUM_VREGISTERS
+} Vector_Register;
+
+#define VECTOR_LANES 4
+
 typedef enum { D_DB, D_DW, D_DD, D_DQ, NUM_DIRECTIVES } Directive;
 
 Byte_Code *bc_create(void);
@@ -108,6 +139,14 @@ qword bc_encode_instruction(struct instruction_line *i);
 
 struct instruction_line bc_decode_instruction(qword einstr);
 
+// Operands of `op` naming a vector register rather than a general purpose
+// one, as IS_DST_REG and IS_SRC_REG bits
+Instr_Semantic bc_vector_operands(hword op);
+
+// Code words taken by `op`, wide instructions are followed by their 64 bit
+// literal in a word of its own
+size_t bc_instruction_words(hword op);
+
 void bc_push_instruction(Byte_Code *bc, struct instruction_line *i);
 
 void bc_free(Byte_Code *bc);
@@ -11,20 +11,21 @@
 typedef uint8_t hword;
 typedef uint64_t qword;
 typedef enum {
-    IS_ATOM        = 0x00,
-    IS_SRC_REG     = 0x1,  // Source is a register
-    IS_SRC_MEM     = 0x2,  // Source is memory
-    IS_SRC_IMM     = 0x4,  // Source is an immediate value
-    IS_SRC_IREG    = 0x8,  // Source is an indirect register (memory address as
-                           // register value)
-    IS_DST_REG     = 0x10, // Destination is a register
-    IS_DST_MEM     = 0x20, // Destination is memory
+    IS_ATOM         = 0x00,
+    IS_SRC_REG      = 0x1,  // Source is a register
+    IS_SRC_MEM      = 0x2,  // Source is memory
+    IS_SRC_IMM      = 0x4,  // Source is an immediate value
+    IS_SRC_IREG     = 0x8,  // Source is an indirect register (memory address
+                            // as register value)
+    IS_DST_REG      = 0x10, // Destination is a register
+    IS_DST_MEM      = 0x20, // Destination is memory
     // Combination semantics
-    IS_SEM_REG_REG = IS_SRC_REG | IS_DST_REG, // Register to Register
-    IS_SEM_REG_MEM = IS_SRC_REG | IS_DST_MEM, // Register to Memory
-    IS_SEM_MEM_REG = IS_SRC_MEM | IS_DST_REG, // Memory to Register
-    IS_SEM_IMM_REG = IS_SRC_IMM | IS_DST_REG, // Immediate to Register
-    IS_SEM_IMM_MEM = IS_SRC_IMM | IS_DST_MEM, // Immediate to Memory
+    IS_SEM_REG_REG  = IS_SRC_REG | IS_DST_REG,  // Register to Register
+    IS_SEM_REG_MEM  = IS_SRC_REG | IS_DST_MEM,  // Register to Memory
+    IS_SEM_MEM_REG  = IS_SRC_MEM | IS_DST_REG,  // Memory to Register
+    IS_SEM_IMM_REG  = IS_SRC_IMM | IS_DST_REG,  // Immediate to Register
+    IS_SEM_IMM_MEM  = IS_SRC_IMM | IS_DST_MEM,  // Immediate to Memory
+    IS_SEM_IREG_REG = IS_SRC_IREG | IS_DST_REG, // Indirect register to Register
 } Instr_Semantic;
 
 // Represents an instruction such e.g.
@@ -0,0 +1,632 @@
+#define _DEFAULT_SOURCE 1
+#include "jit.h"
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__unix__)
+
+#include <sys/mman.h>
+
+#define JIT_BUFFER_SIZE (4 << 20)
+#define JIT_MAX_BLOCK   64
+// Room for the longest instruction, the exits of a block and the side exits
+#define JIT_MARGIN      (256 + JIT_MAX_BLOCK * 16)
+// Memory operands are addressed with a 32 bit displacement
+#define JIT_MAX_ADDRESS (1 << 28)
+
+enum {
+    RAX,
+    RCX,
+    RDX,
+    RBX,
+    RSP,
+    RBP,
+    RSI,
+    RDI,
+    R8,
+    R9,
+    R10,
+    R11,
+    R12,
+    R13,
+    R14,
+    R15
+};
+
+// Opcodes of the r/m64, r64 forms
+#define MOV_STORE 0x89
+#define MOV_LOAD  0x8b
+#define ADD       0x01
+#define SUB       0x29
+#define AND       0x21
+#define OR        0x09
+#define XOR       0x31
+#define TEST      0x85
+// Opcodes taking an extension in the reg field
+#define GROUP_IMM8  0x83
+#define GROUP_UNARY 0xf7
+#define GROUP_SHIFT 0xd3
+
+// While translated code runs the guest registers are pinned to callee saved
+// host ones, RBP points to the VM, R15 to the guest memory and R8 holds the
+// last result setting the flags
+static const int pinned[NUM_REGISTERS] = {RBX, R12, R13, R14};
+
+#define VM_REG     RBP
+#define MEMORY_REG R15
+#define LAST_REG   R8
+
+// Where the translated code left the guest, `stub` is the exit taken, to be
+// patched into a jump once the next block is translated. NULL asks for the
+// instruction at `pc` to be run by the interpreter
+typedef struct jit_exit {
+    qword pc;
+    uint8_t *stub;
+} Jit_Exit;
+
+// Returned in RAX:RDX
+typedef Jit_Exit (*Jit_Enter)(VM *vm, const uint8_t *block);
+
+struct jit {
+    uint8_t *buffer;
+    uint8_t *cursor;
+    uint8_t *epilogue;
+    Jit_Enter enter;
+    // Translated block starting at each pc, `interpreted` if its first
+    // instruction isn't translated
+    uint8_t **blocks;
+    size_t blocks_length;
+};
+
+typedef struct side_exit {
+    uint8_t *jump;
+    qword pc;
+} Side_Exit;
+
+// State of the block being translated
+typedef struct block {
+    bool sets_flags;
+    size_t side_exits_length;
+    Side_Exit side_exits[JIT_MAX_BLOCK];
+} Block;
+
+typedef enum { STEP_NEXT, STEP_END, STEP_UNSUPPORTED } Step;
+
+static uint8_t interpreted;
+
+/*
+ * ENCODING
+ */
+
+static void emit(Jit *jit, uint8_t byte)
+{
+    *jit->cursor++ = byte;
+}
+
+static void emit32(Jit *jit, uint32_t v)
+{
+    memcpy(jit->cursor, &v, sizeof(v));
+    jit->cursor += sizeof(v);
+}
+
+static void emit64(Jit *jit, uint64_t v)
+{
+    memcpy(jit->cursor, &v, sizeof(v));
+    jit->cursor += sizeof(v);
+}
+
+// Point the rel32 at `at` to `target`
+static void patch32(uint8_t *at, const uint8_t *target)
+{
+    int32_t rel = target - (at + 4);
+    memcpy(at, &rel, sizeof(rel));
+}
+
+static void emit_rel32(Jit *jit, const uint8_t *target)
+{
+    patch32(jit->cursor, target);
+    jit->cursor += 4;
+}
+
+// REX.W with the high bits of the two register operands
+static void rex(Jit *jit, int reg, int rm)
+{
+    emit(jit, 0x48 | ((reg >> 3) << 2) | (rm >> 3));
+}
+
+// op rm, reg
+static void emit_rr(Jit *jit, uint8_t op, int reg, int rm)
+{
+    rex(jit, reg, rm);
+    emit(jit, op);
+    emit(jit, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// op [base + disp], reg, RSP and R12 can't be the base
+static void emit_rm(Jit *jit, uint8_t op, int reg, int base, int32_t disp)
+{
+    rex(jit, reg, base);
+    emit(jit, op);
+    emit(jit, 0x80 | ((reg & 7) << 3) | (base & 7));
+    emit32(jit, disp);
+}
+
+// imul reg, rm
+static void emit_imul(Jit *jit, int reg, int rm)
+{
+    rex(jit, reg, rm);
+    emit(jit, 0x0f);
+    emit(jit, 0xaf);
+    emit(jit, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void emit_mov_imm(Jit *jit, int reg, qword imm)
+{
+    if ((int64_t)imm == (int32_t)imm) {
+        emit_rr(jit, 0xc7, 0, reg);
+        emit32(jit, imm);
+    } else {
+        rex(jit, 0, reg);
+        emit(jit, 0xb8 | (reg & 7));
+        emit64(jit, imm);
+    }
+}
+
+// op byte [VM_REG + flags_clear], 0
+static void emit_flags_clear(Jit *jit, uint8_t op, int ext)
+{
+    emit(jit, op);
+    emit(jit, 0x80 | (ext << 3) | VM_REG);
+    emit32(jit, offsetof(VM, flags_clear));
+    emit(jit, 0);
+}
+
+static uint8_t *emit_jcc(Jit *jit, uint8_t cc)
+{
+    emit(jit, 0x0f);
+    emit(jit, cc);
+    emit32(jit, 0);
+    return jit->cursor - 4;
+}
+
+// Leave for the block at `pc`, the first 5 bytes become a direct jump to it
+// once it's translated
+static void emit_exit(Jit *jit, qword pc)
+{
+    uint8_t *stub = jit->cursor;
+    // mov eax, pc
+    emit(jit, 0xb8);
+    emit32(jit, pc);
+    // lea rdx, [stub]
+    emit(jit, 0x48);
+    emit(jit, 0x8d);
+    emit(jit, 0x15);
+    emit_rel32(jit, stub);
+    emit(jit, 0xe9);
+    emit_rel32(jit, jit->epilogue);
+}
+
+// Leave for the interpreter to run the instruction at `pc`
+static void emit_side_exit(Jit *jit, qword pc)
+{
+    emit(jit, 0xb8);
+    emit32(jit, pc);
+    // xor edx, edx
+    emit(jit, 0x31);
+    emit(jit, 0xd2);
+    emit(jit, 0xe9);
+    emit_rel32(jit, jit->epilogue);
+}
+
+static void chain(uint8_t *stub, const uint8_t *block)
+{
+    stub[0] = 0xe9;
+    patch32(stub + 1, block);
+}
+
+// Load the guest registers and jump to the block in RSI, the epilogue stores
+// them back and returns the exit left in RAX:RDX
+static void emit_trampoline(Jit *jit)
+{
+    static const uint8_t push[] = {0x53, 0x55, 0x41, 0x54, 0x41, 0x55,
+                                   0x41, 0x56, 0x41, 0x57};
+    static const uint8_t pop[]  = {0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d,
+                                   0x41, 0x5c, 0x5d, 0x5b, 0xc3};
+
+    memcpy(&jit->enter, &jit->cursor, sizeof(jit->enter));
+    memcpy(jit->cursor, push, sizeof(push));
+    jit->cursor += sizeof(push);
+    emit_rr(jit, MOV_STORE, RDI, VM_REG);
+    emit_rm(jit, MOV_LOAD, MEMORY_REG, VM_REG, offsetof(VM, memory));
+    for (int r = 0; r < NUM_REGISTERS; ++r)
+        emit_rm(jit, MOV_LOAD, pinned[r], VM_REG,
+                offsetof(VM, r) + r * sizeof(qword));
+    emit_rm(jit, MOV_LOAD, LAST_REG, VM_REG, offsetof(VM, last_result));
+    // jmp rsi
+    emit(jit, 0xff);
+    emit(jit, 0xe6);
+
+    jit->epilogue = jit->cursor;
+    for (int r = 0; r < NUM_REGISTERS; ++r)
+        emit_rm(jit, MOV_STORE, pinned[r], VM_REG,
+                offsetof(VM, r) + r * sizeof(qword));
+    emit_rm(jit, MOV_STORE, LAST_REG, VM_REG, offsetof(VM, last_result));
+    memcpy(jit->cursor, pop, sizeof(pop));
+    jit->cursor += sizeof(pop);
+}
+
+/*
+ * TRANSLATION
+ */
+
+static bool addressable(Mode mode, qword operand)
+{
+    return mode != MODE_MEM || operand < JIT_MAX_ADDRESS;
+}
+
+// Source operand to RCX
+static void load_source(Jit *jit, const Decoded_Instruction *i, Mode mode)
+{
+    switch (mode) {
+    case MODE_REG:
+        emit_rr(jit, MOV_STORE, pinned[i->src], RCX);
+        break;
+    case MODE_MEM:
+        emit_rm(jit, MOV_LOAD, RCX, MEMORY_REG, i->src * sizeof(qword));
+        break;
+    case MODE_IMM:
+        // PSH takes the immediate as encoded
+        emit_mov_imm(jit, RCX, i->op == OP_PSH ? i->src : i->imm);
+        break;
+    default:
+        // mov rcx, [r15 + rax * 8]
+        emit_rr(jit, MOV_STORE, pinned[i->src], RAX);
+        emit(jit, 0x49);
+        emit(jit, MOV_LOAD);
+        emit(jit, 0x0c);
+        emit(jit, 0xc7);
+        break;
+    }
+}
+
+// Destination operand to and from RAX
+static void load_destination(Jit *jit, const Decoded_Instruction *i, Mode mode)
+{
+    if (mode == MODE_REG)
+        emit_rr(jit, MOV_STORE, pinned[i->dst], RAX);
+    else
+        emit_rm(jit, MOV_LOAD, RAX, MEMORY_REG, i->dst * sizeof(qword));
+}
+
+static void store_destination(Jit *jit, const Decoded_Instruction *i,
+                              Mode mode)
+{
+    if (mode == MODE_REG)
+        emit_rr(jit, MOV_STORE, RAX, pinned[i->dst]);
+    else
+        emit_rm(jit, MOV_STORE, RAX, MEMORY_REG, i->dst * sizeof(qword));
+}
+
+// The result in RAX sets the flags
+static void set_flags(Jit *jit, Block *b)
+{
+    emit_rr(jit, MOV_STORE, RAX, LAST_REG);
+    if (!b->sets_flags)
+        emit_flags_clear(jit, 0xc6, 0);
+    b->sets_flags = true;
+}
+
+static void translate_binary(Jit *jit, Block *b, const Decoded_Instruction *i,
+                             Mode src, Mode dst, qword pc)
+{
+    load_source(jit, i, src);
+    if (i->op != OP_MOV)
+        load_destination(jit, i, dst);
+
+    switch (i->op) {
+    case OP_MOV:
+        emit_rr(jit, MOV_STORE, RCX, RAX);
+        break;
+    case OP_ADD:
+        emit_rr(jit, ADD, RCX, RAX);
+        break;
+    case OP_SUB:
+        emit_rr(jit, SUB, RCX, RAX);
+        break;
+    case OP_MUL:
+        emit_imul(jit, RAX, RCX);
+        break;
+    case OP_DIV:
+    case OP_MOD:
+        // The interpreter reports a zero divisor
+        emit_rr(jit, TEST, RCX, RCX);
+        b->side_exits[b->side_exits_length++] =
+            (Side_Exit){emit_jcc(jit, 0x84), pc};
+        emit_rr(jit, XOR, RDX, RDX);
+        emit_rr(jit, GROUP_UNARY, 6, RCX);
+        if (i->op == OP_MOD)
+            emit_rr(jit, MOV_STORE, RDX, RAX);
+        break;
+    }
+
+    if (i->op != OP_CMP)
+        store_destination(jit, i, dst);
+    set_flags(jit, b);
+}
+
+static void translate_register(Jit *jit, const Decoded_Instruction *i)
+{
+    int src = pinned[i->src];
+    int dst = pinned[i->dst];
+
+    switch (i->op) {
+    case OP_AND:
+        emit_rr(jit, AND, src, dst);
+        break;
+    case OP_BOR:
+        emit_rr(jit, OR, src, dst);
+        break;
+    case OP_XOR:
+        emit_rr(jit, XOR, src, dst);
+        break;
+    case OP_NOT:
+        emit_rr(jit, MOV_STORE, src, RAX);
+        emit_rr(jit, GROUP_UNARY, 3, RAX);
+        emit_rr(jit, MOV_STORE, RAX, dst);
+        break;
+    case OP_SHL:
+    case OP_SHR:
+        emit_rr(jit, MOV_STORE, src, RCX);
+        emit_rr(jit, GROUP_SHIFT, i->op == OP_SHL ? 4 : 5, dst);
+        break;
+    }
+}
+
+// Guest stack pointer to RAX, after moving it by `delta` for a POP
+static void guest_sp(Jit *jit, int delta)
+{
+    if (delta) {
+        emit_rm(jit, GROUP_IMM8, delta > 0 ? 0 : 5, VM_REG, offsetof(VM, sp));
+        emit(jit, delta > 0 ? delta : -delta);
+    }
+    emit_rm(jit, MOV_LOAD, RAX, VM_REG, offsetof(VM, sp));
+}
+
+// Push RCX on the guest stack
+static void guest_push(Jit *jit)
+{
+    guest_sp(jit, 0);
+    emit_rm(jit, MOV_STORE, RCX, RAX, 0);
+    emit_rm(jit, GROUP_IMM8, 0, VM_REG, offsetof(VM, sp));
+    emit(jit, sizeof(qword));
+}
+
+static void translate_jump(Jit *jit, Block *b, const Decoded_Instruction *i,
+                           qword pc)
+{
+    static const uint8_t conditions[NUM_INSTRUCTIONS] = {
+        [OP_JEQ] = 0x84, [OP_JNE] = 0x85, [OP_JLE] = 0x8e,
+        [OP_JLT] = 0x8c, [OP_JGE] = 0x8d, [OP_JGT] = 0x8f};
+
+    if (i->op == OP_JMP) {
+        emit_exit(jit, i->dst);
+        return;
+    }
+
+    // Flags left by an earlier block might have been cleared by CLF
+    uint8_t *cleared = NULL;
+    if (!b->sets_flags) {
+        emit_flags_clear(jit, 0x80, 7);
+        cleared = emit_jcc(jit, 0x85);
+    }
+
+    // Compared to 0, the host flags tell the sign of the last result
+    emit_rr(jit, TEST, LAST_REG, LAST_REG);
+    uint8_t *taken       = emit_jcc(jit, conditions[i->op]);
+    uint8_t *fallthrough = jit->cursor;
+    emit_exit(jit, pc + 1);
+    patch32(taken, jit->cursor);
+    if (cleared)
+        patch32(cleared, i->op == OP_JNE ? jit->cursor : fallthrough);
+    emit_exit(jit, i->dst);
+}
+
+static Step translate(Jit *jit, Block *b, const Decoded_Instruction *i,
+                      qword pc)
+{
+    Mode src = NUM_MODES;
+    Mode dst = NUM_MODES;
+
+    if (i->op == OP_NOP)
+        return STEP_NEXT;
+    if (!vm_operand_modes(i, &src, &dst))
+        return STEP_UNSUPPORTED;
+
+    switch (i->op) {
+    case OP_MOV:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+    case OP_CMP:
+        if (!addressable(src, i->src) || !addressable(dst, i->dst))
+            return STEP_UNSUPPORTED;
+        translate_binary(jit, b, i, src, dst, pc);
+        return STEP_NEXT;
+    case OP_AND:
+    case OP_BOR:
+    case OP_XOR:
+    case OP_NOT:
+    case OP_SHL:
+    case OP_SHR:
+        translate_register(jit, i);
+        return STEP_NEXT;
+    case OP_INC:
+    case OP_DEC:
+        if (!addressable(dst, i->dst))
+            return STEP_UNSUPPORTED;
+        load_destination(jit, i, dst);
+        emit_rr(jit, GROUP_IMM8, i->op == OP_INC ? 0 : 5, RAX);
+        emit(jit, 1);
+        store_destination(jit, i, dst);
+        set_flags(jit, b);
+        return STEP_NEXT;
+    case OP_PSH:
+        if (!addressable(src, i->src))
+            return STEP_UNSUPPORTED;
+        load_source(jit, i, src);
+        guest_push(jit);
+        return STEP_NEXT;
+    case OP_POP:
+        if (!addressable(dst, i->dst))
+            return STEP_UNSUPPORTED;
+        guest_sp(jit, -(int)sizeof(qword));
+        emit_rm(jit, MOV_LOAD, RAX, RAX, 0);
+        store_destination(jit, i, dst);
+        return STEP_NEXT;
+    case OP_JMP:
+    case OP_JEQ:
+    case OP_JNE:
+    case OP_JLE:
+    case OP_JLT:
+    case OP_JGE:
+    case OP_JGT:
+        translate_jump(jit, b, i, pc);
+        return STEP_END;
+    case OP_CALL:
+        emit_mov_imm(jit, RCX, pc);
+        guest_push(jit);
+        emit_exit(jit, i->dst);
+        return STEP_END;
+    case OP_MOVQ:
+        emit_mov_imm(jit, RAX, i->imm);
+        store_destination(jit, i, dst);
+        set_flags(jit, b);
+        return STEP_NEXT;
+    default:
+        return STEP_UNSUPPORTED;
+    }
+}
+
+// Translate from `pc` up to the first jump or instruction left to the
+// interpreter, NULL if that's the first one or if the buffer is full
+static uint8_t *compile(Jit *jit, const VM *vm, qword pc)
+{
+    uint8_t *block = jit->cursor;
+    Block b        = {0};
+
+    for (qword n = pc;; n += bc_instruction_words(vm->code[n].op)) {
+        if (jit->cursor + JIT_MARGIN > jit->buffer + JIT_BUFFER_SIZE) {
+            jit->cursor = block;
+            return NULL;
+        }
+
+        Step step = n - pc < JIT_MAX_BLOCK
+                        ? translate(jit, &b, &vm->code[n], n)
+                        : STEP_UNSUPPORTED;
+        if (step == STEP_END)
+            break;
+        if (step == STEP_UNSUPPORTED) {
+            if (n == pc)
+                return NULL;
+            emit_exit(jit, n);
+            break;
+        }
+    }
+
+    for (size_t s = 0; s < b.side_exits_length; ++s) {
+        patch32(b.side_exits[s].jump, jit->cursor);
+        emit_side_exit(jit, b.side_exits[s].pc);
+    }
+
+    return block;
+}
+
+static uint8_t *lookup(Jit *jit, const VM *vm, qword pc)
+{
+    if (pc >= jit->blocks_length)
+        return NULL;
+
+    if (!jit->blocks[pc]) {
+        uint8_t *block  = compile(jit, vm, pc);
+        jit->blocks[pc] = block ? block : &interpreted;
+    }
+
+    return jit->blocks[pc] == &interpreted ? NULL : jit->blocks[pc];
+}
+
+Jit *jit_create(const VM *vm)
+{
+    Jit *jit = calloc(1, sizeof(*jit));
+    if (!jit)
+        return NULL;
+
+    jit->blocks_length = vm->code_length + 1;
+    jit->blocks        = calloc(jit->blocks_length, sizeof(*jit->blocks));
+    jit->buffer        = mmap(NULL, JIT_BUFFER_SIZE,
+                              PROT_READ | PROT_WRITE | PROT_EXEC,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (!jit->blocks || jit->buffer == MAP_FAILED) {
+        if (jit->buffer != MAP_FAILED)
+            munmap(jit->buffer, JIT_BUFFER_SIZE);
+        free(jit->blocks);
+        free(jit);
+        return NULL;
+    }
+
+    jit->cursor = jit->buffer;
+    emit_trampoline(jit);
+
+    return jit;
+}
+
+void jit_free(Jit *jit)
+{
+    munmap(jit->buffer, JIT_BUFFER_SIZE);
+    free(jit->blocks);
+    free(jit);
+}
+
+Exec_Result jit_run(Jit *jit, VM *vm)
+{
+    uint8_t *from = NULL;
+    vm->run       = true;
+    vm->result    = SUCCESS;
+
+    while (vm->run) {
+        uint8_t *block = lookup(jit, vm, vm->pc);
+        if (!block) {
+            from = NULL;
+            vm_step(vm);
+            continue;
+        }
+
+        if (from)
+            chain(from, block);
+
+        Jit_Exit e = jit->enter(vm, block);
+        vm->pc     = e.pc;
+        from       = e.stub;
+        if (!from)
+            vm_step(vm);
+    }
+
+    return vm->result;
+}
+
+#else
+
+Jit *jit_create(const VM *vm)
+{
+    return NULL;
+}
+
+void jit_free(Jit *jit) {}
+
+Exec_Result jit_run(Jit *jit, VM *vm)
+{
+    return vm_run(vm);
+}
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "vm.h"
+
+// Basic block translator to x86-64 machine code. A block is compiled the
+// first time it runs and kept in a cache indexed by its pc; the guest
+// registers live in host registers for as long as translated code runs, and
+// exits to blocks already translated are patched into direct jumps.
+// Instructions it doesn't translate, SYSCALL among them, are run one at a time
+// by vm_step
+typedef struct jit Jit;
+
+// NULL if the host isn't x86-64 or no executable memory can be mapped
+Jit *jit_create(const VM *vm);
+
+void jit_free(Jit *jit);
+
+// Same as vm_run, translating the program as it goes
+Exec_Result jit_run(Jit *jit, VM *vm);
+
+#endif // JIT_H
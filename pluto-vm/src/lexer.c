@@ -18,12 +18,16 @@
 //  These static maps are used to determine the token types during the lexical
 //  analysis of the source code
 static const char *instructions[] = {
-    "nop", "clf", "cmp",  "mov", "psh",     "pop", "add", "sub",
-    "mul", "div", "mod",  "inc", "dec",     "and", "bor", "xor",
-    "not", "shl", "shr",  "jmp", "jeq",     "jne", "jle", "jlt",
-    "jge", "jgt", "call", "ret", "syscall", "hlt", NULL};
+    "nop",   "clf",  "cmp",  "mov",  "psh",     "pop",  "add",  "sub",
+    "mul",   "div",  "mod",  "inc",  "dec",     "and",  "bor",  "xor",
+    "not",   "shl",  "shr",  "jmp",  "jeq",     "jne",  "jle",  "jlt",
+    "jge",   "jgt",  "call", "ret",  "syscall", "hlt",  "vld",  "vst",
+    "vsum",  "vadd", "vsub", "vmul", "vand",    "vxor", "vceq", "vcgt",
+    "spawn", "join", "xadd", "xchg", "cmpxchg", "movq", NULL};
 
-static const char *registers[]  = {"ax", "bx", "cx", "dx", NULL};
+static const char *registers[]  = {"ax", "bx", "cx", "dx", "v0", "v1",
+                                   "v2", "v3", "v4", "v5", "v6", "v7",
+                                   NULL};
 static const char *directives[] = {"db", "dw", "dd", "dq", NULL};
 
 static const char *tokens[]     = {"TOKEN_LABEL",    "TOKEN_INSTR",
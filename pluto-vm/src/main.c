@@ -1,8 +1,11 @@
 #include "bytecode.h"
+#include "jit.h"
 #include "parser.h"
+#include "probes.h"
 #include "vm.h"
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 
 #define DEFAULT_MEMORY_SIZE 32768
 
@@ -19,24 +22,48 @@ static void die(int line_nr, const char *fmt, ...)
 
 int main(int argc, char **argv)
 {
-    if (argc < 2)
+    const char *source_path = NULL;
+    size_t memory_size      = DEFAULT_MEMORY_SIZE;
+    bool jit                = false;
+
+    // pluto-vm [--jit] [--memory <qwords>] source
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp("--jit", argv[i]) == 0)
+            jit = true;
+        else if (strcmp("--memory", argv[i]) == 0 && i + 1 < argc)
+            memory_size = strtoull(argv[++i], NULL, 0);
+        else
+            source_path = argv[i];
+    }
+
+    if (!source_path)
         die(__LINE__, "Please specify a source path");
 
-    const char *source_path = argv[1];
     // Construct the absolute path
-    Byte_Code *bc           = bc_load(source_path);
+    Byte_Code *bc = bc_load(source_path);
     if (!bc)
         die(__LINE__, "error parsing source");
 
+    PROBE2(load, bc->code_segment->length, bc->data_segment->length);
+
     printf("\n* disassamble \n");
     bc_disassemble(bc);
 
-    VM *vm = vm_create(bc, DEFAULT_MEMORY_SIZE);
+    VM *vm = vm_create(bc, memory_size);
     if (!vm)
         die(__LINE__, "Error creating CPU");
 
+    Jit *translator = jit ? jit_create(vm) : NULL;
+    if (jit && !translator)
+        fprintf(stderr, "JIT unavailable, interpreting\n");
+
     printf("\n* Execution \n");
-    vm_run(vm);
+    if (translator) {
+        jit_run(translator, vm);
+        jit_free(translator);
+    } else {
+        vm_run(vm);
+    }
     printf("\n\n* Register status\n\n");
     vm_print_registers(vm);
 
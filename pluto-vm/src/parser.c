@@ -132,12 +132,16 @@ static Instruction_Set parse_instruction(const char *str)
         return OP_NOP;
     if (strncasecmp(str, "HLT", 3) == 0)
         return OP_HLT;
+    if (strncasecmp(str, "MOVQ", 4) == 0)
+        return OP_MOVQ;
     if (strncasecmp(str, "MOV", 3) == 0)
         return OP_MOV;
     if (strncasecmp(str, "MOD", 3) == 0)
         return OP_MOD;
     if (strncasecmp(str, "CLF", 3) == 0)
         return OP_CLF;
+    if (strncasecmp(str, "CMPXCHG", 7) == 0)
+        return OP_CMPXCHG;
     if (strncasecmp(str, "CMP", 3) == 0)
         return OP_CMP;
     if (strncasecmp(str, "PSH", 3) == 0)
@@ -188,6 +192,34 @@ static Instruction_Set parse_instruction(const char *str)
         return OP_SHL;
     if (strncasecmp(str, "SHR", 3) == 0)
         return OP_SHR;
+    if (strncasecmp(str, "VLD", 3) == 0)
+        return OP_VLD;
+    if (strncasecmp(str, "VST", 3) == 0)
+        return OP_VST;
+    if (strncasecmp(str, "VSUM", 4) == 0)
+        return OP_VSUM;
+    if (strncasecmp(str, "VADD", 4) == 0)
+        return OP_VADD;
+    if (strncasecmp(str, "VSUB", 4) == 0)
+        return OP_VSUB;
+    if (strncasecmp(str, "VMUL", 4) == 0)
+        return OP_VMUL;
+    if (strncasecmp(str, "VAND", 4) == 0)
+        return OP_VAND;
+    if (strncasecmp(str, "VXOR", 4) == 0)
+        return OP_VXOR;
+    if (strncasecmp(str, "VCEQ", 4) == 0)
+        return OP_VCEQ;
+    if (strncasecmp(str, "VCGT", 4) == 0)
+        return OP_VCGT;
+    if (strncasecmp(str, "SPAWN", 5) == 0)
+        return OP_SPAWN;
+    if (strncasecmp(str, "JOIN", 4) == 0)
+        return OP_JOIN;
+    if (strncasecmp(str, "XADD", 4) == 0)
+        return OP_XADD;
+    if (strncasecmp(str, "XCHG", 4) == 0)
+        return OP_XCHG;
 
     return -1;
 }
@@ -205,6 +237,14 @@ static int64_t parse_register(const char *value)
     return -1;
 }
 
+static int64_t parse_vector_register(const char *value)
+{
+    if ((value[0] == 'V' || value[0] == 'v') && value[1] >= '0' &&
+        value[1] < '0' + NUM_VREGISTERS && value[2] == '\0')
+        return R_V0 + value[1] - '0';
+    return -1;
+}
+
 static Directive parse_directive(const char *value)
 {
     if (strncasecmp(value, "DB", 2) == 0)
@@ -226,11 +266,12 @@ static int64_t parse_hex(const char *value)
     // To distinguish success/failure after call
     errno       = 0;
 
-    int64_t val = strtol(value, &endptr, 16);
+    // Unsigned, literals of wide instructions take all the 64 bits
+    int64_t val = strtoull(value, &endptr, 16);
 
     // Check for various possible errors.
     if (errno != 0) {
-        perror("strtol");
+        perror("strtoull");
         exit(EXIT_FAILURE);
     }
 
@@ -291,7 +332,7 @@ static void parser_append_instruction(struct parser *p,
                                       struct instruction_line *instruction)
 {
     da_push(&p->instructions, *instruction);
-    p->current_address++;
+    p->current_address += bc_instruction_words(instruction->op);
     data_reset_instruction(instruction);
 }
 
@@ -390,7 +431,13 @@ int parser_run(struct parser *p, Byte_Code *bc)
             if (current->section == DATA_SECTION) {
                 goto parser_error_token;
             }
-            int64_t reg = parse_register(current->value);
+            // The instruction tells which register file the operand names,
+            // the register number is encoded the same way for both
+            Instr_Semantic position =
+                last_instruction.dst == -1 ? IS_DST_REG : IS_SRC_REG;
+            int64_t reg = bc_vector_operands(last_instruction.op) & position
+                              ? parse_vector_register(current->value)
+                              : parse_register(current->value);
             if (reg < 0) {
                 fprintf(stderr, "unrcognized register %s\n", current->value);
                 return -1;
@@ -471,12 +518,15 @@ int parser_run(struct parser *p, Byte_Code *bc)
 
             // Check if it's an indirect register and grab the content as a
             // memory address
-            int64_t ireg = parse_register(current->value);
-            if (ireg > 0) {
+            int64_t ireg = strlen(current->value) == 2
+                               ? parse_register(current->value)
+                               : -1;
+            if (ireg >= 0) {
                 // Indirect registers are supported only as SRC
                 if (last_instruction.dst == -1)
                     goto parser_error_token;
-                last_instruction.sem = IS_SRC_IREG;
+                last_instruction.sem &= ~IS_SRC_MEM;
+                last_instruction.sem |= IS_SRC_IREG;
                 last_instruction.src = ireg;
             } else {
                 // Label case e.g. a JMP, check for the presence of the
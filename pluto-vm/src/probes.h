@@ -0,0 +1,25 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+// USDT probes for perf and bpftrace, provider "pluto". With sys/sdt.h around
+// each probe is a single NOP plus an ELF note telling tracers where to patch
+// it, the arguments only cost the instructions computing them. Without it, or
+// built with -DNO_PROBES, they compile to nothing
+#if defined(__has_include) && !defined(NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_PROBES
+#endif
+#endif
+
+#ifdef HAVE_PROBES
+#define PROBE2(name, a, b)       DTRACE_PROBE2(pluto, name, a, b)
+#define PROBE3(name, a, b, c)    DTRACE_PROBE3(pluto, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(pluto, name, a, b, c, d)
+#else
+#define PROBE2(name, a, b)       ((void)0)
+#define PROBE3(name, a, b, c)    ((void)0)
+#define PROBE4(name, a, b, c, d) ((void)0)
+#endif
+
+#endif // PROBES_H
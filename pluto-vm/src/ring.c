@@ -0,0 +1,347 @@
+#define _DEFAULT_SOURCE 1
+#include "ring.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include) && !defined(NO_IO_URING)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING
+#endif
+#endif
+
+// Entries handed to the kernel at once, and host iovecs they can point to
+#define RING_DEPTH      64
+#define RING_MAX_IOVECS 1024
+
+// Entries of the guest ring translated to host iovecs, the iovecs of
+// consecutive entries are contiguous
+typedef struct batch {
+    size_t length;
+    size_t iovecs_length;
+    struct iovec iovecs[RING_MAX_IOVECS];
+    size_t first[RING_DEPTH];
+    size_t count[RING_DEPTH];
+    size_t bytes[RING_DEPTH];
+    int64_t results[RING_DEPTH];
+    bool done[RING_DEPTH];
+} Batch;
+
+static bool is_write(qword op)
+{
+    return op == RING_WRITE || op == RING_WRITEV;
+}
+
+static bool in_memory(size_t memory_size, qword addr, qword len)
+{
+    return addr <= memory_size && len <= memory_size - addr;
+}
+
+// Host iovecs of an entry appended to the batch, false if the entry is
+// malformed or points outside the guest memory
+static bool batch_add(Batch *b, qword *memory, size_t memory_size,
+                      const qword *e)
+{
+    qword addr = e[RING_ADDR];
+    qword len  = e[RING_LEN];
+    bool pairs = e[RING_OP] == RING_READV || e[RING_OP] == RING_WRITEV;
+    size_t n   = pairs ? len : 1;
+
+    if (e[RING_OP] > RING_WRITEV || n > RING_MAX_IOVECS ||
+        !in_memory(memory_size, addr, pairs ? len * 2 : len))
+        return false;
+
+    if (b->iovecs_length + n > RING_MAX_IOVECS)
+        return false;
+
+    size_t j    = b->length;
+    b->first[j] = b->iovecs_length;
+    b->count[j] = n;
+    b->bytes[j] = 0;
+    for (size_t i = 0; i < n; ++i) {
+        qword base = pairs ? memory[addr + i * 2] : addr;
+        qword size = pairs ? memory[addr + i * 2 + 1] : len;
+        if (!in_memory(memory_size, base, size))
+            return false;
+
+        b->iovecs[b->first[j] + i] =
+            (struct iovec){&memory[base], size * sizeof(qword)};
+        b->bytes[j] += size * sizeof(qword);
+    }
+
+    b->iovecs_length += n;
+    b->length++;
+    return true;
+}
+
+// Entry that moved fewer bytes than it asked for, io_uring breaks a linked
+// chain on it and the fallback does the same
+static bool is_short(const Batch *b, size_t j)
+{
+    return b->results[j] >= 0 && (size_t)b->results[j] < b->bytes[j];
+}
+
+static void cancel_from(Batch *b, size_t j)
+{
+    for (; j < b->length; ++j)
+        b->results[j] = -ECANCELED;
+}
+
+// readv/writev fallback, consecutive writes to the same descriptor are
+// gathered in a single writev
+static void run_vectored(Batch *b, const qword *entries)
+{
+    for (size_t j = 0; j < b->length;) {
+        const qword *e = &entries[j * RING_ENTRY_SIZE];
+        size_t k       = j + 1;
+        while (is_write(e[RING_OP]) && k < b->length &&
+               is_write(entries[k * RING_ENTRY_SIZE + RING_OP]) &&
+               entries[k * RING_ENTRY_SIZE + RING_FD] == e[RING_FD])
+            k++;
+
+        struct iovec *iov = &b->iovecs[b->first[j]];
+        size_t iovcnt     = b->first[k - 1] + b->count[k - 1] - b->first[j];
+        ssize_t moved     = is_write(e[RING_OP])
+                                ? writev(e[RING_FD], iov, iovcnt)
+                                : readv(e[RING_FD], iov, iovcnt);
+        if (moved < 0) {
+            b->results[j] = -errno;
+            cancel_from(b, j + 1);
+            return;
+        }
+
+        // Share the bytes moved among the gathered entries, in order, the
+        // ones after a short entry haven't moved anything
+        for (; j < k; ++j) {
+            b->results[j] =
+                (size_t)moved < b->bytes[j] ? (size_t)moved : b->bytes[j];
+            moved -= b->results[j];
+            if (is_short(b, j)) {
+                cancel_from(b, j + 1);
+                return;
+            }
+        }
+    }
+}
+
+#ifdef HAVE_IO_URING
+
+typedef struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+} Uring;
+
+static Uring uring;
+// 0 until the first submission tries to set the ring up, -1 if that failed
+static int uring_state = 0;
+// Threads of the program share the ring, one batch at a time
+static pthread_mutex_t uring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int uring_setup(Uring *u)
+{
+    struct io_uring_params p = {0};
+    u->fd = syscall(__NR_io_uring_setup, RING_DEPTH, &p);
+    if (u->fd < 0)
+        return -1;
+
+    // Reading and writing at the current file position needs 5.6
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+        close(u->fd);
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(*u->cqes);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+    uint8_t *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       u->fd, IORING_OFF_SQ_RING);
+    uint8_t *cq = sq;
+    if (sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP))
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED, u->fd,
+                  IORING_OFF_CQ_RING);
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(*u->sqes),
+                   PROT_READ | PROT_WRITE, MAP_SHARED, u->fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || u->sqes == MAP_FAILED) {
+        // The mappings go away with the descriptor
+        close(u->fd);
+        return -1;
+    }
+
+    u->sq_head  = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head  = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return 0;
+}
+
+// Queue the whole batch as a chain of linked requests, so that they run in
+// order and a failure or a short transfer cancels the rest, and wait for
+// every completion with a single io_uring_enter
+static bool submit_uring(Batch *b, const qword *entries)
+{
+    if (uring_state == 0)
+        uring_state = uring_setup(&uring) == 0 ? 1 : -1;
+    if (uring_state < 0)
+        return false;
+
+    Uring *u       = &uring;
+    unsigned start = *u->sq_tail;
+    unsigned tail  = start;
+    for (size_t j = 0; j < b->length; ++j, ++tail) {
+        const qword *e           = &entries[j * RING_ENTRY_SIZE];
+        unsigned slot            = tail & *u->sq_mask;
+        struct io_uring_sqe *sqe = &u->sqes[slot];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode    = is_write(e[RING_OP]) ? IORING_OP_WRITEV
+                                              : IORING_OP_READV;
+        sqe->fd        = e[RING_FD];
+        sqe->addr      = (uintptr_t)&b->iovecs[b->first[j]];
+        sqe->len       = b->count[j];
+        sqe->off       = (uint64_t)-1;
+        sqe->flags     = j + 1 < b->length ? IOSQE_IO_LINK : 0;
+        sqe->user_data = j;
+        u->sq_array[slot] = slot;
+        b->done[j]        = false;
+    }
+    atomic_thread_fence(memory_order_release);
+    *u->sq_tail = tail;
+
+    // Entries left in the ring, taken by the kernel and completed. Every
+    // entry the kernel took is reaped before returning, the iovecs they
+    // point to go away with the batch
+    size_t queued    = b->length;
+    size_t submitted = 0;
+    size_t completed = 0;
+    int err          = 0;
+    while (completed < queued) {
+        int r = syscall(__NR_io_uring_enter, u->fd, queued - submitted,
+                        queued - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0) {
+            err         = errno;
+            uring_state = -1;
+            // Nothing is left to reap the completions with
+            if (submitted == queued)
+                break;
+        }
+        if (r < 0 || (size_t)r < queued - submitted) {
+            // The kernel stopped short of the batch, the entries it didn't
+            // take are taken back and never run
+            unsigned head = *u->sq_head;
+            atomic_thread_fence(memory_order_acquire);
+            *u->sq_tail = head;
+            queued      = head - start;
+            submitted   = queued;
+        } else {
+            submitted += r;
+        }
+
+        unsigned head = *u->cq_head;
+        atomic_thread_fence(memory_order_acquire);
+        for (; head != *u->cq_tail; ++head, ++completed) {
+            const struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+            b->results[cqe->user_data]     = cqe->res;
+            b->done[cqe->user_data]        = true;
+        }
+        atomic_thread_fence(memory_order_release);
+        *u->cq_head = head;
+    }
+
+    for (size_t j = 0; j < b->length; ++j)
+        if (!b->done[j])
+            b->results[j] = err ? -err : -ECANCELED;
+
+    return true;
+}
+
+static bool run_uring(Batch *b, const qword *entries)
+{
+    pthread_mutex_lock(&uring_lock);
+    bool ran = submit_uring(b, entries);
+    pthread_mutex_unlock(&uring_lock);
+    return ran;
+}
+
+#else
+
+static bool run_uring(Batch *b, const qword *entries)
+{
+    return false;
+}
+
+#endif
+
+qword ring_submit(qword *memory, size_t memory_size, qword ring, qword count)
+{
+    if (!in_memory(memory_size, ring, 0) ||
+        count > (memory_size - ring) / RING_ENTRY_SIZE)
+        return 0;
+
+    Batch *b = malloc(sizeof(*b));
+    if (!b)
+        return 0;
+
+    qword succeeded = 0;
+    bool failed     = false;
+    qword n         = 0;
+    while (n < count && !failed) {
+        qword *entries   = &memory[ring + n * RING_ENTRY_SIZE];
+        b->length        = 0;
+        b->iovecs_length = 0;
+        while (n + b->length < count && b->length < RING_DEPTH &&
+               batch_add(b, memory, memory_size,
+                         &entries[b->length * RING_ENTRY_SIZE]))
+            ;
+
+        // An entry the batch couldn't take with an empty batch is malformed
+        if (b->length == 0) {
+            entries[RING_RESULT] = -EFAULT;
+            failed               = true;
+            n++;
+            break;
+        }
+
+        if (!run_uring(b, entries))
+            run_vectored(b, entries);
+
+        for (size_t j = 0; j < b->length; ++j) {
+            entries[j * RING_ENTRY_SIZE + RING_RESULT] = b->results[j];
+            if (b->results[j] < 0 || is_short(b, j))
+                failed = true;
+            if (b->results[j] >= 0)
+                succeeded++;
+        }
+        n += b->length;
+    }
+
+    for (; n < count; ++n)
+        memory[ring + n * RING_ENTRY_SIZE + RING_RESULT] = -ECANCELED;
+
+    free(b);
+    return succeeded;
+}
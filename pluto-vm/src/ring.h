@@ -0,0 +1,27 @@
+#ifndef RING_H
+#define RING_H
+
+#include "data.h"
+
+// I/O ring living in guest memory: a program fills an array of entries and
+// submits all of them with a single SYSCALL, BX = 2, CX = address of the first
+// entry and DX = number of entries. Each entry takes RING_ENTRY_SIZE qwords:
+//
+//   op      one of Ring_Op
+//   fd      host file descriptor
+//   addr    buffer for READ and WRITE, array of `len` (addr, len) pairs for
+//           READV and WRITEV
+//   len     qwords for READ and WRITE, pairs for READV and WRITEV
+//   result  bytes transferred or -errno, written back on completion
+//
+// Entries run in order, the first failing one, or the first one transferring
+// less than `len` asked for, cancels the rest with -ECANCELED
+typedef enum { RING_READ, RING_WRITE, RING_READV, RING_WRITEV } Ring_Op;
+
+enum { RING_OP, RING_FD, RING_ADDR, RING_LEN, RING_RESULT, RING_ENTRY_SIZE };
+
+// Run `count` entries starting at `ring`, through io_uring when the kernel
+// has it and with readv/writev otherwise. Returns the entries that succeeded
+qword ring_submit(qword *memory, size_t memory_size, qword ring, qword count);
+
+#endif // RING_H
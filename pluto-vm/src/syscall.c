@@ -1,5 +1,11 @@
+#define _DEFAULT_SOURCE 1
 #include "syscall.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 void syscall_exit(void) { exit(EXIT_SUCCESS); }
@@ -22,3 +28,55 @@ ssize_t syscall_read(qword fd, qword *addr, size_t len)
 }
 
 int64_t syscall_atoi(qword *addr) { return atoi((char *)addr); }
+
+int64_t syscall_map(qword *memory, size_t memory_size, size_t *top,
+                    size_t floor, qword path, qword *length)
+{
+    char name[PATH_MAX];
+    size_t n = 0;
+    for (; path + n < memory_size && n < PATH_MAX && memory[path + n]; ++n)
+        name[n] = memory[path + n];
+    if (n == PATH_MAX)
+        return -ENAMETOOLONG;
+    if (path + n >= memory_size)
+        return -EFAULT;
+    name[n] = '\0';
+
+    int fd = open(name, O_RDONLY);
+    if (fd < 0)
+        return -errno;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int err = errno;
+        close(fd);
+        return -err;
+    }
+
+    // Mappings are whole pages, the tail of the last one reads as zero
+    size_t page  = sysconf(_SC_PAGESIZE) / sizeof(qword);
+    size_t pages = (st.st_size + page * sizeof(qword) - 1) /
+                   (page * sizeof(qword));
+    int64_t base = -ENOMEM;
+
+    size_t end = *top / page * page;
+    if (pages <= end / page && end - pages * page >= floor) {
+        base = end - pages * page;
+        // MAP_FIXED replaces the anonymous guest pages in place, MAP_PRIVATE
+        // keeps the file untouched by copy-on-write stores. The pages stay
+        // writable, the VM doesn't check stores against the mappings and a
+        // read-only page would fault the host
+        if (pages > 0 &&
+            mmap(&memory[base], pages * page * sizeof(qword),
+                 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd,
+                 0) == MAP_FAILED)
+            base = -errno;
+        else
+            *top = base;
+    }
+
+    close(fd);
+    if (base >= 0)
+        *length = st.st_size;
+    return base;
+}
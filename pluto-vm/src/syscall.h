@@ -2,6 +2,7 @@
 #define SYSCALL_H
 
 #include "bytecode.h"
+#include <stdbool.h>
 #include <stdio.h>
 
 void syscall_exit(void);
@@ -9,4 +10,12 @@ ssize_t syscall_write(qword fd, qword *addr, size_t len);
 ssize_t syscall_read(qword fd, qword *addr, size_t len);
 int64_t syscall_atoi(qword *addr);
 
+// Map the file named by the string at `path`, one character per qword as in
+// the data segment, right below `*top` and no lower than `floor`,
+// copy-on-write. `*top` moves down to the start of the mapping and its guest
+// address is returned, or -errno; `*length` is the size in bytes. The caller
+// serializes the updates of `*top`
+int64_t syscall_map(qword *memory, size_t memory_size, size_t *top,
+                    size_t floor, qword path, qword *length);
+
 #endif
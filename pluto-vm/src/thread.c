@@ -0,0 +1,211 @@
+#include "thread.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+
+// Addresses waited on are hashed to a few buckets, each one queueing its
+// waiters with the address they sleep on so a wake only takes those on the
+// same address
+#define WAIT_BUCKETS 64
+
+typedef enum { SLOT_FREE, SLOT_RUNNING, SLOT_JOINING } Slot_State;
+
+struct threads {
+    pthread_mutex_t lock;
+    struct {
+        Slot_State state;
+        pthread_t handle;
+        VM *vm;
+    } slots[MAX_THREADS];
+};
+
+// Lives on the stack of the waiting thread, the waker unlinks it
+typedef struct waiter {
+    const qword *addr;
+    bool woken;
+    struct waiter *next;
+} Waiter;
+
+typedef struct wait_bucket {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    Waiter *waiters;
+} Wait_Bucket;
+
+static Wait_Bucket buckets[WAIT_BUCKETS];
+static pthread_once_t buckets_once = PTHREAD_ONCE_INIT;
+
+static void *thread_run(void *arg)
+{
+    vm_run(arg);
+    return NULL;
+}
+
+int64_t thread_spawn(VM *vm, qword pc, qword reg)
+{
+    VM *root = vm->root;
+    // Only the first thread runs before the first SPAWN, nobody else can be
+    // creating the table
+    if (!root->threads) {
+        root->threads = calloc(1, sizeof(*root->threads));
+        if (!root->threads)
+            return -ENOMEM;
+        pthread_mutex_init(&root->threads->lock, NULL);
+    }
+
+    VM *child = malloc(sizeof(*child));
+    if (!child)
+        return -ENOMEM;
+
+    *child = *vm;
+    memset(child->stack, 0x00, STACK_SIZE * sizeof(*child->stack));
+    child->sp          = child->stack;
+    child->pc          = pc;
+    child->r[reg]      = 0;
+    child->flags_clear = true;
+
+    Threads *t = root->threads;
+    int err    = EAGAIN;
+    size_t n   = 0;
+    pthread_mutex_lock(&t->lock);
+    for (; n < MAX_THREADS; ++n) {
+        if (t->slots[n].state != SLOT_FREE)
+            continue;
+        err = pthread_create(&t->slots[n].handle, NULL, thread_run, child);
+        if (err == 0) {
+            t->slots[n].state = SLOT_RUNNING;
+            t->slots[n].vm    = child;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    if (err != 0) {
+        free(child);
+        return -err;
+    }
+
+    return n + 1;
+}
+
+// Join the thread in slot `n`, -ESRCH if it's not running or -errno if it
+// can't be joined, e.g. a thread joining itself, which keeps it running
+static int join(Threads *t, size_t n, int64_t *ax)
+{
+    // Claimed under the lock, only one thread gets to join it
+    pthread_mutex_lock(&t->lock);
+    bool running = t->slots[n].state == SLOT_RUNNING;
+    if (running)
+        t->slots[n].state = SLOT_JOINING;
+    pthread_mutex_unlock(&t->lock);
+    if (!running)
+        return -ESRCH;
+
+    int err = pthread_join(t->slots[n].handle, NULL);
+    if (err != 0) {
+        pthread_mutex_lock(&t->lock);
+        t->slots[n].state = SLOT_RUNNING;
+        pthread_mutex_unlock(&t->lock);
+        return -err;
+    }
+
+    *ax = t->slots[n].vm->r[R_AX];
+    free(t->slots[n].vm);
+
+    pthread_mutex_lock(&t->lock);
+    t->slots[n].state = SLOT_FREE;
+    pthread_mutex_unlock(&t->lock);
+
+    return 0;
+}
+
+int64_t thread_join(VM *vm, qword id)
+{
+    int64_t ax = 0;
+    Threads *t = vm->root->threads;
+    if (!t || id == 0 || id > MAX_THREADS)
+        return -ESRCH;
+    int err = join(t, id - 1, &ax);
+    return err < 0 ? err : ax;
+}
+
+void thread_join_all(VM *vm)
+{
+    Threads *t = vm->threads;
+    if (!t)
+        return;
+
+    // Threads may still be spawning others, join until none is left
+    int64_t ax = 0;
+    for (bool joined = true; joined;) {
+        joined = false;
+        for (size_t n = 0; n < MAX_THREADS; ++n)
+            joined |= join(t, n, &ax) == 0;
+    }
+
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+    vm->threads = NULL;
+}
+
+static void buckets_init(void)
+{
+    for (size_t i = 0; i < WAIT_BUCKETS; ++i) {
+        pthread_mutex_init(&buckets[i].lock, NULL);
+        pthread_cond_init(&buckets[i].cond, NULL);
+    }
+}
+
+static Wait_Bucket *bucket(const qword *addr)
+{
+    pthread_once(&buckets_once, buckets_init);
+    return &buckets[((uintptr_t)addr / sizeof(qword)) % WAIT_BUCKETS];
+}
+
+int64_t thread_wait(qword *addr, qword expected)
+{
+    Wait_Bucket *b = bucket(addr);
+
+    // A waker changes the value before taking the lock, checking it under the
+    // lock means no wakeup is lost in between
+    pthread_mutex_lock(&b->lock);
+    if (atomic_load((_Atomic qword *)addr) != expected) {
+        pthread_mutex_unlock(&b->lock);
+        return -EAGAIN;
+    }
+    // Queued last, wakes go in arrival order
+    Waiter w     = {.addr = addr, .woken = false, .next = NULL};
+    Waiter **end = &b->waiters;
+    while (*end)
+        end = &(*end)->next;
+    *end = &w;
+    while (!w.woken)
+        pthread_cond_wait(&b->cond, &b->lock);
+    pthread_mutex_unlock(&b->lock);
+
+    return 0;
+}
+
+int64_t thread_wake(qword *addr, qword count)
+{
+    Wait_Bucket *b = bucket(addr);
+
+    pthread_mutex_lock(&b->lock);
+    qword woken = 0;
+    for (Waiter **w = &b->waiters; *w && woken < count;) {
+        if ((*w)->addr != addr) {
+            w = &(*w)->next;
+            continue;
+        }
+        (*w)->woken = true;
+        *w          = (*w)->next;
+        woken++;
+    }
+    // The others sharing the condition go back to sleep
+    if (woken > 0)
+        pthread_cond_broadcast(&b->cond);
+    pthread_mutex_unlock(&b->lock);
+
+    return woken;
+}
@@ -0,0 +1,32 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+#include "vm.h"
+
+// Threads started by SPAWN, each one a VM of its own sharing the code and the
+// memory of the one the program started on, run by vm_run on a host thread.
+// Ids go from 1 to MAX_THREADS and are reused once joined
+#define MAX_THREADS 64
+
+// Start a thread at `pc` with a copy of the registers of `vm` and an empty
+// stack, `reg` reads 0 in the copy. Returns the id of the thread or -errno
+int64_t thread_spawn(VM *vm, qword pc, qword reg);
+
+// Wait for thread `id` to halt, returns its AX, -ESRCH for an id not running
+// or -EDEADLK for the calling thread itself
+int64_t thread_join(VM *vm, qword id);
+
+// Wait for every thread still running, called on the VM the program started
+// on before it's reset or freed
+void thread_join_all(VM *vm);
+
+// Futex-like wait on a memory qword: sleeps only if it still holds
+// `expected`, returns 0 once woken by thread_wake on the same address or
+// -EAGAIN
+int64_t thread_wait(qword *addr, qword expected);
+
+// Wake up to `count` threads waiting on `addr`, oldest first, returns how
+// many were woken
+int64_t thread_wake(qword *addr, qword count);
+
+#endif // THREAD_H
@@ -0,0 +1,183 @@
+#include "vector.h"
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(NO_SIMD)
+#include <immintrin.h>
+#define HAVE_SIMD
+#endif
+
+/*
+ * PLAIN C
+ */
+
+static void generic_add(qword *d, const qword *s)
+{
+    for (int i = 0; i < VECTOR_LANES; ++i)
+        d[i] += s[i];
+}
+
+static void generic_sub(qword *d, const qword *s)
+{
+    for (int i = 0; i < VECTOR_LANES; ++i)
+        d[i] -= s[i];
+}
+
+static void generic_mul(qword *d, const qword *s)
+{
+    for (int i = 0; i < VECTOR_LANES; ++i)
+        d[i] *= s[i];
+}
+
+static void generic_and(qword *d, const qword *s)
+{
+    for (int i = 0; i < VECTOR_LANES; ++i)
+        d[i] &= s[i];
+}
+
+static void generic_xor(qword *d, const qword *s)
+{
+    for (int i = 0; i < VECTOR_LANES; ++i)
+        d[i] ^= s[i];
+}
+
+static void generic_eq(qword *d, const qword *s)
+{
+    for (int i = 0; i < VECTOR_LANES; ++i)
+        d[i] = d[i] == s[i] ? ~(qword)0 : 0;
+}
+
+static void generic_gt(qword *d, const qword *s)
+{
+    for (int i = 0; i < VECTOR_LANES; ++i)
+        d[i] = (int64_t)d[i] > (int64_t)s[i] ? ~(qword)0 : 0;
+}
+
+static qword generic_sum(const qword *v)
+{
+    qword sum = 0;
+    for (int i = 0; i < VECTOR_LANES; ++i)
+        sum += v[i];
+    return sum;
+}
+
+static const Vector_Ops generic_ops = {
+    "generic",   generic_add, generic_sub, generic_mul, generic_and,
+    generic_xor, generic_eq,  generic_gt,  generic_sum,
+};
+
+#ifdef HAVE_SIMD
+
+/*
+ * SSE2, TWO LANES PER REGISTER
+ */
+
+// Vector registers and guest memory are only qword aligned, every access is
+// unaligned
+#define SSE2_LOAD(p)     _mm_loadu_si128((const __m128i *)(p))
+#define SSE2_STORE(p, x) _mm_storeu_si128((__m128i *)(p), (x))
+
+#define SSE2_BINARY(name, expr)                                                \
+    static void sse2_##name(qword *d, const qword *s)                          \
+    {                                                                          \
+        for (int i = 0; i < VECTOR_LANES; i += 2) {                            \
+            __m128i a = SSE2_LOAD(&d[i]);                                      \
+            __m128i b = SSE2_LOAD(&s[i]);                                      \
+            SSE2_STORE(&d[i], (expr));                                         \
+        }                                                                      \
+    }
+
+// Low 64 bits of the product out of three 32x32 multiplies, there's no 64 bit
+// one before AVX-512
+static __m128i sse2_mul64(__m128i a, __m128i b)
+{
+    __m128i lo    = _mm_mul_epu32(a, b);
+    __m128i cross = _mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(a, 32), b),
+                                  _mm_mul_epu32(a, _mm_srli_epi64(b, 32)));
+    return _mm_add_epi64(lo, _mm_slli_epi64(cross, 32));
+}
+
+// Both 32 bit halves equal, 64 bit compares need SSE4.1
+static __m128i sse2_eq64(__m128i a, __m128i b)
+{
+    __m128i eq = _mm_cmpeq_epi32(a, b);
+    return _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+}
+
+SSE2_BINARY(add, _mm_add_epi64(a, b))
+SSE2_BINARY(sub, _mm_sub_epi64(a, b))
+SSE2_BINARY(mul, sse2_mul64(a, b))
+SSE2_BINARY(and, _mm_and_si128(a, b))
+SSE2_BINARY(xor, _mm_xor_si128(a, b))
+SSE2_BINARY(eq, sse2_eq64(a, b))
+
+static qword sse2_sum(const qword *v)
+{
+    __m128i x = _mm_add_epi64(SSE2_LOAD(&v[0]), SSE2_LOAD(&v[2]));
+    return _mm_cvtsi128_si64(_mm_add_epi64(x, _mm_unpackhi_epi64(x, x)));
+}
+
+// Signed 64 bit greater than needs SSE4.2, left to plain C
+static const Vector_Ops sse2_ops = {
+    "sse2",   sse2_add, sse2_sub,   sse2_mul, sse2_and,
+    sse2_xor, sse2_eq,  generic_gt, sse2_sum,
+};
+
+/*
+ * AVX2, ALL LANES IN ONE REGISTER
+ */
+
+#define AVX2 __attribute__((target("avx2")))
+
+#define AVX2_LOAD(p)     _mm256_loadu_si256((const __m256i *)(p))
+#define AVX2_STORE(p, x) _mm256_storeu_si256((__m256i *)(p), (x))
+
+#define AVX2_BINARY(name, expr)                                                \
+    AVX2 static void avx2_##name(qword *d, const qword *s)                     \
+    {                                                                          \
+        __m256i a = AVX2_LOAD(d);                                              \
+        __m256i b = AVX2_LOAD(s);                                              \
+        AVX2_STORE(d, (expr));                                                 \
+    }
+
+AVX2 static __m256i avx2_mul64(__m256i a, __m256i b)
+{
+    __m256i lo    = _mm256_mul_epu32(a, b);
+    __m256i cross = _mm256_add_epi64(
+        _mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+        _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+    return _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+}
+
+AVX2_BINARY(add, _mm256_add_epi64(a, b))
+AVX2_BINARY(sub, _mm256_sub_epi64(a, b))
+AVX2_BINARY(mul, avx2_mul64(a, b))
+AVX2_BINARY(and, _mm256_and_si256(a, b))
+AVX2_BINARY(xor, _mm256_xor_si256(a, b))
+AVX2_BINARY(eq, _mm256_cmpeq_epi64(a, b))
+AVX2_BINARY(gt, _mm256_cmpgt_epi64(a, b))
+
+AVX2 static qword avx2_sum(const qword *v)
+{
+    __m256i x = AVX2_LOAD(v);
+    __m128i y = _mm_add_epi64(_mm256_castsi256_si128(x),
+                              _mm256_extracti128_si256(x, 1));
+    return _mm_cvtsi128_si64(_mm_add_epi64(y, _mm_unpackhi_epi64(y, y)));
+}
+
+static const Vector_Ops avx2_ops = {
+    "avx2",   avx2_add, avx2_sub, avx2_mul, avx2_and,
+    avx2_xor, avx2_eq,  avx2_gt,  avx2_sum,
+};
+
+#endif
+
+const Vector_Ops *vector_ops(void)
+{
+#ifdef HAVE_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return &avx2_ops;
+    if (__builtin_cpu_supports("sse2"))
+        return &sse2_ops;
+#endif
+    return &generic_ops;
+}
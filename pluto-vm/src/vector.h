@@ -0,0 +1,33 @@
+#ifndef VECTOR_H
+#define VECTOR_H
+
+#include "bytecode.h"
+
+// Vector register, VECTOR_LANES qwords processed by a single instruction
+typedef struct vector {
+    qword lane[VECTOR_LANES];
+} Vector;
+
+// Lane-wise `d = d op s`, compares set a lane to all ones when true and to
+// zero otherwise
+typedef void (*Vector_Binary)(qword *d, const qword *s);
+
+// One implementation of the vector instructions, picked once at startup by
+// vector_ops
+typedef struct vector_ops {
+    const char *name;
+    Vector_Binary add;
+    Vector_Binary sub;
+    Vector_Binary mul;
+    Vector_Binary band;
+    Vector_Binary bxor;
+    Vector_Binary eq;
+    Vector_Binary gt;
+    qword (*sum)(const qword *v);
+} Vector_Ops;
+
+// AVX2 if the CPU has it, SSE2 on any other x86-64 and plain C elsewhere or
+// when built with -DNO_SIMD
+const Vector_Ops *vector_ops(void);
+
+#endif // VECTOR_H
@@ -1,25 +1,44 @@
+#define _DEFAULT_SOURCE 1
 #include "vm.h"
+#include "probes.h"
+#include "ring.h"
 #include "syscall.h"
+#include "thread.h"
+#include <errno.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 
 static void clear_flags(VM *vm);
 
-static void reset(VM *vm, qword *code_segment, hword *data_segment,
-                  size_t data_len, size_t memory_size)
+static void reset(VM *vm, hword *data_segment, size_t data_len)
 {
     memset(vm->r, 0x00, NUM_REGISTERS * sizeof(*vm->r));
+    memset(vm->v, 0x00, NUM_VREGISTERS * sizeof(*vm->v));
     memset(vm->stack, 0x00, STACK_SIZE * sizeof(*vm->stack));
-    vm->bcode = code_segment;
 
-    vm->pc    = 0;
-    vm->sp    = vm->stack;
-    vm->run   = false;
+    vm->pc  = 0;
+    vm->sp  = vm->stack;
+    vm->run = false;
+    clear_flags(vm);
+    PROBE3(reset, vm->code_length, data_len, vm->memory_size);
+
+    // Mapped files go back to anonymous memory
+    if (vm->map_top < vm->memory_size)
+        mmap(&vm->memory[vm->map_top],
+             (vm->memory_size - vm->map_top) * sizeof(qword),
+             PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    vm->map_top   = vm->memory_size;
+    vm->map_floor = DATA_OFFSET + data_len;
 
     if (!data_segment)
         return;
 
-    memset(vm->memory, 0x00, memory_size * sizeof(qword));
+    // Give back every page touched so far, they read as zero again on the next
+    // access. Only the address table and the data are written
+    madvise(vm->memory, vm->memory_size * sizeof(qword), MADV_DONTNEED);
     // Addressing
     for (size_t i = DATA_OFFSET; i < DATA_OFFSET * 2; ++i)
         vm->memory[i] = i + DATA_OFFSET;
@@ -27,44 +46,33 @@ static void reset(VM *vm, qword *code_segment, hword *data_segment,
     for (size_t i = DATA_OFFSET * 2, j = 0; j < data_len - DATA_OFFSET;
          ++i, ++j)
         vm->memory[i] = data_segment[j];
-
-    clear_flags(vm);
 }
 
-static qword fetch(VM *vm) { return vm->bcode[vm->pc++]; }
-
-static struct instruction_line decode(qword einstr)
+static void clear_flags(VM *vm)
 {
-    return bc_decode_instruction(einstr);
+    vm->flags_clear = true;
 }
 
-static void clear_flags(VM *vm)
+// Flags are lazy, only the result is kept and the jumps test it directly
+static void set_flags(VM *vm, qword v)
 {
-    vm->flags[FL_ZRO] = 0;
-    vm->flags[FL_NEG] = 0;
-    vm->flags[FL_POS] = 0;
+    vm->last_result = v;
+    vm->flags_clear = false;
 }
 
-// TODO consider using a single register with multiple FL_* enum values
-static void set_flags(VM *vm, qword v, int type)
+static bool flag(const VM *vm, Flag f)
 {
-    clear_flags(vm);
-    if (type == 0) {
-        if (vm->r[v] == 0) {
-            vm->flags[FL_ZRO] = 1;
-        } else if (vm->r[v] >> 63) {
-            vm->flags[FL_NEG] = 1;
-        } else {
-            vm->flags[FL_POS] = 1;
-        }
-    } else {
-        if (vm->memory[v] == 0) {
-            vm->flags[FL_ZRO] = 1;
-        } else if (vm->memory[v] >> 63) {
-            vm->flags[FL_NEG] = 1;
-        } else {
-            vm->flags[FL_POS] = 1;
-        }
+    if (vm->flags_clear)
+        return false;
+
+    int64_t v = vm->last_result;
+    switch (f) {
+    case FL_ZRO:
+        return v == 0;
+    case FL_NEG:
+        return v < 0;
+    default:
+        return v > 0;
     }
 }
 
@@ -78,247 +86,434 @@ static uint64_t sign_extend(qword x, int bit_count)
     return x;
 }
 
-static int set_operands(VM *vm, const struct instruction_line *i, qword *src,
-                        qword **dst)
+// The qword gets the register only if it equals AX, AX gets the previous
+// value and the flags compare it to the old AX, zero if the exchange happened
+static qword compare_exchange(VM *vm, _Atomic qword *m, qword r)
 {
-    *src = (i->sem & IS_SRC_REG)    ? vm->r[i->src]
-           : (i->sem & IS_SRC_MEM)  ? vm->memory[i->src]
-           : (i->sem & IS_SRC_IREG) ? vm->memory[vm->r[i->src]]
-                                    : sign_extend(i->src, 27);
-
-    if (i->sem & IS_DST_REG) {
-        *dst = &vm->r[i->dst];
-        return 0;
-    }
-    *dst = &vm->memory[i->dst];
-    return 1;
+    qword expected = vm->r[R_AX];
+    atomic_compare_exchange_strong(m, &expected, r);
+    set_flags(vm, expected - vm->r[R_AX]);
+    vm->r[R_AX] = expected;
+    return r;
 }
 
-static Exec_Result execute(VM *vm, struct instruction_line *instr)
+/*
+ * INSTRUCTION HANDLERS
+ */
+
+// Operand access for each addressing mode
+#define SRC_REG  vm->r[i->src]
+#define SRC_MEM  vm->memory[i->src]
+#define SRC_IMM  i->imm
+#define SRC_IREG vm->memory[vm->r[i->src]]
+#define DST_REG  vm->r[i->dst]
+#define DST_MEM  vm->memory[i->dst]
+
+// Address of the memory operand of the atomic instructions
+#define ADDR_MEM  i->src
+#define ADDR_IREG vm->r[i->src]
+
+// Two operand instructions setting the flags on the destination: name,
+// whether a zero source traps and the result computed from the destination
+// `d` and the source `s`
+#define BINARY_OPS(X)                                                          \
+    X(MOV, 0, s)                                                               \
+    X(ADD, 0, d + s)                                                           \
+    X(SUB, 0, d - s)                                                           \
+    X(MUL, 0, d * s)                                                           \
+    X(DIV, 1, d / s)                                                           \
+    X(MOD, 1, d % s)                                                           \
+    X(CMP, 0, d)
+
+// Every source mode to every destination one
+#define BINARY_MODES(X, op, check, expr)                                       \
+    X(op, check, expr, REG, REG)                                               \
+    X(op, check, expr, MEM, REG)                                               \
+    X(op, check, expr, IMM, REG)                                               \
+    X(op, check, expr, IREG, REG)                                              \
+    X(op, check, expr, REG, MEM)                                               \
+    X(op, check, expr, MEM, MEM)                                               \
+    X(op, check, expr, IMM, MEM)                                               \
+    X(op, check, expr, IREG, MEM)
+
+// Bitwise instructions, registers only and leaving the flags untouched
+#define REGISTER_OPS(X)                                                        \
+    X(AND, d & s)                                                              \
+    X(BOR, d | s)                                                              \
+    X(XOR, d ^ s)                                                              \
+    X(NOT, -s)                                                                 \
+    X(SHL, d << s)                                                             \
+    X(SHR, d >> s)
+
+// Conditions on the sign of the last result setting the flags, after CLF only
+// JNE and JMP are taken
+#define LAST ((int64_t)vm->last_result)
+
+#define JUMP_OPS(X)                                                            \
+    X(JMP, true)                                                               \
+    X(JEQ, !vm->flags_clear && LAST == 0)                                      \
+    X(JNE, vm->flags_clear || LAST != 0)                                       \
+    X(JLE, !vm->flags_clear && LAST <= 0)                                      \
+    X(JLT, !vm->flags_clear && LAST < 0)                                       \
+    X(JGE, !vm->flags_clear && LAST >= 0)                                      \
+    X(JGT, !vm->flags_clear && LAST > 0)
+
+// INC and DEC on a register or on memory
+#define STEP_OPS(X)                                                            \
+    X(INC, 1, REG)                                                             \
+    X(INC, 1, MEM)                                                             \
+    X(DEC, -1, REG)                                                            \
+    X(DEC, -1, MEM)
+
+// Lane-wise instructions on two vector registers, run by the member of
+// vm->vector
+#define VECTOR_OPS(X)                                                          \
+    X(VADD, add)                                                               \
+    X(VSUB, sub)                                                               \
+    X(VMUL, mul)                                                               \
+    X(VAND, band)                                                              \
+    X(VXOR, bxor)                                                              \
+    X(VCEQ, eq)                                                                \
+    X(VCGT, gt)
+
+// Atomic read-modify-write of the qword at address `a` with a register,
+// which gets back the previous value: name and the result from the atomic
+// `m` and the register value `r`
+#define ATOMIC_OPS(X)                                                          \
+    X(XADD, atomic_fetch_add(m, r))                                            \
+    X(XCHG, atomic_exchange(m, r))                                             \
+    X(CMPXCHG, compare_exchange(vm, m, r))
+
+// The address comes from the instruction or from a register
+#define ATOMIC_MODES(X, op, expr)                                              \
+    X(op, expr, MEM)                                                           \
+    X(op, expr, IREG)
+
+// Handlers written out by hand in vm_run, FAULT reports an operand out of the
+// registers, the memory or the code
+#define OTHER_KINDS(X)                                                         \
+    X(PSH_REG)                                                                 \
+    X(PSH_MEM)                                                                 \
+    X(PSH_IMM)                                                                 \
+    X(POP_REG)                                                                 \
+    X(POP_MEM)                                                                 \
+    X(NOP)                                                                     \
+    X(CLF)                                                                     \
+    X(CALL)                                                                    \
+    X(RET)                                                                     \
+    X(SYSCALL)                                                                 \
+    X(HLT)                                                                     \
+    X(VLD_MEM)                                                                 \
+    X(VLD_IREG)                                                                \
+    X(VST_MEM)                                                                 \
+    X(VST_IREG)                                                                \
+    X(VSUM)                                                                    \
+    X(SPAWN)                                                                   \
+    X(JOIN)                                                                    \
+    X(MOVQ)                                                                    \
+    X(UNKNOWN)                                                                 \
+    X(FAULT)
+
+#define BINARY_KIND(op, check, expr, src, dst) K_##op##_##src##_##dst,
+#define BINARY_KINDS(op, check, expr)                                          \
+    BINARY_MODES(BINARY_KIND, op, check, expr)
+#define ATOMIC_KIND(op, expr, src) K_##op##_##src,
+#define ATOMIC_KINDS(op, expr)     ATOMIC_MODES(ATOMIC_KIND, op, expr)
+#define OP_KIND(op, expr)          K_##op,
+#define STEP_KIND(op, delta, dst)  K_##op##_##dst,
+#define OTHER_KIND(name)           K_##name,
+
+// One handler per opcode and addressing mode
+typedef enum {
+    BINARY_OPS(BINARY_KINDS) REGISTER_OPS(OP_KIND) JUMP_OPS(OP_KIND)
+        STEP_OPS(STEP_KIND) VECTOR_OPS(OP_KIND) ATOMIC_OPS(ATOMIC_KINDS)
+            OTHER_KINDS(OTHER_KIND) NUM_KINDS
+} Kind;
+
+#define BINARY_ENTRY(op, check, expr, src, dst)                                \
+    [OP_##op][MODE_##src][MODE_##dst] = K_##op##_##src##_##dst,
+#define BINARY_ENTRIES(op, check, expr)                                        \
+    BINARY_MODES(BINARY_ENTRY, op, check, expr)
+#define ATOMIC_ENTRY(op, expr, src) [OP_##op][MODE_##src] = K_##op##_##src,
+#define ATOMIC_ENTRIES(op, expr)     ATOMIC_MODES(ATOMIC_ENTRY, op, expr)
+#define OP_ENTRY(op, expr)           [OP_##op] = K_##op,
+
+static const Kind binary_kinds[NUM_INSTRUCTIONS][NUM_MODES][2] = {
+    BINARY_OPS(BINARY_ENTRIES)};
+
+static const Kind atomic_kinds[NUM_INSTRUCTIONS][NUM_MODES] = {
+    ATOMIC_OPS(ATOMIC_ENTRIES)};
+
+static const Kind op_kinds[NUM_INSTRUCTIONS] = {
+    REGISTER_OPS(OP_ENTRY) JUMP_OPS(OP_ENTRY) VECTOR_OPS(OP_ENTRY)};
+
+/*
+ * DECODING
+ */
+
+static Mode source_mode(hword sem)
 {
-    switch (instr->op) {
-    case OP_NOP: {
-        break;
-    }
-    case OP_MOV: {
-        qword src  = 0;
-        qword *dst = NULL;
-        int type   = set_operands(vm, instr, &src, &dst);
-
-        *dst       = src;
-        set_flags(vm, instr->dst, type);
-        break;
-    }
-    case OP_PSH: {
-        if (instr->sem & IS_DST_REG)
-            *vm->sp++ = vm->r[instr->dst];
-        else if (instr->sem & IS_SRC_REG)
-            *vm->sp++ = vm->r[instr->src];
-        else if (instr->sem & IS_DST_MEM)
-            *vm->sp++ = vm->memory[instr->dst];
-        else if (instr->sem & IS_SRC_MEM)
-            *vm->sp++ = vm->memory[instr->src];
-        else if (instr->sem & IS_SRC_IMM)
-            *vm->sp++ = instr->src;
-
-        break;
-    }
-    case OP_POP: {
-        if (instr->sem & IS_DST_REG)
-            vm->r[instr->dst] = *--vm->sp;
-        else if (instr->sem & IS_DST_MEM)
-            vm->memory[instr->dst] = *--vm->sp;
-        break;
-    }
-    case OP_ADD: {
-        qword src  = 0;
-        qword *dst = NULL;
-        int type   = set_operands(vm, instr, &src, &dst);
-
-        *dst += src;
-        set_flags(vm, instr->dst, type);
-        break;
-    }
-    case OP_SUB: {
-        qword src  = 0;
-        qword *dst = NULL;
-        int type   = set_operands(vm, instr, &src, &dst);
+    if (sem & IS_SRC_REG)
+        return MODE_REG;
+    if (sem & IS_SRC_MEM)
+        return MODE_MEM;
+    if (sem & IS_SRC_IREG)
+        return MODE_IREG;
+    return MODE_IMM;
+}
 
-        *dst -= src;
-        set_flags(vm, instr->dst, type);
-        break;
-    }
-    case OP_MUL: {
-        qword src  = 0;
-        qword *dst = NULL;
-        int type   = set_operands(vm, instr, &src, &dst);
+static Mode destination_mode(hword sem)
+{
+    return (sem & IS_DST_REG) ? MODE_REG : MODE_MEM;
+}
 
-        *dst *= src;
-        set_flags(vm, instr->dst, type);
-        break;
+static bool operand_valid(const VM *vm, Mode mode, qword operand)
+{
+    switch (mode) {
+    case MODE_REG:
+    case MODE_IREG:
+        return operand < NUM_REGISTERS;
+    case MODE_MEM:
+        return operand < vm->memory_size;
+    default:
+        return true;
     }
-    case OP_DIV: {
-        qword src  = 0;
-        qword *dst = NULL;
-        int type   = set_operands(vm, instr, &src, &dst);
-
-        if (src == 0)
-            return E_DIV_BY_ZERO;
+}
 
-        *dst /= src;
-        set_flags(vm, instr->dst, type);
-        break;
+// Pick the handler specialized for the addressing mode of the instruction,
+// operands out of range are only reported if the instruction is ever run
+static Kind select_kind(const VM *vm, Decoded_Instruction *d)
+{
+    Mode src = source_mode(d->sem);
+    Mode dst = destination_mode(d->sem);
+
+    switch (d->op) {
+    case OP_MOV:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+    case OP_CMP:
+        if (!operand_valid(vm, src, d->src) || !operand_valid(vm, dst, d->dst))
+            return K_FAULT;
+        return binary_kinds[d->op][src][dst];
+    case OP_AND:
+    case OP_BOR:
+    case OP_XOR:
+    case OP_NOT:
+    case OP_SHL:
+    case OP_SHR:
+        if (!operand_valid(vm, MODE_REG, d->src) ||
+            !operand_valid(vm, MODE_REG, d->dst))
+            return K_FAULT;
+        return op_kinds[d->op];
+    case OP_JMP:
+    case OP_JEQ:
+    case OP_JNE:
+    case OP_JLE:
+    case OP_JLT:
+    case OP_JGE:
+    case OP_JGT:
+        return d->dst <= vm->code_length ? op_kinds[d->op] : K_FAULT;
+    case OP_CALL:
+        return d->dst <= vm->code_length ? K_CALL : K_FAULT;
+    case OP_INC:
+    case OP_DEC:
+        // INC and DEC tell memory by the source flag
+        dst = (d->sem & IS_SRC_MEM) ? MODE_MEM : MODE_REG;
+        if (!operand_valid(vm, dst, d->dst))
+            return K_FAULT;
+        if (d->op == OP_INC)
+            return dst == MODE_MEM ? K_INC_MEM : K_INC_REG;
+        return dst == MODE_MEM ? K_DEC_MEM : K_DEC_REG;
+    case OP_PSH:
+        if (d->sem & (IS_DST_REG | IS_DST_MEM))
+            d->src = d->dst;
+        src = (d->sem & IS_DST_REG)   ? MODE_REG
+              : (d->sem & IS_SRC_REG) ? MODE_REG
+              : (d->sem & IS_DST_MEM) ? MODE_MEM
+              : (d->sem & IS_SRC_MEM) ? MODE_MEM
+              : (d->sem & IS_SRC_IMM) ? MODE_IMM
+                                      : NUM_MODES;
+        if (src == NUM_MODES)
+            return K_NOP;
+        if (!operand_valid(vm, src, d->src))
+            return K_FAULT;
+        return src == MODE_REG ? K_PSH_REG
+               : src == MODE_MEM ? K_PSH_MEM
+                                 : K_PSH_IMM;
+    case OP_POP:
+        if (!(d->sem & (IS_DST_REG | IS_DST_MEM)))
+            return K_NOP;
+        if (!operand_valid(vm, dst, d->dst))
+            return K_FAULT;
+        return dst == MODE_REG ? K_POP_REG : K_POP_MEM;
+    case OP_NOP:
+        return K_NOP;
+    case OP_CLF:
+        return K_CLF;
+    case OP_RET:
+        return K_RET;
+    case OP_SYSCALL:
+        return K_SYSCALL;
+    case OP_HLT:
+        return K_HLT;
+    case OP_VADD:
+    case OP_VSUB:
+    case OP_VMUL:
+    case OP_VAND:
+    case OP_VXOR:
+    case OP_VCEQ:
+    case OP_VCGT:
+        if (src != MODE_REG || dst != MODE_REG || d->src >= NUM_VREGISTERS ||
+            d->dst >= NUM_VREGISTERS)
+            return K_FAULT;
+        return op_kinds[d->op];
+    case OP_VSUM:
+        if (src != MODE_REG || dst != MODE_REG || d->src >= NUM_VREGISTERS ||
+            d->dst >= NUM_REGISTERS)
+            return K_FAULT;
+        return K_VSUM;
+    case OP_VLD:
+    case OP_VST:
+        // The vector register comes first, the address second for both, an
+        // indirect one is checked when it's used
+        if (dst != MODE_REG || d->dst >= NUM_VREGISTERS)
+            return K_FAULT;
+        if (src == MODE_MEM && d->src <= vm->memory_size - VECTOR_LANES)
+            return d->op == OP_VLD ? K_VLD_MEM : K_VST_MEM;
+        if (src == MODE_IREG && d->src < NUM_REGISTERS)
+            return d->op == OP_VLD ? K_VLD_IREG : K_VST_IREG;
+        return K_FAULT;
+    case OP_SPAWN:
+        // The register gets the id, the address is where the thread starts
+        if (dst != MODE_REG || !operand_valid(vm, dst, d->dst) ||
+            src != MODE_MEM || d->src > vm->code_length)
+            return K_FAULT;
+        return K_SPAWN;
+    case OP_JOIN:
+        if (dst != MODE_REG || !operand_valid(vm, dst, d->dst))
+            return K_FAULT;
+        return K_JOIN;
+    case OP_XADD:
+    case OP_XCHG:
+    case OP_CMPXCHG:
+        // Register first, then the address as with VLD
+        if (dst != MODE_REG || !operand_valid(vm, dst, d->dst) ||
+            (src != MODE_MEM && src != MODE_IREG) ||
+            !operand_valid(vm, src, d->src))
+            return K_FAULT;
+        return atomic_kinds[d->op][src];
+    case OP_MOVQ:
+        // Wide immediates only go to registers
+        if (d->sem != IS_SEM_IMM_REG || !operand_valid(vm, dst, d->dst))
+            return K_FAULT;
+        return K_MOVQ;
+    default:
+        return K_UNKNOWN;
     }
-    case OP_MOD: {
-        qword src  = 0;
-        qword *dst = NULL;
-        int type   = set_operands(vm, instr, &src, &dst);
+}
 
-        *dst %= src;
-        set_flags(vm, instr->dst, type);
-        break;
-    }
-    case OP_INC: {
-        int is_src_mem = (instr->sem & IS_SRC_MEM);
-        if (is_src_mem)
-            vm->memory[instr->dst]++;
-        else
-            vm->r[instr->dst]++;
-
-        set_flags(vm, instr->dst, is_src_mem);
-        break;
-    }
-    case OP_DEC: {
-        int is_src_mem = (instr->sem & IS_SRC_MEM);
-        if (is_src_mem)
-            vm->memory[instr->dst]--;
-        else
-            vm->r[instr->dst]--;
-
-        set_flags(vm, instr->dst, is_src_mem);
+bool vm_operand_modes(const Decoded_Instruction *i, Mode *src, Mode *dst)
+{
+    if (i->kind == K_FAULT || i->kind == K_UNKNOWN || i->kind == K_NOP)
+        return false;
+
+    *src = source_mode(i->sem);
+    *dst = destination_mode(i->sem);
+    switch (i->op) {
+    case OP_INC:
+    case OP_DEC:
+        *dst = (i->sem & IS_SRC_MEM) ? MODE_MEM : MODE_REG;
         break;
-    }
-    case OP_CLF: {
-        clear_flags(vm);
+    case OP_PSH:
+        *src = i->kind == K_PSH_REG   ? MODE_REG
+               : i->kind == K_PSH_MEM ? MODE_MEM
+                                      : MODE_IMM;
         break;
     }
-    case OP_CMP: {
-        qword src  = 0;
-        qword *dst = NULL;
-        int type   = set_operands(vm, instr, &src, &dst);
+    return true;
+}
 
-        set_flags(vm, instr->dst, type);
-        break;
-    }
-    case OP_JMP: {
-        vm->pc = instr->dst;
-        break;
-    }
-    case OP_JEQ: {
-        if (vm->flags[FL_ZRO])
-            vm->pc = instr->dst;
-        break;
-    }
-    case OP_JNE: {
-        if (!vm->flags[FL_ZRO])
-            vm->pc = instr->dst;
-        break;
-    }
-    case OP_JLE: {
-        if (vm->flags[FL_ZRO] || vm->flags[FL_NEG])
-            vm->pc = instr->dst;
-        break;
-    }
-    case OP_JLT: {
-        if (!vm->flags[FL_ZRO] && vm->flags[FL_NEG])
-            vm->pc = instr->dst;
-        break;
-    }
-    case OP_JGE: {
-        if (vm->flags[FL_ZRO] || vm->flags[FL_POS])
-            vm->pc = instr->dst;
-        break;
-    }
-    case OP_JGT: {
-        if (!vm->flags[FL_ZRO] && vm->flags[FL_POS])
-            vm->pc = instr->dst;
-        break;
-    }
-    case OP_AND: {
-        vm->r[instr->dst] &= vm->r[instr->src];
-        break;
-    }
-    case OP_BOR: {
-        vm->r[instr->dst] |= vm->r[instr->src];
-        break;
-    }
-    case OP_XOR: {
-        vm->r[instr->dst] ^= vm->r[instr->src];
-        break;
-    }
-    case OP_NOT: {
-        vm->r[instr->dst] = -vm->r[instr->src];
-        break;
-    }
-    case OP_SHR: {
-        vm->r[instr->dst] >>= vm->r[instr->src];
-        break;
-    }
-    case OP_SHL: {
-        vm->r[instr->dst] <<= vm->r[instr->src];
-        break;
-    }
-    case OP_CALL: {
-        *vm->sp++ = (vm->pc - 1);
-        vm->pc    = instr->dst;
-        break;
-    }
-    case OP_RET: {
-        vm->pc = *--vm->sp;
-        break;
-    }
-    case OP_SYSCALL: {
-        switch (vm->r[R_BX]) {
-        // STDIN
-        case 0:
-            syscall_read(vm->r[R_BX], &vm->memory[vm->r[R_CX]],
-                         vm->r[R_DX] * sizeof(qword));
-            break;
-        // STDOUT
-        case 1:
-            syscall_write(vm->r[R_BX], &vm->memory[vm->r[R_CX]],
-                          vm->r[R_DX] * sizeof(qword));
-            fflush(stdout);
-            break;
-        case 64:
-            vm->r[R_AX] = syscall_atoi(&vm->memory[vm->r[R_CX]]);
-            break;
+// Decode every instruction ahead of time, a trailing HLT stops programs running
+// off the end of the code. The literal of a wide instruction becomes its
+// immediate, the word holding it faults if jumped to as does a wide
+// instruction cut short by the end of the code
+static int predecode(VM *vm, const qword *code, size_t length)
+{
+    vm->code = calloc(length + 1, sizeof(*vm->code));
+    if (!vm->code)
+        return -1;
+
+    vm->code_length = length;
+    for (size_t n = 0; n < length; ++n) {
+        struct instruction_line i = bc_decode_instruction(code[n]);
+        Decoded_Instruction *d    = &vm->code[n];
+
+        d->op                     = i.op;
+        d->sem                    = i.sem;
+        d->src                    = i.src;
+        d->dst                    = i.dst;
+        d->imm                    = sign_extend(i.src, 27);
+        d->kind                   = select_kind(vm, d);
+
+        if (bc_instruction_words(i.op) == 2) {
+            if (n + 1 == length) {
+                d->kind = K_FAULT;
+                break;
+            }
+            d->imm           = code[++n];
+            vm->code[n].op   = i.op;
+            vm->code[n].kind = K_FAULT;
         }
-        break;
-    }
-    case OP_HLT:
-        vm->run = false;
-        break;
-    default:
-        return E_UNKNOWN_INSTRUCTION;
     }
+    vm->code[length].op   = OP_HLT;
+    vm->code[length].kind = K_HLT;
+
+    return 0;
+}
 
-    return SUCCESS;
+// Guest memory is reserved but not committed, pages are zero-filled by the
+// kernel on first touch so a large memory costs nothing until it's used
+static qword *map_memory(size_t memory_size)
+{
+    void *memory = mmap(NULL, memory_size * sizeof(qword),
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return memory == MAP_FAILED ? NULL : memory;
 }
 
 VM *vm_create(const Byte_Code *bc, size_t memory_size)
 {
+    // Room for the address table and the data segment, in bytes it must still
+    // fit a size_t
+    if (memory_size > SIZE_MAX / sizeof(qword) ||
+        memory_size < DATA_OFFSET * 2 ||
+        memory_size < DATA_OFFSET + bc_data_addr(bc))
+        return NULL;
+
     VM *vm = malloc(sizeof(*vm));
     if (!vm)
         return NULL;
 
-    vm->memory = malloc(memory_size * sizeof(qword));
-    if (!vm->memory) {
+    vm->memory      = map_memory(memory_size);
+    vm->memory_size = memory_size;
+    vm->map_top     = memory_size;
+    vm->vector      = vector_ops();
+    pthread_mutex_init(&vm->map_lock, NULL);
+    vm->root        = vm;
+    vm->threads     = NULL;
+    if (!vm->memory ||
+        predecode(vm, bc_code(bc), bc->code_segment->length) < 0) {
+        if (vm->memory)
+            munmap(vm->memory, memory_size * sizeof(qword));
+        pthread_mutex_destroy(&vm->map_lock);
         free(vm);
         return NULL;
     }
 
-    reset(vm, bc_code(bc), bc_data(bc), bc_data_addr(bc), memory_size);
+    reset(vm, bc_data(bc), bc_data_addr(bc));
     vm->pc = bc->entrypoint;
 
     return vm;
@@ -326,33 +521,133 @@ VM *vm_create(const Byte_Code *bc, size_t memory_size)
 
 void vm_free(VM *vm)
 {
-    free(vm->memory);
+    thread_join_all(vm);
+    free(vm->code);
+    munmap(vm->memory, vm->memory_size * sizeof(qword));
+    pthread_mutex_destroy(&vm->map_lock);
     free(vm);
 }
 
-void vm_reset(VM *vm, qword *code, hword *data, size_t data_len,
-              size_t memory_size)
+void vm_reset(VM *vm, hword *data, size_t data_len)
 {
-    reset(vm, code, data, data_len, memory_size);
+    thread_join_all(vm);
+    reset(vm, data, data_len);
 }
 
-Exec_Result vm_run(VM *vm)
-{
-    Exec_Result r = SUCCESS;
-    vm->run       = true;
-    while (vm->run && r == SUCCESS) {
-        qword encoded_instr           = fetch(vm);
-        struct instruction_line instr = decode(encoded_instr);
-        r                             = execute(vm, &instr);
-    }
-
-    return r;
-}
+// Threaded dispatch: every handler ends jumping straight to the next one
+// through its own indirect branch, which the predictor tells apart from the
+// others. Computed goto where the compiler supports it, the __extension__
+// keeps -pedantic quiet, a switch otherwise
+#if defined(__GNUC__) && !defined(NO_THREADED_DISPATCH)
+#define THREADED_DISPATCH
+#endif
+
+#define NEXT()                                                                 \
+    do {                                                                       \
+        ++i;                                                                   \
+        DISPATCH();                                                            \
+    } while (0)
+
+#define JUMP(to)                                                               \
+    do {                                                                       \
+        i = (to);                                                              \
+        DISPATCH();                                                            \
+    } while (0)
+
+// HLT and errors leave the dispatch out of band
+#define FAIL(r)                                                                \
+    do {                                                                       \
+        vm->result = (r);                                                      \
+        goto stop;                                                             \
+    } while (0)
+
+#define RUN_BINARY(op, check, expr, src, dst)                                  \
+    HANDLER(K_##op##_##src##_##dst)                                            \
+    {                                                                          \
+        qword s = SRC_##src;                                                   \
+        qword d = DST_##dst;                                                   \
+        (void)d;                                                               \
+        if (check && s == 0)                                                   \
+            FAIL(E_DIV_BY_ZERO);                                               \
+        DST_##dst = (expr);                                                    \
+        set_flags(vm, DST_##dst);                                              \
+        NEXT();                                                                \
+    }
+
+#define RUN_BINARY_MODES(op, check, expr)                                      \
+    BINARY_MODES(RUN_BINARY, op, check, expr)
+
+#define RUN_REGISTER(op, expr)                                                 \
+    HANDLER(K_##op)                                                            \
+    {                                                                          \
+        qword s = vm->r[i->src];                                               \
+        qword d = vm->r[i->dst];                                               \
+        (void)d;                                                               \
+        vm->r[i->dst] = (expr);                                                \
+        NEXT();                                                                \
+    }
+
+#define RUN_JUMP(op, cond)                                                     \
+    HANDLER(K_##op)                                                            \
+    {                                                                          \
+        if (cond)                                                              \
+            JUMP(&vm->code[i->dst]);                                           \
+        NEXT();                                                                \
+    }
+
+#define RUN_STEP(op, delta, dst)                                               \
+    HANDLER(K_##op##_##dst)                                                    \
+    {                                                                          \
+        DST_##dst += (delta);                                                  \
+        set_flags(vm, DST_##dst);                                              \
+        NEXT();                                                                \
+    }
+
+#define RUN_VECTOR(op, fn)                                                     \
+    HANDLER(K_##op)                                                            \
+    {                                                                          \
+        vm->vector->fn(vm->v[i->dst].lane, vm->v[i->src].lane);                \
+        NEXT();                                                                \
+    }
+
+#define RUN_ATOMIC(op, expr, src)                                              \
+    HANDLER(K_##op##_##src)                                                    \
+    {                                                                          \
+        if (ADDR_##src >= vm->memory_size)                                     \
+            FAIL(E_INVALID_OPERAND);                                           \
+        _Atomic qword *m = (_Atomic qword *)&vm->memory[ADDR_##src];           \
+        qword r          = DST_REG;                                            \
+        DST_REG          = (expr);                                             \
+        NEXT();                                                                \
+    }
+
+#define RUN_ATOMIC_MODES(op, expr) ATOMIC_MODES(RUN_ATOMIC, op, expr)
+
+#define BINARY_LABEL(op, check, expr, src, dst) LABEL(K_##op##_##src##_##dst)
+#define BINARY_LABELS(op, check, expr)                                         \
+    BINARY_MODES(BINARY_LABEL, op, check, expr)
+#define ATOMIC_LABEL(op, expr, src) LABEL(K_##op##_##src)
+#define ATOMIC_LABELS(op, expr)     ATOMIC_MODES(ATOMIC_LABEL, op, expr)
+#define OP_LABEL(op, expr)          LABEL(K_##op)
+#define STEP_LABEL(op, delta, dst)  LABEL(K_##op##_##dst)
+#define OTHER_LABEL(name)           LABEL(K_##name)
+
+#define VM_RUN_NAME vm_run
+#define VM_RUN_STEP 0
+#include "vm_run.h"
+#undef VM_RUN_NAME
+#undef VM_RUN_STEP
+
+#define VM_RUN_NAME vm_step
+#define VM_RUN_STEP 1
+#include "vm_run.h"
+#undef VM_RUN_NAME
+#undef VM_RUN_STEP
 
 void vm_print_registers(const VM *const vm)
 {
     printf("AX: %lli BX: %lli CX: %lli DX: %lli FL_ZRO: %i FL_NEG: %i FL_POS: "
            "%i\n",
            vm->r[R_AX], vm->r[R_BX], vm->r[R_CX], vm->r[R_DX],
-           vm->flags[FL_ZRO], vm->flags[FL_NEG], vm->flags[FL_POS]);
+           flag(vm, FL_ZRO), flag(vm, FL_NEG), flag(vm, FL_POS));
 }
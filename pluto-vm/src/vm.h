@@ -2,35 +2,85 @@
 #define VM_H
 
 #include "bytecode.h"
+#include "vector.h"
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 
 #define STACK_SIZE 2048
 
-typedef enum { SUCCESS, E_DIV_BY_ZERO, E_UNKNOWN_INSTRUCTION } Exec_Result;
+typedef enum {
+    SUCCESS,
+    E_DIV_BY_ZERO,
+    E_UNKNOWN_INSTRUCTION,
+    E_INVALID_OPERAND
+} Exec_Result;
 typedef enum { FL_ZRO, FL_NEG, FL_POS } Flag;
+typedef enum { MODE_REG, MODE_MEM, MODE_IMM, MODE_IREG, NUM_MODES } Mode;
+
+// Instruction decoded once by vm_create, `kind` selects the handler of vm_run
+// specialized on both the opcode and the addressing mode, the operands are
+// accessed without looking at `sem` again. `imm` is the sign extended
+// immediate source
+typedef struct decoded_instruction {
+    qword imm;
+    qword src;
+    uint32_t dst;
+    uint16_t kind;
+    hword op;
+    hword sem;
+} Decoded_Instruction;
+
+// Threads spawned by a program
+typedef struct threads Threads;
 
 typedef struct vm_s {
-    qword *bcode;
+    Decoded_Instruction *code;
+    size_t code_length;
     qword *memory;
+    size_t memory_size;
+    // Files mapped by the program are stacked down from the top of memory to
+    // map_top, never below the end of the data segment map_floor. Threads
+    // move map_top of the root VM holding its map_lock
+    size_t map_top;
+    size_t map_floor;
+    pthread_mutex_t map_lock;
     qword stack[STACK_SIZE];
     // Registers
     qword pc;
     qword *sp;
     qword r[NUM_REGISTERS];
-    // Flags
-    uint8_t flags[3];
+    Vector v[NUM_VREGISTERS];
+    // Host implementation of the vector instructions
+    const Vector_Ops *vector;
+    // Flags, computed from the last result setting them when needed
+    qword last_result;
+    bool flags_clear;
     bool run;
+    Exec_Result result;
+    // VM the program started on, holding what its threads share: the map
+    // range and the threads table
+    struct vm_s *root;
+    Threads *threads;
 } VM;
 
 VM *vm_create(const Byte_Code *bc, size_t memory_size);
 
 void vm_free(VM *vm);
 
-void vm_reset(VM *vm, qword *code, hword *data, size_t len, size_t memory_size);
+// Reset registers, stack and memory, the VM keeps running the program it was
+// created with
+void vm_reset(VM *vm, hword *data, size_t len);
 
 Exec_Result vm_run(VM *vm);
 
+// Run the instruction at vm->pc alone, `run` is cleared by HLT or an error
+Exec_Result vm_step(VM *vm);
+
+// Addressing modes of the operands of a decoded instruction, false if it only
+// faults or if it has no operand to access
+bool vm_operand_modes(const Decoded_Instruction *i, Mode *src, Mode *dst);
+
 void vm_print_registers(const VM *const vm);
 
 #endif // VM_H
@@ -0,0 +1,235 @@
+// Body of the register interpreter, included twice by vm.c: as the threaded
+// loop of vm_run and, with VM_RUN_STEP set, as vm_step which runs a single
+// instruction through a switch over the same handlers. No include guard on
+// purpose
+//
+// Run from vm->pc up to HLT or an error, leaving vm->pc past the instruction
+// that stopped. A step leaves vm->pc on the next instruction to run instead
+#if !VM_RUN_STEP && defined(THREADED_DISPATCH)
+#define LABEL(kind)   [kind] = __extension__ &&L_##kind,
+#define HANDLER(kind) L_##kind:
+#define DISPATCH()    __extension__({ goto *labels[i->kind]; })
+#elif VM_RUN_STEP
+#define HANDLER(kind) case kind:
+#define DISPATCH()    goto next
+#else
+#define HANDLER(kind) case kind:
+#define DISPATCH()    goto dispatch
+#endif
+
+Exec_Result VM_RUN_NAME(VM *vm)
+{
+#ifdef LABEL
+    static const void *const labels[NUM_KINDS] = {
+        BINARY_OPS(BINARY_LABELS) REGISTER_OPS(OP_LABEL) JUMP_OPS(OP_LABEL)
+            STEP_OPS(STEP_LABEL) VECTOR_OPS(OP_LABEL)
+                ATOMIC_OPS(ATOMIC_LABELS) OTHER_KINDS(OTHER_LABEL)};
+#endif
+    const Decoded_Instruction *i = &vm->code[vm->pc];
+    vm->run                      = true;
+    vm->result                   = SUCCESS;
+
+#ifdef LABEL
+    DISPATCH();
+#else
+#if !VM_RUN_STEP
+dispatch:
+#endif
+    switch (i->kind) {
+#endif
+    BINARY_OPS(RUN_BINARY_MODES)
+    REGISTER_OPS(RUN_REGISTER)
+    JUMP_OPS(RUN_JUMP)
+    STEP_OPS(RUN_STEP)
+    VECTOR_OPS(RUN_VECTOR)
+    ATOMIC_OPS(RUN_ATOMIC_MODES)
+
+    // The operand of PSH is always moved to `src` when decoding, unlike the
+    // other instructions PSH takes the immediate as encoded
+    HANDLER(K_PSH_REG)
+    {
+        *vm->sp++ = SRC_REG;
+        NEXT();
+    }
+    HANDLER(K_PSH_MEM)
+    {
+        *vm->sp++ = SRC_MEM;
+        NEXT();
+    }
+    HANDLER(K_PSH_IMM)
+    {
+        *vm->sp++ = i->src;
+        NEXT();
+    }
+    HANDLER(K_POP_REG)
+    {
+        DST_REG = *--vm->sp;
+        NEXT();
+    }
+    HANDLER(K_POP_MEM)
+    {
+        DST_MEM = *--vm->sp;
+        NEXT();
+    }
+    HANDLER(K_NOP)
+    {
+        NEXT();
+    }
+    HANDLER(K_CLF)
+    {
+        clear_flags(vm);
+        NEXT();
+    }
+    HANDLER(K_CALL)
+    {
+        PROBE4(call, i - vm->code, i->op, vm->sp - vm->stack, i->dst);
+        *vm->sp++ = i - vm->code;
+        JUMP(&vm->code[i->dst]);
+    }
+    HANDLER(K_RET)
+    {
+        PROBE4(ret, i - vm->code, i->op, vm->sp - vm->stack, vm->sp[-1]);
+        qword addr = *--vm->sp;
+        if (addr > vm->code_length)
+            FAIL(E_INVALID_OPERAND);
+        JUMP(&vm->code[addr]);
+    }
+    HANDLER(K_SYSCALL)
+    {
+        PROBE4(syscall, i - vm->code, i->op, vm->sp - vm->stack, vm->r[R_BX]);
+        switch (vm->r[R_BX]) {
+        // STDIN
+        case 0:
+            syscall_read(vm->r[R_BX], &vm->memory[vm->r[R_CX]],
+                         vm->r[R_DX] * sizeof(qword));
+            break;
+        // STDOUT
+        case 1:
+            syscall_write(vm->r[R_BX], &vm->memory[vm->r[R_CX]],
+                          vm->r[R_DX] * sizeof(qword));
+            fflush(stdout);
+            break;
+        // I/O ring
+        case 2:
+            vm->r[R_AX] = ring_submit(vm->memory, vm->memory_size,
+                                      vm->r[R_CX], vm->r[R_DX]);
+            fflush(stdout);
+            break;
+        // Map a file copy-on-write, threads share the range below map_top
+        case 3: {
+            qword length = 0;
+            pthread_mutex_lock(&vm->root->map_lock);
+            vm->r[R_AX] = syscall_map(vm->memory, vm->memory_size,
+                                      &vm->root->map_top, vm->root->map_floor,
+                                      vm->r[R_CX], &length);
+            pthread_mutex_unlock(&vm->root->map_lock);
+            vm->r[R_DX] = length;
+            break;
+        }
+        // Sleep while the qword at CX holds DX
+        case 4:
+            vm->r[R_AX] = vm->r[R_CX] < vm->memory_size
+                              ? thread_wait(&vm->memory[vm->r[R_CX]],
+                                            vm->r[R_DX])
+                              : -EFAULT;
+            break;
+        // Wake up to DX threads sleeping on CX
+        case 5:
+            vm->r[R_AX] = vm->r[R_CX] < vm->memory_size
+                              ? thread_wake(&vm->memory[vm->r[R_CX]],
+                                            vm->r[R_DX])
+                              : -EFAULT;
+            break;
+        case 64:
+            vm->r[R_AX] = syscall_atoi(&vm->memory[vm->r[R_CX]]);
+            break;
+        }
+        NEXT();
+    }
+    HANDLER(K_HLT)
+    {
+        PROBE3(halt, i - vm->code, i->op, vm->sp - vm->stack);
+        goto stop;
+    }
+    // Vector loads and stores move VECTOR_LANES consecutive qwords, a memory
+    // address was checked when decoding
+    HANDLER(K_VLD_MEM)
+    {
+        memcpy(vm->v[i->dst].lane, &SRC_MEM, sizeof(Vector));
+        NEXT();
+    }
+    HANDLER(K_VLD_IREG)
+    {
+        if (SRC_REG > vm->memory_size - VECTOR_LANES)
+            FAIL(E_INVALID_OPERAND);
+        memcpy(vm->v[i->dst].lane, &SRC_IREG, sizeof(Vector));
+        NEXT();
+    }
+    HANDLER(K_VST_MEM)
+    {
+        memcpy(&SRC_MEM, vm->v[i->dst].lane, sizeof(Vector));
+        NEXT();
+    }
+    HANDLER(K_VST_IREG)
+    {
+        if (SRC_REG > vm->memory_size - VECTOR_LANES)
+            FAIL(E_INVALID_OPERAND);
+        memcpy(&SRC_IREG, vm->v[i->dst].lane, sizeof(Vector));
+        NEXT();
+    }
+    HANDLER(K_VSUM)
+    {
+        DST_REG = vm->vector->sum(vm->v[i->src].lane);
+        set_flags(vm, DST_REG);
+        NEXT();
+    }
+    // The thread starts on a copy of the registers, see thread_spawn
+    HANDLER(K_SPAWN)
+    {
+        DST_REG = thread_spawn(vm, i->src, i->dst);
+        NEXT();
+    }
+    HANDLER(K_JOIN)
+    {
+        DST_REG = thread_join(vm, DST_REG);
+        NEXT();
+    }
+    // The literal takes the next word, execution goes on past it
+    HANDLER(K_MOVQ)
+    {
+        DST_REG = i->imm;
+        set_flags(vm, DST_REG);
+        JUMP(i + 2);
+    }
+    HANDLER(K_UNKNOWN)
+    {
+        FAIL(E_UNKNOWN_INSTRUCTION);
+    }
+    HANDLER(K_FAULT)
+    {
+        FAIL(E_INVALID_OPERAND);
+    }
+#ifndef LABEL
+    case NUM_KINDS:
+        FAIL(E_UNKNOWN_INSTRUCTION);
+    }
+#endif
+
+#if VM_RUN_STEP
+next:
+    vm->pc = i - vm->code;
+    return SUCCESS;
+#endif
+
+stop:
+    vm->run = false;
+    vm->pc  = i - vm->code + 1;
+    if (vm->result != SUCCESS)
+        PROBE4(error, i - vm->code, i->op, vm->sp - vm->stack, vm->result);
+
+    return vm->result;
+}
+
+#undef LABEL
+#undef HANDLER
+#undef DISPATCH